@@ -2,6 +2,14 @@
 
 #define AN_FACE_NAME_LIMIT 64
 
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+  #define AN_TRIM_X86 1
+  #include <immintrin.h>
+  #define AN_SSE2 __attribute__((target("sse2")))
+#else
+  #define AN_TRIM_X86 0
+#endif
+
 /* Object definition.
  */
  
@@ -9,98 +17,1309 @@ struct an_animator {
 
   // Constantish source data.
   // Frames are not required to be within the image -- we always check and repair at the last moment.
+  // The decoder gives us just the part of the file that our frames use, with its top-left at (imagex,imagey).
+  // Once it's done, we copy each distinct frame rect into (atlas), and drop the image's pixels.
+  // (image) stays, for its APNG frames. (rectv) lists what's in (atlas), so a new config can find its frames there.
   struct png_image *image;
+  int imagex,imagey;
+  uint8_t *atlas;
+  int atlasc,atlasa;
+  // Rects with the same pixels share one copy, so (atlasblockc) counts the copies actually in (atlas).
+  struct an_rect {
+    int x,y,w,h; // in file pixels
+    int p; // offset in (atlas), packed at (w*4) stride, transparent where it was outside the image
+    uint32_t crc; // of its pixels
+  } *rectv;
+  int rectc,recta;
+  int *recthashv; // Open-addressed index of (rectv) by (x,y,w,h), power-of-two length (recthasha). -1 empty.
+  int recthasha;
+  int atlasblockc;
+  int regionx,regiony,regionw,regionh; // What we asked the decoder for. (regionw) zero if the whole image.
+  int needs_image; // Config changed and uses pixels outside the region we decoded.
+  
+  // We keep one decoder for every image, it can reuse its buffers. (Not our old image's pixels: Those went away once the atlas had them.)
+  // (loading) while an image is in progress, and (load*) is the region we asked it for.
+  // If we have no image yet, (preview) is the decoder's image in progress (WEAK), once the current frame is in it,
+  // and (loadrows) counts its rows finished so far, from the top. Only then does the decoder call us per row, always on this thread.
+  struct png_decoder *decoder;
+  int loading;
+  int loadx,loady,loadw,loadh;
+  int loadrows;
+  struct png_image *preview;
   struct an_face {
-    char *name;
+    char *name; // In (cfgnamev), or static for the APNG face.
     int namec;
     int rate; // in frames, zero if unspecified
     int w,h; // zero if unspecified
     int anchor; // CTR by default
+    int apng; // Not from the config: it's the image's APNG animation. Always the last face.
     struct an_frame {
       // Optional fields (w,h,delay,anchor) are filled in at decode.
       int x,y,w,h;
       int delay; // frames
       int anchor;
-    } *framev;
-    int framec,framea;
+      int apng; // 1+index in (image->framev), if it's an APNG frame. (x,y,w,h) is then the rect it draws on the canvas.
+      int padp; // Offset in (pad) of this frame drawn at its face's size, or <0 if we don't have one.
+      int atlasp; // Offset in (atlas) of this frame's rect, or <0 if it isn't there.
+      int trimx,trimy,trimw,trimh; // Nonzero alpha in this frame at its face's size, if (trim). (trimw<0) if not measured.
+      int deltap,deltac; // Changes from the previous frame in the face's (deltav), if we keep it that way. (deltap<0) if not.
+    } *framev; // In (cfgframev), or the APNG face's own.
+    int framec;
+    int64_t *endv; // Sum of delays through each frame, so (endv[framec-1]) is the whole cycle. For seeking.
+    uint8_t *deltav; // Each frame's changes: Packed (struct an_span) headers, each followed by its pixels.
+    int deltac,deltaa;
   } *facev;
   int facec,facea;
   
+  // Config faces' names, frames, and delay sums all live in these, sized by counting the config's lines before parsing it.
+  // (cfgendv) runs parallel to (cfgframev). Each face's frames are a contiguous run. The APNG face allocates its own.
+  char *cfgnamev;
+  int cfgnamec,cfgnamea;
+  struct an_frame *cfgframev;
+  int64_t *cfgendv;
+  int cfgframec,cfgframea;
+  
+  // Open-addressed index of faces by name: (facehasha) is a power of two, each entry is a faceid or -1.
+  int *facehashv;
+  int facehasha;
+  
   // Running state.
   int faceid;
   int framep;
   int dirty; // Report a change on the next update regardless of clock (eg image changed).
-  int delay; // Counts down to next frame.
+  int64_t now; // Ticks so far.
+  int64_t due; // Tick when the next frame starts.
   
-  // Image buffer for padding.
+  // Frames that don't fit their face's box exactly, or reach outside the image, drawn once at the face's size.
+  // Rebuilt whenever the image or config changes. (buf) is for drawing them on the fly, while there's only a preview.
+  // Frames that would draw the same thing share one, so (padc) counts the distinct ones.
+  uint8_t *pad;
+  int pada,padc;
   uint8_t *buf;
   int bufa;
+  
+  // APNG playback. (canvas) has the APNG face's frames drawn on it through (canvasframe), or it's -1 if none yet.
+  // (prev) holds what a DISPOSE_PREVIOUS frame covered, so we can put it back.
+  uint8_t *canvas,*prev;
+  int canvasa,preva;
+  int canvasframe;
+  
+  // Nonzero to measure each frame's opaque bounds, so the wm can skip the transparent margins.
+  int trim;
+  
+  // With (delta>1), every (delta)th frame of a face is kept whole, and the rest only as changes from the one before.
+  // (deltabuf) is the frame (deltaframe) of face (deltafaceid) rebuilt from its keyframe, or (deltafaceid<0) if none.
+  int delta;
+  uint8_t *deltabuf;
+  int deltabufa;
+  int deltafaceid,deltaframe;
+};
+
+struct an_span {
+  int p,c; // in pixels, from the top-left of a frame at its face's size
 };
 
 /* Cleanup.
  */
  
 static void an_face_cleanup(struct an_face *face) {
-  if (face->name) free(face->name);
-  if (face->framev) free(face->framev);
+  if (face->apng) {
+    if (face->framev) free(face->framev);
+    if (face->endv) free(face->endv);
+  }
+  if (face->deltav) free(face->deltav);
+}
+
+/* Fill (endv) once the frames' delays are final.
+ */
+
+static void an_face_sum_delays(struct an_face *face) {
+  int64_t end=0;
+  int i=0;
+  for (;i<face->framec;i++) {
+    end+=(face->framev[i].delay>1)?face->framev[i].delay:1;
+    face->endv[i]=end;
+  }
 }
 
 void an_animator_del(struct an_animator *animator) {
   if (!animator) return;
   
   png_image_del(animator->image);
+  png_decoder_del(animator->decoder);
   
   if (animator->facev) {
     while (animator->facec-->0) an_face_cleanup(animator->facev+animator->facec);
     free(animator->facev);
   }
+  if (animator->cfgnamev) free(animator->cfgnamev);
+  if (animator->cfgframev) free(animator->cfgframev);
+  if (animator->cfgendv) free(animator->cfgendv);
+  if (animator->facehashv) free(animator->facehashv);
+  
+  if (animator->atlas) free(animator->atlas);
+  if (animator->rectv) free(animator->rectv);
+  if (animator->recthashv) free(animator->recthashv);
+  if (animator->pad) free(animator->pad);
+  if (animator->buf) free(animator->buf);
+  if (animator->canvas) free(animator->canvas);
+  if (animator->prev) free(animator->prev);
+  if (animator->deltabuf) free(animator->deltabuf);
+
+  free(animator);
+}
+
+/* New.
+ */
+
+struct an_animator *an_animator_new() {
+  struct an_animator *animator=calloc(1,sizeof(struct an_animator));
+  if (!animator) return 0;
+  
+  animator->faceid=0;
+  animator->canvasframe=-1;
+  animator->deltafaceid=-1;
+  
+  return animator;
+}
+
+/* Bounds of all frames, in file pixels.
+ * Returns >0 if there are any frames.
+ */
+ 
+static int an_animator_measure_frames(int *x,int *y,int *w,int *h,const struct an_animator *animator) {
+  int l=INT_MAX,t=INT_MAX,r=INT_MIN,b=INT_MIN;
+  const struct an_face *face=animator->facev;
+  int facei=animator->facec;
+  for (;facei-->0;face++) {
+    const struct an_frame *frame=face->framev;
+    int framei=face->framec;
+    for (;framei-->0;frame++) {
+      // APNG frames with pixels of their own don't need the image.
+      if (frame->apng&&animator->image->framev[frame->apng-1].image) continue;
+      if (frame->x<l) l=frame->x;
+      if (frame->y<t) t=frame->y;
+      if (frame->x+frame->w>r) r=frame->x+frame->w;
+      if (frame->y+frame->h>b) b=frame->y+frame->h;
+    }
+  }
+  if ((l>=r)||(t>=b)) {
+    *x=*y=*w=*h=0;
+    return 0;
+  }
+  *x=l;
+  *y=t;
+  *w=r-l;
+  *h=b-t;
+  return 1;
+}
+
+/* If we decoded only part of the image, and the frames reach outside that part, we need it again.
+ */
+ 
+static void an_animator_check_region(struct an_animator *animator) {
+  if (animator->image&&animator->regionw) {
+    int x,y,w,h;
+    an_animator_measure_frames(&x,&y,&w,&h,animator);
+    if (
+      (x<animator->regionx)||(y<animator->regiony)||
+      (x+w>animator->regionx+animator->regionw)||
+      (y+h>animator->regiony+animator->regionh)
+    ) animator->needs_image=1;
+  }
+}
+
+/* Grow face list for one more.
+ */
+ 
+static int an_animator_require_face(struct an_animator *animator) {
+  if (animator->facec<animator->facea) return 0;
+  int na=animator->facea?(animator->facea<<1):4;
+  if ((na<0)||(na>INT_MAX/sizeof(struct an_face))) return -1;
+  void *nv=realloc(animator->facev,sizeof(struct an_face)*na);
+  if (!nv) return -1;
+  animator->facev=nv;
+  animator->facea=na;
+  return 0;
+}
+
+/* Index faces by name.
+ * FNV-1a, and linear probing in a table at least twice the face count. With duplicate names, the first one wins.
+ * Only the config's faces are in it. The APNG face comes and goes with the image, so we check it separately.
+ */
+
+static uint32_t an_name_hash(const char *src,int srcc) {
+  uint32_t h=0x811c9dc5;
+  for (;srcc-->0;src++) h=(h^(uint8_t)*src)*0x01000193;
+  return h;
+}
+
+static int an_animator_index_faces(struct an_animator *animator) {
+  int na=16;
+  while (na<animator->facec*2) {
+    if (na>INT_MAX/sizeof(int)/2) return -1;
+    na<<=1;
+  }
+  if (na>animator->facehasha) {
+    void *nv=realloc(animator->facehashv,sizeof(int)*na);
+    if (!nv) return -1;
+    animator->facehashv=nv;
+    animator->facehasha=na;
+  }
+  memset(animator->facehashv,0xff,sizeof(int)*animator->facehasha);
+  int mask=animator->facehasha-1;
+  const struct an_face *face=animator->facev;
+  int faceid=0;
+  for (;faceid<animator->facec;faceid++,face++) {
+    int p=an_name_hash(face->name,face->namec)&mask;
+    for (;animator->facehashv[p]>=0;p=(p+1)&mask) {
+      const struct an_face *other=animator->facev+animator->facehashv[p];
+      if ((other->namec==face->namec)&&!memcmp(other->name,face->name,face->namec)) break;
+    }
+    if (animator->facehashv[p]<0) animator->facehashv[p]=faceid;
+  }
+  return 0;
+}
+
+static int an_animator_find_face(const struct an_animator *animator,const char *name,int namec) {
+  if (animator->facehasha>0) {
+    int mask=animator->facehasha-1;
+    int p=an_name_hash(name,namec)&mask;
+    for (;animator->facehashv[p]>=0;p=(p+1)&mask) {
+      int faceid=animator->facehashv[p];
+      if (faceid>=animator->facec) continue;
+      const struct an_face *face=animator->facev+faceid;
+      if ((face->namec==namec)&&!memcmp(face->name,name,namec)) return faceid;
+    }
+  }
+  if ((animator->facec>0)&&animator->facev[animator->facec-1].apng) {
+    const struct an_face *face=animator->facev+animator->facec-1;
+    if ((face->namec==namec)&&!memcmp(face->name,name,namec)) return animator->facec-1;
+  }
+  return -1;
+}
+
+/* Replace the APNG face with one for the current image, or drop it if the image isn't animated.
+ * If it's the current face, start it over.
+ */
+ 
+static char an_apng_face_name[]="apng";
+
+static int an_animator_sync_apng(struct an_animator *animator) {
+  animator->canvasframe=-1;
+  int current=0;
+  if ((animator->facec>0)&&animator->facev[animator->facec-1].apng) {
+    animator->facec--;
+    an_face_cleanup(animator->facev+animator->facec);
+    if (animator->faceid==animator->facec) current=1;
+  }
+  
+  const struct png_image *image=animator->image;
+  if (image&&(image->framec>0)) {
+    if (an_animator_require_face(animator)<0) return -1;
+    struct an_face *face=animator->facev+animator->facec;
+    memset(face,0,sizeof(struct an_face));
+    face->name=an_apng_face_name;
+    face->namec=4;
+    face->w=image->canvasw;
+    face->h=image->canvash;
+    face->anchor=AN_ANCHOR_CTR;
+    face->apng=1;
+    if (
+      !(face->framev=calloc(image->framec,sizeof(struct an_frame)))||
+      !(face->endv=malloc(sizeof(int64_t)*image->framec))
+    ) {
+      an_face_cleanup(face);
+      return -1;
+    }
+    animator->facec++;
+    const struct png_frame *src=image->framev;
+    struct an_frame *frame=face->framev;
+    for (;face->framec<image->framec;face->framec++,src++,frame++) {
+      frame->x=src->x;
+      frame->y=src->y;
+      frame->w=src->w;
+      frame->h=src->h;
+      frame->delay=((int64_t)src->delaynum*60+(src->delayden>>1))/src->delayden;
+      if (frame->delay<1) frame->delay=1;
+      frame->anchor=AN_ANCHOR_CTR;
+      frame->apng=face->framec+1;
+      frame->padp=-1;
+      frame->atlasp=-1;
+      frame->trimw=-1;
+      frame->deltap=-1;
+    }
+    an_face_sum_delays(face);
+  }
+  
+  if (current) {
+    if (animator->faceid>=animator->facec) animator->faceid=0;
+    animator->framep=0;
+    if (animator->faceid<animator->facec) animator->due=animator->now+animator->facev[animator->faceid].framev[0].delay;
+    animator->dirty=1;
+  }
+  return 0;
+}
+
+/* Index of rects by their bounds.
+ * Clearing makes room for at least (c) rects, and then an_animator_rect_slot() finds each one's slot, or the empty one to add it at.
+ */
+
+static int an_animator_clear_rect_index(struct an_animator *animator,int c) {
+  int na=16;
+  while (na<c*2) {
+    if (na>INT_MAX/sizeof(int)/2) return -1;
+    na<<=1;
+  }
+  if (na>animator->recthasha) {
+    void *nv=realloc(animator->recthashv,sizeof(int)*na);
+    if (!nv) return -1;
+    animator->recthashv=nv;
+    animator->recthasha=na;
+  }
+  memset(animator->recthashv,0xff,sizeof(int)*animator->recthasha);
+  return 0;
+}
+
+static int *an_animator_rect_slot(const struct an_animator *animator,int x,int y,int w,int h) {
+  int mask=animator->recthasha-1;
+  uint32_t k=(uint32_t)x*0x9e3779b1;
+  k=(k^(uint32_t)y)*0x85ebca6b;
+  k=(k^(uint32_t)w)*0xc2b2ae35;
+  k=(k^(uint32_t)h)*0x27d4eb2f;
+  int p=(k^(k>>15))&mask;
+  for (;animator->recthashv[p]>=0;p=(p+1)&mask) {
+    const struct an_rect *rect=animator->rectv+animator->recthashv[p];
+    if ((rect->x==x)&&(rect->y==y)&&(rect->w==w)&&(rect->h==h)) break;
+  }
+  return animator->recthashv+p;
+}
+
+/* Rebuild the index after (rectv) changed under it.
+ */
+
+static int an_animator_index_rects(struct an_animator *animator) {
+  if (an_animator_clear_rect_index(animator,animator->rectc)<0) return -1;
+  const struct an_rect *rect=animator->rectv;
+  int i=0;
+  for (;i<animator->rectc;i++,rect++) *an_animator_rect_slot(animator,rect->x,rect->y,rect->w,rect->h)=i;
+  return 0;
+}
+
+/* Find a rect in the atlas, or <0.
+ */
+ 
+static int an_animator_find_rect(const struct an_animator *animator,const struct an_frame *frame) {
+  if (animator->recthasha<1) return -1;
+  int rectid=*an_animator_rect_slot(animator,frame->x,frame->y,frame->w,frame->h);
+  if (rectid<0) return -1;
+  return animator->rectv[rectid].p;
+}
+
+/* Point each frame at its rect in the atlas, if it's there.
+ * Returns >0 if any frame that needs one isn't.
+ */
+ 
+static int an_animator_find_frames_in_atlas(struct an_animator *animator) {
+  int missing=0;
+  struct an_face *face=animator->facev;
+  int facei=animator->facec;
+  for (;facei-->0;face++) {
+    struct an_frame *frame=face->framev;
+    int framei=face->framec;
+    for (;framei-->0;frame++) {
+      if (frame->apng&&animator->image->framev[frame->apng-1].image) continue;
+      if ((frame->atlasp=an_animator_find_rect(animator,frame))<0) missing=1;
+    }
+  }
+  return missing;
+}
+
+/* Collapse rects with identical pixels to one copy, and pack the copies down to the front of the atlas.
+ * Rects are hashed by CRC in an open-addressed table. We confirm with memcmp, so collisions only cost time.
+ * Blocks only ever move toward the front, and never past one we haven't read yet.
+ */
+ 
+static int an_animator_dedupe_atlas(struct an_animator *animator) {
+  animator->atlasblockc=0;
+  if (animator->rectc<1) return 0;
+  int tablec=64;
+  while (tablec<animator->rectc<<1) {
+    if (tablec>INT_MAX/2/sizeof(int)) return -1;
+    tablec<<=1;
+  }
+  int *table=calloc(tablec,sizeof(int)); // 1+index in (rectv), or zero for empty
+  if (!table) return -1;
+  int mask=tablec-1,dstp=0,i=0;
+  struct an_rect *rect=animator->rectv;
+  for (;i<animator->rectc;i++,rect++) {
+    int size=rect->w*rect->h*4;
+    const uint8_t *src=animator->atlas+rect->p;
+    rect->crc=png_crc32(0,src,size);
+    int k=(rect->crc^(rect->w*0x9e3779b1)^rect->h)&mask;
+    for (;table[k];k=(k+1)&mask) {
+      const struct an_rect *other=animator->rectv+table[k]-1;
+      if ((other->crc!=rect->crc)||(other->w!=rect->w)||(other->h!=rect->h)) continue;
+      if (memcmp(animator->atlas+other->p,src,size)) continue;
+      break;
+    }
+    if (table[k]) {
+      rect->p=animator->rectv[table[k]-1].p;
+      continue;
+    }
+    table[k]=i+1;
+    if (dstp!=rect->p) memmove(animator->atlas+dstp,src,size);
+    rect->p=dstp;
+    dstp+=size;
+    animator->atlasblockc++;
+  }
+  free(table);
+  animator->atlasc=dstp;
+  return 0;
+}
+
+/* Copy every distinct frame rect out of the image, which we just got from the decoder, then drop its pixels.
+ * Rects are packed one after the other in playback order, so each frame is one contiguous run of memory.
+ */
+ 
+static int an_animator_build_atlas(struct an_animator *animator) {
+  struct png_image *image=animator->image;
+  animator->rectc=0;
+  animator->atlasc=0;
+  struct an_face *face=animator->facev;
+  int facei=animator->facec,framec=0;
+  for (;facei-->0;face++) framec+=face->framec;
+  if (an_animator_clear_rect_index(animator,framec)<0) return -1;
+  for (face=animator->facev,facei=animator->facec;facei-->0;face++) {
+    struct an_frame *frame=face->framev;
+    int framei=face->framec;
+    for (;framei-->0;frame++) {
+      if (frame->apng&&image->framev[frame->apng-1].image) continue;
+      int *slot=an_animator_rect_slot(animator,frame->x,frame->y,frame->w,frame->h);
+      if (*slot>=0) {
+        frame->atlasp=animator->rectv[*slot].p;
+        continue;
+      }
+      if ((frame->w<1)||(frame->h<1)||(frame->w>INT_MAX/4/frame->h)) return -1;
+      int size=frame->w*frame->h*4;
+      if (animator->atlasc>INT_MAX-size) return -1;
+      if (animator->rectc>=animator->recta) {
+        int na=animator->recta?(animator->recta<<1):32;
+        if ((na<0)||(na>INT_MAX/sizeof(struct an_rect))) return -1;
+        void *nv=realloc(animator->rectv,sizeof(struct an_rect)*na);
+        if (!nv) return -1;
+        animator->rectv=nv;
+        animator->recta=na;
+      }
+      *slot=animator->rectc;
+      struct an_rect *rect=animator->rectv+animator->rectc++;
+      rect->x=frame->x;
+      rect->y=frame->y;
+      rect->w=frame->w;
+      rect->h=frame->h;
+      rect->p=frame->atlasp=animator->atlasc;
+      animator->atlasc+=size;
+    }
+  }
+  if (animator->atlasc>animator->atlasa) {
+    void *nv=realloc(animator->atlas,animator->atlasc);
+    if (!nv) return -1;
+    animator->atlas=nv;
+    animator->atlasa=animator->atlasc;
+  }
+  
+  // Copy each rect, clipped to the image, and zero the rest.
+  const struct an_rect *rect=animator->rectv;
+  int i=animator->rectc;
+  for (;i-->0;rect++) {
+    uint8_t *dst=animator->atlas+rect->p;
+    int dststride=rect->w<<2;
+    memset(dst,0,dststride*rect->h);
+    int dstx=0,dsty=0,w=rect->w,h=rect->h;
+    int srcx=rect->x-animator->imagex,srcy=rect->y-animator->imagey;
+    if (srcx<0) { dstx-=srcx; w+=srcx; srcx=0; }
+    if (srcy<0) { dsty-=srcy; h+=srcy; srcy=0; }
+    if (srcx+w>image->w) w=image->w-srcx;
+    if (srcy+h>image->h) h=image->h-srcy;
+    if ((w<1)||(h<1)) continue;
+    const uint8_t *src=(uint8_t*)image->pixels+srcy*image->stride+(srcx<<2);
+    dst+=dsty*dststride+(dstx<<2);
+    for (;h-->0;src+=image->stride,dst+=dststride) memcpy(dst,src,w<<2);
+  }
+  
+  free(image->pixels);
+  image->pixels=0;
+  
+  // Sheets often repeat cells at different coordinates. Keep one copy of each, and point the frames at it.
+  if (an_animator_dedupe_atlas(animator)<0) return -1;
+  an_animator_find_frames_in_atlas(animator);
+  if (animator->atlasc<animator->atlasa) {
+    void *nv=realloc(animator->atlas,animator->atlasc?animator->atlasc:1);
+    if (nv) {
+      animator->atlas=nv;
+      animator->atlasa=animator->atlasc;
+    }
+  }
+  return 0;
+}
+
+/* Where a frame's pixels are: Its rect in the atlas once we have an image, or somewhere in the preview before that.
+ * (x,y) is the frame's top-left in (v), which might be outside it. (w,h) are the bounds of (v).
+ * (v) null if the frame has no pixels: It's not in the atlas, or we have nothing at all yet.
+ */
+ 
+struct an_source {
+  const uint8_t *v;
+  int x,y,w,h,stride;
+};
+
+static void an_animator_frame_source(struct an_source *src,const struct an_animator *animator,const struct an_frame *frame) {
+  memset(src,0,sizeof(struct an_source));
+  if (animator->image) {
+    if (frame->atlasp<0) return;
+    src->v=animator->atlas+frame->atlasp;
+    src->w=frame->w;
+    src->h=frame->h;
+    src->stride=frame->w<<2;
+  } else if (animator->preview) {
+    src->v=animator->preview->pixels;
+    src->x=frame->x-animator->imagex;
+    src->y=frame->y-animator->imagey;
+    src->w=animator->preview->w;
+    src->h=animator->preview->h;
+    src->stride=animator->preview->stride;
+  }
+}
+
+/* True if we can't return a pointer straight into the source for this frame.
+ * Our output size is always constant within one face, wm kind of depends on it.
+ * So if the frame's box is a different size, or reaches outside the source, we draw it into a box of the face's size.
+ */
+ 
+static int an_animator_frame_needs_pad(
+  const struct an_source *src,
+  const struct an_face *face,
+  const struct an_frame *frame
+) {
+  if ((frame->w!=face->w)||(frame->h!=face->h)) return 1;
+  if (!src->v) return 1;
+  if ((src->x<0)||(src->y<0)||(src->x+frame->w>src->w)||(src->y+frame->h>src->h)) return 1;
+  return 0;
+}
+
+/* Draw a frame at its face's size, anchored, and clipped to the source. (dst) is packed, (face->w*4) stride.
+ */
+ 
+static void an_animator_draw_pad(
+  uint8_t *dst,
+  const struct an_source *src,
+  const struct an_face *face,
+  const struct an_frame *frame
+) {
+  int dstw=face->w;
+  int dsth=face->h;
+  int dststride=dstw*4;
+  memset(dst,0,dststride*dsth);
+  if (!src->v) return;
+  
+  // Calculate and clip bounds.
+  int dstx=0;
+  int dsty=0;
+  int srcx=src->x;
+  int srcy=src->y;
+  int srcw=frame->w;
+  int srch=frame->h;
+  if (dstw!=srcw) switch (frame->anchor) {
+    case AN_ANCHOR_NW: case AN_ANCHOR_W: case AN_ANCHOR_SW: dstx=0; break;
+    case AN_ANCHOR_NE: case AN_ANCHOR_E: case AN_ANCHOR_SE: dstx=dstw-srcw; break;
+    default: dstx=(dstw>>1)-(srcw>>1);
+  }
+  if (dsth!=srch) switch (frame->anchor) {
+    case AN_ANCHOR_NW: case AN_ANCHOR_N: case AN_ANCHOR_NE: dsty=0; break;
+    case AN_ANCHOR_SW: case AN_ANCHOR_S: case AN_ANCHOR_SE: dsty=dsth-srch; break;
+    default: dsty=(dsth>>1)-(srch>>1);
+  }
+  if (srcx<0) { dstx-=srcx; srcw+=srcx; srcx=0; }
+  if (srcy<0) { dsty-=srcy; srch+=srcy; srcy=0; }
+  if (dstx<0) { srcx-=dstx; srcw+=dstx; dstx=0; }
+  if (dsty<0) { srcy-=dsty; srch+=dsty; dsty=0; }
+  if (srcx+srcw>src->w) srcw=src->w-srcx;
+  if (srcy+srch>src->h) srch=src->h-srcy;
+  if (dstx+srcw>dstw) srcw=dstw-dstx;
+  if (dsty+srch>dsth) srch=dsth-dsty;
+  if ((srcw<1)||(srch<1)) return;
+  
+  // Copy the valid range.
+  int cpc=srcw<<2;
+  const uint8_t *srcrow=src->v+srcy*src->stride+(srcx<<2);
+  uint8_t *dstrow=dst+dsty*dststride+(dstx<<2);
+  int yi=srch;
+  for (;yi-->0;srcrow+=src->stride,dstrow+=dststride) {
+    memcpy(dstrow,srcrow,cpc);
+  }
+}
+
+/* Earlier frames, in playback order, by whatever makes them interchangeable for some purpose.
+ * Open-addressed on a key of up to AN_TWIN_KEY ints, sized for every frame, so one pass finds all the twins.
+ * an_twins_slot() returns the slot holding an earlier frame with this key, or the empty one to put this frame in.
+ */
+
+#define AN_TWIN_KEY 6
+
+struct an_twins {
+  struct an_twin {
+    int key[AN_TWIN_KEY];
+    const struct an_frame *frame; // null if empty
+  } *v;
+  int mask;
+};
+
+static void an_twins_cleanup(struct an_twins *twins) {
+  if (twins->v) free(twins->v);
+}
+
+static int an_twins_init(struct an_twins *twins,const struct an_animator *animator) {
+  int framec=0,facei=animator->facec,c=16;
+  const struct an_face *face=animator->facev;
+  for (;facei-->0;face++) framec+=face->framec;
+  while (c<framec*2) {
+    if (c>INT_MAX/sizeof(struct an_twin)/2) return -1;
+    c<<=1;
+  }
+  if (!(twins->v=calloc(c,sizeof(struct an_twin)))) return -1;
+  twins->mask=c-1;
+  return 0;
+}
+
+static struct an_twin *an_twins_slot(struct an_twins *twins,const int *key) {
+  uint32_t h=0x811c9dc5;
+  int i=0;
+  for (;i<AN_TWIN_KEY;i++) h=(h^(uint32_t)key[i])*0x01000193;
+  int p=(h^(h>>16))&twins->mask;
+  for (;twins->v[p].frame;p=(p+1)&twins->mask) {
+    if (!memcmp(twins->v[p].key,key,sizeof(twins->v[p].key))) break;
+  }
+  return twins->v+p;
+}
+
+/* Draw every frame that needs it into (pad), for the current image and config.
+ * Without an image, there's nothing to draw, and any frames needing it will be drawn on the fly from the preview.
+ * On errors, likewise, they all get drawn on the fly.
+ */
+ 
+static void an_animator_drop_pads(struct an_animator *animator) {
+  struct an_face *face=animator->facev;
+  int facei=animator->facec;
+  for (;facei-->0;face++) {
+    struct an_frame *frame=face->framev;
+    int framei=face->framec;
+    for (;framei-->0;frame++) frame->padp=-1;
+  }
+}
+ 
+static int an_animator_render_pads(struct an_animator *animator) {
+  an_animator_drop_pads(animator);
+  animator->padc=0;
+  if (!animator->image) return 0;
+  
+  // Frames with the same rect, box, and anchor, in faces of the same size, draw the same pad.
+  struct an_twins twins={0};
+  if (an_twins_init(&twins,animator)<0) return -1;
+  int padc=0,facei,framei;
+  struct an_face *face;
+  struct an_frame *frame;
+  struct an_source src;
+  for (facei=animator->facec,face=animator->facev;facei-->0;face++) {
+    for (framei=face->framec,frame=face->framev;framei-->0;frame++) {
+      if (frame->apng||(frame->deltap>=0)) continue;
+      an_animator_frame_source(&src,animator,frame);
+      if (!an_animator_frame_needs_pad(&src,face,frame)) continue;
+      int key[AN_TWIN_KEY]={frame->atlasp,frame->w,frame->h,frame->anchor,face->w,face->h};
+      struct an_twin *twin=an_twins_slot(&twins,key);
+      if (twin->frame) {
+        frame->padp=twin->frame->padp;
+        continue;
+      }
+      if ((face->w<1)||(face->h<1)||(face->w>INT_MAX/4/face->h)||(padc>INT_MAX-face->w*face->h*4)) {
+        an_twins_cleanup(&twins);
+        an_animator_drop_pads(animator);
+        return -1;
+      }
+      memcpy(twin->key,key,sizeof(key));
+      twin->frame=frame;
+      frame->padp=padc;
+      padc+=face->w*face->h*4;
+      animator->padc++;
+    }
+  }
+  an_twins_cleanup(&twins);
+  if (padc>animator->pada) {
+    void *nv=realloc(animator->pad,padc);
+    if (!nv) {
+      an_animator_drop_pads(animator);
+      return -1;
+    }
+    animator->pad=nv;
+    animator->pada=padc;
+  }
+  // Pads were assigned in this same order, so the first frame to use each one is the one that sees it at (padc).
+  for (padc=0,facei=animator->facec,face=animator->facev;facei-->0;face++) {
+    for (framei=face->framec,frame=face->framev;framei-->0;frame++) {
+      if (frame->padp!=padc) continue;
+      an_animator_frame_source(&src,animator,frame);
+      an_animator_draw_pad(animator->pad+frame->padp,&src,face,frame);
+      padc+=face->w*face->h*4;
+    }
+  }
+  return 0;
+}
+
+/* First pixel with nonzero alpha in a row of (c), or (c) if none.
+ * Last pixel with nonzero alpha, or -1 if none.
+ * With SSE2, we test four pixels' alpha at a time.
+ */
+ 
+static int an_trim_level=-1; // 0=scalar, 1=sse2
+
+#if AN_TRIM_X86
+
+AN_SSE2 static int an_alpha_first_sse2(const uint8_t *row,int c) {
+  const __m128i amask=_mm_set1_epi32(0xff000000);
+  const __m128i zero=_mm_setzero_si128();
+  int x=0;
+  for (;x<=c-4;x+=4,row+=16) {
+    __m128i v=_mm_and_si128(_mm_loadu_si128((const __m128i*)row),amask);
+    int m=_mm_movemask_epi8(_mm_cmpeq_epi32(v,zero))^0xffff;
+    if (m) return x+(__builtin_ctz(m)>>2);
+  }
+  for (;x<c;x++,row+=4) if (row[3]) return x;
+  return c;
+}
+
+AN_SSE2 static int an_alpha_last_sse2(const uint8_t *row,int c) {
+  const __m128i amask=_mm_set1_epi32(0xff000000);
+  const __m128i zero=_mm_setzero_si128();
+  int x=c;
+  for (;x>=4;x-=4) {
+    __m128i v=_mm_and_si128(_mm_loadu_si128((const __m128i*)(row+((x-4)<<2))),amask);
+    int m=_mm_movemask_epi8(_mm_cmpeq_epi32(v,zero))^0xffff;
+    if (m) return x-4+((31-__builtin_clz(m))>>2);
+  }
+  while (x-->0) if (row[(x<<2)+3]) return x;
+  return -1;
+}
+
+#endif
+
+static int an_alpha_first(const uint8_t *row,int c) {
+  #if AN_TRIM_X86
+    if (an_trim_level>0) return an_alpha_first_sse2(row,c);
+  #endif
+  int x=0;
+  for (;x<c;x++,row+=4) if (row[3]) return x;
+  return c;
+}
+
+static int an_alpha_last(const uint8_t *row,int c) {
+  #if AN_TRIM_X86
+    if (an_trim_level>0) return an_alpha_last_sse2(row,c);
+  #endif
+  int x=c;
+  while (x-->0) if (row[(x<<2)+3]) return x;
+  return -1;
+}
+
+/* Bounds of nonzero alpha in an RGBA image. Zero size if it's all transparent.
+ * Rows are only searched outside the bounds found so far, so a typical frame touches each margin pixel about once.
+ */
+ 
+static void an_alpha_bounds(int *dstx,int *dsty,int *dstw,int *dsth,const uint8_t *src,int w,int h,int stride) {
+  int top=0,bottom=h-1;
+  while ((top<h)&&(an_alpha_first(src+top*stride,w)>=w)) top++;
+  if (top>=h) {
+    *dstx=*dsty=*dstw=*dsth=0;
+    return;
+  }
+  while (an_alpha_first(src+bottom*stride,w)>=w) bottom--;
+  int left=w,right=-1,y=top;
+  const uint8_t *row=src+top*stride;
+  for (;y<=bottom;y++,row+=stride) {
+    int x=an_alpha_first(row,left);
+    if (x<left) left=x;
+    if ((x=an_alpha_last(row+((right+1)<<2),w-right-1))>=0) right+=1+x;
+  }
+  *dstx=left;
+  *dsty=top;
+  *dstw=right-left+1;
+  *dsth=bottom-top+1;
+}
+
+/* Measure the opaque bounds of every frame we can, once the pads are drawn.
+ * APNG frames change with what's under them on the canvas, so they stay untrimmed, as do all frames before an image.
+ */
+ 
+static void an_animator_trim_frames(struct an_animator *animator) {
+  if (animator->trim&&(an_trim_level<0)) {
+    an_trim_level=0;
+    #if AN_TRIM_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("sse2")) an_trim_level=1;
+    #endif
+  }
+  // Frames drawing from the same pad, or unpadded from the same rect, have the same bounds.
+  // If we can't get the table, measure them all, it's only slower.
+  struct an_twins twins={0};
+  if (animator->trim&&animator->image) an_twins_init(&twins,animator);
+  struct an_face *face=animator->facev;
+  int facei=animator->facec;
+  struct an_source src;
+  for (;facei-->0;face++) {
+    struct an_frame *frame=face->framev;
+    int framei=face->framec;
+    for (;framei-->0;frame++) {
+      // Delta frames were measured as we encoded them. Their pixels aren't anywhere else.
+      if (frame->deltap>=0) {
+        if (!animator->trim) frame->trimw=-1;
+        continue;
+      }
+      frame->trimw=-1;
+      if (!animator->trim||!animator->image||frame->apng) continue;
+      int key[AN_TWIN_KEY]={0};
+      if (frame->padp>=0) key[1]=frame->padp;
+      else { key[0]=1; key[1]=frame->atlasp; }
+      struct an_twin *twin=twins.v?an_twins_slot(&twins,key):0;
+      if (twin&&twin->frame) {
+        frame->trimx=twin->frame->trimx;
+        frame->trimy=twin->frame->trimy;
+        frame->trimw=twin->frame->trimw;
+        frame->trimh=twin->frame->trimh;
+        continue;
+      }
+      if (frame->padp>=0) {
+        an_alpha_bounds(&frame->trimx,&frame->trimy,&frame->trimw,&frame->trimh,animator->pad+frame->padp,face->w,face->h,face->w<<2);
+      } else {
+        an_animator_frame_source(&src,animator,frame);
+        if (an_animator_frame_needs_pad(&src,face,frame)) continue;
+        an_alpha_bounds(
+          &frame->trimx,&frame->trimy,&frame->trimw,&frame->trimh,
+          src.v+src.y*src.stride+(src.x<<2),frame->w,frame->h,src.stride
+        );
+      }
+      if (twin) {
+        memcpy(twin->key,key,sizeof(key));
+        twin->frame=frame;
+      }
+    }
+  }
+  an_twins_cleanup(&twins);
+}
+
+int an_animator_set_trim(struct an_animator *animator,int trim) {
+  animator->trim=trim?1:0;
+  an_animator_trim_frames(animator);
+  return 0;
+}
+
+/* A frame's pixels at its face's size, packed, if they're in the pad or atlas. Null if not.
+ */
+ 
+static const uint8_t *an_animator_frame_output(
+  const struct an_animator *animator,
+  const struct an_face *face,
+  const struct an_frame *frame
+) {
+  if (frame->padp>=0) return animator->pad+frame->padp;
+  struct an_source src;
+  an_animator_frame_source(&src,animator,frame);
+  if (an_animator_frame_needs_pad(&src,face,frame)) return 0;
+  return src.v+src.y*src.stride+(src.x<<2);
+}
+
+/* Append the changes from (prev) to (next), (c) pixels each, to a face's deltas.
+ * Runs of changed pixels less than a header apart are merged, since the header would cost more than the pixels.
+ */
+ 
+static int an_face_append_delta(struct an_face *face,const uint32_t *prev,const uint32_t *next,int c) {
+  const int gap=sizeof(struct an_span)>>2;
+  int p=0;
+  while (p<c) {
+    if (prev[p]==next[p]) { p++; continue; }
+    int q=p+1,end=p+1;
+    while (q<c) {
+      if (prev[q]!=next[q]) end=++q;
+      else if (q-end>=gap) break;
+      else q++;
+    }
+    int spanc=end-p;
+    if (spanc>(INT_MAX-(int)sizeof(struct an_span))>>2) return -1;
+    int addc=sizeof(struct an_span)+(spanc<<2);
+    if (face->deltac>INT_MAX-addc) return -1;
+    if (face->deltac+addc>face->deltaa) {
+      int na=face->deltac+addc;
+      if (na<INT_MAX-65536) na=(na+65536)&~65535;
+      void *nv=realloc(face->deltav,na);
+      if (!nv) return -1;
+      face->deltav=nv;
+      face->deltaa=na;
+    }
+    struct an_span *span=(struct an_span*)(face->deltav+face->deltac);
+    span->p=p;
+    span->c=spanc;
+    memcpy(span+1,next+p,spanc<<2);
+    face->deltac+=addc;
+    p=end;
+  }
+  return 0;
+}
+
+/* Apply one frame's changes.
+ */
+ 
+static void an_face_apply_delta(uint8_t *dst,const struct an_face *face,const struct an_frame *frame) {
+  const uint8_t *src=face->deltav+frame->deltap;
+  const uint8_t *end=src+frame->deltac;
+  while (src<end) {
+    const struct an_span *span=(const struct an_span*)src;
+    src+=sizeof(struct an_span);
+    memcpy(dst+(span->p<<2),src,span->c<<2);
+    src+=span->c<<2;
+  }
+}
+
+/* Drop every rect from the atlas that only delta frames were using, and repack what's left.
+ * One pass over the frames marks the blocks still in use, one over the rects moves them down, and one more repoints the frames.
+ * (keyv,newpv) map old atlas offsets to new ones, open-addressed: (keyv) -1 if empty, (newpv) -1 until the block is moved.
+ */
+
+static int *an_offset_slot(int *keyv,int mask,int key) {
+  int p=((uint32_t)key*0x9e3779b1)>>7&mask;
+  for (;(keyv[p]>=0)&&(keyv[p]!=key);p=(p+1)&mask) ;
+  return keyv+p;
+}
+ 
+static int an_animator_drop_delta_rects(struct an_animator *animator) {
+  if (animator->rectc<1) return 0;
+  int tablec=64;
+  while (tablec<animator->rectc<<1) {
+    if (tablec>INT_MAX/2/sizeof(int)) return -1;
+    tablec<<=1;
+  }
+  int *keyv=malloc(sizeof(int)*tablec*2);
+  uint8_t *natlas=malloc(animator->atlasc?animator->atlasc:1);
+  if (!keyv||!natlas) {
+    if (keyv) free(keyv);
+    if (natlas) free(natlas);
+    return -1;
+  }
+  memset(keyv,0xff,sizeof(int)*tablec*2);
+  int *newpv=keyv+tablec,mask=tablec-1;
+  int natlasc=0,i,j,facei,framei,*slot;
+  struct an_rect *rect;
+  struct an_face *face;
+  struct an_frame *frame;
+  
+  for (facei=animator->facec,face=animator->facev;facei-->0;face++) {
+    for (framei=face->framec,frame=face->framev;framei-->0;frame++) {
+      if ((frame->deltap>=0)||(frame->atlasp<0)) continue;
+      *an_offset_slot(keyv,mask,frame->atlasp)=frame->atlasp;
+    }
+  }
+  
+  animator->atlasblockc=0;
+  for (i=j=0,rect=animator->rectv;i<animator->rectc;i++,rect++) {
+    slot=an_offset_slot(keyv,mask,rect->p);
+    if (*slot<0) continue;
+    int *newp=newpv+(slot-keyv);
+    if (*newp<0) {
+      int size=rect->w*rect->h*4;
+      memcpy(natlas+natlasc,animator->atlas+rect->p,size);
+      *newp=natlasc;
+      natlasc+=size;
+      animator->atlasblockc++;
+    }
+    animator->rectv[j]=*rect;
+    animator->rectv[j++].p=*newp;
+  }
+  animator->rectc=j;
+  
+  for (facei=animator->facec,face=animator->facev;facei-->0;face++) {
+    for (framei=face->framec,frame=face->framev;framei-->0;frame++) {
+      if (frame->atlasp<0) continue;
+      if (frame->deltap>=0) { frame->atlasp=-1; continue; }
+      slot=an_offset_slot(keyv,mask,frame->atlasp);
+      frame->atlasp=newpv[slot-keyv];
+    }
+  }
+  
+  free(keyv);
+  free(animator->atlas);
+  animator->atlas=natlas;
+  animator->atlasc=animator->atlasa=natlasc;
+  return an_animator_index_rects(animator);
+}
+
+/* Encode each face's frames as keyframes and changes, once the atlas is ready, and before the pads.
+ * If the config needs pixels we don't have, leave it alone. We'll be back when the image reloads.
+ */
+ 
+static int an_animator_encode_deltas(struct an_animator *animator) {
+  animator->deltafaceid=-1;
+  if ((animator->delta<2)||!animator->image||animator->needs_image) return 0;
+  uint8_t *prev=0,*next=0;
+  int bufa=0,err=0;
+  struct an_face *face=animator->facev;
+  int facei=animator->facec;
+  for (;facei-->0;face++) {
+    face->deltac=0;
+    if (face->apng||(face->framec<2)) continue;
+    if ((face->w<1)||(face->h<1)||(face->w>INT_MAX/4/face->h)) { err=-1; break; }
+    int size=face->w*face->h*4;
+    if (size>bufa) {
+      if (prev) free(prev);
+      if (next) free(next);
+      prev=malloc(size);
+      next=malloc(size);
+      if (!prev||!next) { err=-1; break; }
+      bufa=size;
+    }
+    struct an_frame *frame=face->framev;
+    int framei=0;
+    for (;framei<face->framec;framei++,frame++) {
+      struct an_source src;
+      an_animator_frame_source(&src,animator,frame);
+      an_animator_draw_pad(next,&src,face,frame);
+      if (framei%animator->delta) {
+        frame->deltap=face->deltac;
+        if (an_face_append_delta(face,(uint32_t*)prev,(uint32_t*)next,face->w*face->h)<0) { err=-1; break; }
+        frame->deltac=face->deltac-frame->deltap;
+        frame->trimw=-1;
+        if (animator->trim) {
+          an_alpha_bounds(&frame->trimx,&frame->trimy,&frame->trimw,&frame->trimh,next,face->w,face->h,face->w<<2);
+        }
+      }
+      uint8_t *tmp=prev;
+      prev=next;
+      next=tmp;
+    }
+    if (err<0) break;
+  }
+  if (prev) free(prev);
+  if (next) free(next);
+  if (err>=0) err=an_animator_drop_delta_rects(animator);
+  if (err<0) {
+    fprintf(stderr,"Failed to encode frames as changes.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int an_animator_set_delta(struct an_animator *animator,int keyframes) {
+  if (keyframes<0) return -1;
+  animator->delta=keyframes;
+  if (animator->image) animator->needs_image=1;
+  return 0;
+}
+
+/* Any face and frame, or the current ones, or null.
+ */
+ 
+static const struct an_face *an_animator_face_at(const struct an_animator *animator,int faceid) {
+  if ((faceid<0)||(faceid>=animator->facec)) return 0;
+  return animator->facev+faceid;
+}
+ 
+static const struct an_frame *an_animator_frame_at(const struct an_animator *animator,int faceid,int framep) {
+  const struct an_face *face=an_animator_face_at(animator,faceid);
+  if (!face) return 0;
+  if ((framep<0)||(framep>=face->framec)) return 0;
+  return face->framev+framep;
+}
+ 
+static const struct an_face *an_animator_current_face(const struct an_animator *animator) {
+  return an_animator_face_at(animator,animator->faceid);
+}
+ 
+static const struct an_frame *an_animator_current_frame(const struct an_animator *animator) {
+  return an_animator_frame_at(animator,animator->faceid,animator->framep);
+}
+
+/* How many preview rows must be finished before we can draw this frame. At least one, at most all of them.
+ */
+ 
+static int an_animator_frame_bottom(const struct an_animator *animator,const struct an_frame *frame) {
+  int bottom=frame->y+frame->h-animator->imagey;
+  if (bottom>animator->preview->h) bottom=animator->preview->h;
+  if (bottom<1) bottom=1;
+  return bottom;
+}
+
+/* True if we can draw this frame: We have a finished image, or the preview has all the rows it touches.
+ */
+ 
+static int an_animator_frame_ready(const struct an_animator *animator,const struct an_frame *frame) {
+  if (animator->image) return 1;
+  if (!animator->preview||!frame) return 0;
+  return (an_animator_frame_bottom(animator,frame)<=animator->loadrows);
+}
+
+/* Row finished decoding, while we have no image yet.
+ * Show the one in progress, and redraw as soon as the current frame is covered.
+ */
+ 
+static int an_animator_cb_row(int y,const void *row,void *userdata) {
+  struct an_animator *animator=userdata;
+  animator->loadrows=y+1;
+  if (!animator->preview) {
+    animator->preview=png_decoder_get_image(animator->decoder);
+    png_decoder_get_region(&animator->imagex,&animator->imagey,0,0,animator->decoder);
+  }
+  const struct an_frame *frame=an_animator_current_frame(animator);
+  if (frame&&(an_animator_frame_bottom(animator,frame)==animator->loadrows)) animator->dirty=1;
+  return 0;
+}
+
+/* One line about how much we share, after each image loads.
+ */
+ 
+static void an_animator_log_stats(const struct an_animator *animator,const char *path) {
+  int framec=0,deltac=0;
+  const struct an_face *face=animator->facev;
+  int facei=animator->facec;
+  for (;facei-->0;face++) {
+    const struct an_frame *frame=face->framev;
+    int framei=face->framec;
+    for (;framei-->0;frame++) if ((frame->atlasp>=0)||(frame->deltap>=0)) framec++;
+    deltac+=face->deltac;
+  }
+  int ratio=animator->atlasblockc?(int)(((int64_t)framec*100)/animator->atlasblockc):0;
+  fprintf(stderr,
+    "%s: %d frames, %d rects, %d unique (%d.%02dx), %d bytes in atlas, %d pads, %d bytes in deltas.\n",
+    path,framec,animator->rectc,animator->atlasblockc,ratio/100,ratio%100,animator->atlasc,animator->padc,deltac
+  );
+}
+
+/* Replace image, incrementally.
+ */
+ 
+int an_animator_begin_image(struct an_animator *animator) {
+  animator->loading=0;
+  animator->loadrows=0;
+  if (animator->preview) {
+    // The decoder is about to take back what we were showing.
+    animator->preview=0;
+    animator->dirty=1;
+  }
+  if (!animator->decoder) {
+    if (!(animator->decoder=png_decoder_new())) return -1;
+  } else {
+    if (png_decoder_reset(animator->decoder)<0) return -1;
+  }
   
-  if (animator->buf) free(animator->buf);
+  // The preview reads rows from the callback and draws them between pieces, so it keeps the decoder on our thread.
+  // Once we have an image there's no preview and no callback, and the decoder can take a thread if the image is big enough.
+  if (animator->image) {
+    if (png_decoder_set_threaded(animator->decoder,-1)<0) return -1;
+    if (png_decoder_set_row_callback(animator->decoder,0,0)<0) return -1;
+  } else {
+    if (png_decoder_set_threaded(animator->decoder,0)<0) return -1;
+    if (png_decoder_set_row_callback(animator->decoder,an_animator_cb_row,animator)<0) return -1;
+  }
 
-  free(animator);
+  // Image must be 32-bit RGBA. The decoder converts each row as it goes.
+  // If we have a config already, decode only the part its frames use.
+  an_animator_measure_frames(&animator->loadx,&animator->loady,&animator->loadw,&animator->loadh,animator);
+  if (
+    (png_decoder_set_format(animator->decoder,8,PNG_COLORTYPE_RGBA)<0)||
+    (png_decoder_set_region(animator->decoder,animator->loadx,animator->loady,animator->loadw,animator->loadh)<0)
+  ) {
+    return -1;
+  }
+  animator->loading=1;
+  return 0;
 }
 
-/* New.
- */
+int an_animator_provide_image(struct an_animator *animator,const void *src,int srcc) {
+  if (!animator->loading) return -1;
+  return png_decoder_provide_input(animator->decoder,src,srcc);
+}
 
-struct an_animator *an_animator_new() {
-  struct an_animator *animator=calloc(1,sizeof(struct an_animator));
-  if (!animator) return 0;
+int an_animator_end_image(struct an_animator *animator,const char *path) {
+  if (!animator->loading) return -1;
+  animator->loading=0;
+  struct png_decoder *decoder=animator->decoder;
+  if (animator->preview) {
+    // Success or failure, stop showing the work in progress. Success replaces it with the same pixels.
+    animator->preview=0;
+    animator->dirty=1;
+  }
   
-  animator->faceid=0;
+  if (png_decoder_get_status(decoder)!=PNG_DECODER_COMPLETE) {
+    const char *message=png_decoder_get_error_message(decoder);
+    if (message) fprintf(stderr,"%s: Failed to decode PNG. %s\n",path,message);
+    else fprintf(stderr,"%s: Failed to decode PNG.\n",path);
+    return -1;
+  }
+  struct png_image *image=png_decoder_get_image(decoder);
+  if ((image->colortype!=PNG_COLORTYPE_RGBA)||(image->depth!=8)) {
+    fprintf(stderr,"%s: Failed to convert image to RGBA.\n",path);
+    return -1;
+  }
+  if (png_image_ref(image)<0) return -1;
+  png_decoder_get_region(&animator->imagex,&animator->imagey,0,0,decoder);
   
-  return animator;
+  // Commit the change. The old image goes back to the decoder, so the next load can reuse its pixels.
+  png_decoder_recycle_image(decoder,animator->image);
+  animator->image=image;
+  animator->regionx=animator->loadx;
+  animator->regiony=animator->loady;
+  animator->regionw=animator->loadw;
+  animator->regionh=animator->loadh;
+  animator->needs_image=0;
+  animator->dirty=1;
+  
+  // An APNG face comes and goes with the image. If its first frame is the image itself, we might need all of it.
+  if (an_animator_sync_apng(animator)<0) return -1;
+  an_animator_check_region(animator);
+  if (an_animator_build_atlas(animator)<0) return -1;
+  if (an_animator_encode_deltas(animator)<0) return -1;
+  if (an_animator_render_pads(animator)<0) return -1;
+  an_animator_trim_frames(animator);
+  an_animator_log_stats(animator,path);
+  
+  return 0;
 }
 
-/* Replace image.
+/* Replace image, all at once.
  */
 
 int an_animator_set_image(struct an_animator *animator,const void *src,int srcc,const char *path) {
+  if (an_animator_begin_image(animator)<0) return -1;
+  an_animator_provide_image(animator,src,srcc);
+  return an_animator_end_image(animator,path);
+}
 
-  struct png_image *image=png_decode(src,srcc);
-  if (!image) {
-    fprintf(stderr,"%s: Failed to decode PNG.\n",path);
-    return -1;
-  }
-  
-  // Image must be 32-bit RGBA.
-  if ((image->colortype!=PNG_COLORTYPE_RGBA)||(image->depth!=8)) {
-    struct png_image *rgba=png_image_new();
-    if (!rgba||(png_image_convert(rgba,8,PNG_COLORTYPE_RGBA,image)<0)) {
-      fprintf(stderr,"%s: Failed to convert image to RGBA.\n",path);
-      png_image_del(image);
-      png_image_del(rgba);
-      return -1;
-    }
-    png_image_del(image);
-    image=rgba;
-  }
+/* Does the image cover what the config needs?
+ */
+ 
+int an_animator_needs_image(const struct an_animator *animator) {
+  return animator->needs_image;
+}
+
+/* With the config's faces all resolved and indexed, add the APNG face, restore the current face, and bring the image along.
+ */
+
+static int an_animator_apply_config(struct an_animator *animator,const char *name,int namec) {
   
-  // Commit the change.
-  png_image_del(animator->image);
-  animator->image=image;
-  animator->dirty=1;
+  // The image's APNG face goes after the ones we declare, and it can be the restore face too.
+  if (an_animator_sync_apng(animator)<0) return -1;
+  int faceid=an_animator_find_face(animator,name,namec);
+  if (faceid>=0) animator->faceid=faceid;
   
+  // We only kept the rects that the old frames used. If the new ones use any others, we need the image again.
+  if (animator->image&&an_animator_find_frames_in_atlas(animator)) animator->needs_image=1;
+  if (an_animator_encode_deltas(animator)<0) return -1;
+  if (an_animator_render_pads(animator)<0) return -1;
+  an_animator_trim_frames(animator);
   return 0;
 }
 
@@ -127,11 +1346,6 @@ static int an_animator_finish_config(
       return -1;
     }
   
-    // Is this the restore face?
-    if ((face->namec==namec)&&!memcmp(face->name,name,namec)) {
-      animator->faceid=faceid;
-    }
-    
     // If anchor unset, it defaults to CTR.
     if (!face->anchor) face->anchor=AN_ANCHOR_CTR;
     
@@ -167,8 +1381,11 @@ static int an_animator_finish_config(
       }
       if (!frame->anchor) frame->anchor=face->anchor;
     }
+    an_face_sum_delays(face);
   }
-  return 0;
+  if (an_animator_index_faces(animator)<0) return -1;
+  
+  return an_animator_apply_config(animator,name,namec);
 }
 
 /* Begin decoding a new face.
@@ -179,14 +1396,8 @@ static struct an_face *an_animator_begin_face(
   const char *src,int srcc
 ) {
   
-  if (animator->facec>=animator->facea) {
-    int na=animator->facea+4;
-    if (na>INT_MAX/sizeof(struct an_face)) return 0;
-    void *nv=realloc(animator->facev,sizeof(struct an_face)*na);
-    if (!nv) return 0;
-    animator->facev=nv;
-    animator->facea=na;
-  }
+  if (an_animator_require_face(animator)<0) return 0;
+  if (animator->cfgnamec>=animator->cfgnamea-srcc) return 0;
   
   if ((srcc<2)||(src[0]!='[')) return 0;
   src++; srcc--;
@@ -201,16 +1412,16 @@ static struct an_face *an_animator_begin_face(
       return 0;
     }
   }
-  int namec=srcc;
-  char *name=malloc(namec+1);
-  if (!name) return 0;
-  memcpy(name,src,namec);
-  name[namec]=0;
   
   struct an_face *face=animator->facev+animator->facec++;
   memset(face,0,sizeof(struct an_face));
-  face->name=name;
-  face->namec=namec;
+  face->name=animator->cfgnamev+animator->cfgnamec;
+  face->namec=srcc;
+  memcpy(face->name,src,srcc);
+  face->name[srcc]=0;
+  animator->cfgnamec+=srcc+1;
+  face->framev=animator->cfgframev+animator->cfgframec;
+  face->endv=animator->cfgendv+animator->cfgframec;
   
   return face;
 }
@@ -286,6 +1497,7 @@ static int an_face_set_field(
  */
  
 static int an_animator_decode_frame(
+  struct an_animator *animator,
   struct an_face *face,
   const char *src,int srcc
 ) {
@@ -317,15 +1529,9 @@ static int an_animator_decode_frame(
     if ((anchor=an_eval_anchor(src+srcp,srcc-srcp))<0) return -1;
   }
   
-  if (face->framec>=face->framea) {
-    int na=face->framea+4;
-    if (na>INT_MAX/sizeof(struct an_frame)) return -1;
-    void *nv=realloc(face->framev,sizeof(struct an_frame)*na);
-    if (!nv) return -1;
-    face->framev=nv;
-    face->framea=na;
-  }
-  
+  // The current face's frames are always the tail of (cfgframev).
+  if (animator->cfgframec>=animator->cfgframea) return -1;
+  animator->cfgframec++;
   struct an_frame *frame=face->framev+face->framec++;
   memset(frame,0,sizeof(struct an_frame));
   frame->x=x;
@@ -334,7 +1540,273 @@ static int an_animator_decode_frame(
   frame->h=h;
   frame->delay=delay;
   frame->anchor=anchor;
+  frame->padp=-1;
+  frame->atlasp=-1;
+  frame->trimw=-1;
+  frame->deltap=-1;
+  
+  return 0;
+}
+
+/* Count faces, frames, and bytes of face names in a config, before parsing it.
+ * It's only lines' first characters, so it can overcount, but never under.
+ */
+
+static void an_config_measure(int *facec,int *framec,int *namec,const char *src,int srcc) {
+  *facec=*framec=*namec=0;
+  int srcp=0;
+  while (srcp<srcc) {
+    while ((srcp<srcc)&&((unsigned char)src[srcp]<=0x20)) srcp++;
+    if (srcp>=srcc) break;
+    const char *line=src+srcp;
+    int linec=0;
+    while ((srcp<srcc)&&(src[srcp]!=0x0a)) { srcp++; linec++; }
+    if (line[0]=='[') {
+      (*facec)++;
+      (*namec)+=linec+1;
+    } else if (line[0]=='-') {
+      (*framec)++;
+    }
+  }
+}
+
+/* Make room for so many config faces, frames, and name bytes. Drop the old faces first.
+ * The arenas only grow, so reloading a config of the same size allocates nothing.
+ */
+
+static int an_animator_require_config(struct an_animator *animator,int facec,int framec,int namec) {
+  animator->cfgnamec=0;
+  animator->cfgframec=0;
+  if (facec>INT_MAX/sizeof(struct an_face)-1) return -1;
+  if (facec+1>animator->facea) { // +1 for the APNG face
+    void *nv=realloc(animator->facev,sizeof(struct an_face)*(facec+1));
+    if (!nv) return -1;
+    animator->facev=nv;
+    animator->facea=facec+1;
+  }
+  if (namec>animator->cfgnamea) {
+    void *nv=realloc(animator->cfgnamev,namec);
+    if (!nv) return -1;
+    animator->cfgnamev=nv;
+    animator->cfgnamea=namec;
+  }
+  if (framec>animator->cfgframea) {
+    if (framec>INT_MAX/sizeof(struct an_frame)) return -1;
+    void *nv=realloc(animator->cfgframev,sizeof(struct an_frame)*framec);
+    if (!nv) return -1;
+    animator->cfgframev=nv;
+    if (!(nv=realloc(animator->cfgendv,sizeof(int64_t)*framec))) return -1;
+    animator->cfgendv=nv;
+    animator->cfgframea=framec;
+  }
+  return 0;
+}
+
+/* Compiled config.
+ * Everything finish_config resolved, in flat arrays that load with a few copies and bounds checks, no parsing.
+ * Native byte order, every field int32, in this order:
+ *   header
+ *   (facec) faces, their frames contiguous in (framev) in face order
+ *   (framec) frames
+ *   (hasha) faceid or -1: The config's faces by an_name_hash(), same as (facehashv)
+ *   (namec) bytes of names, each terminated
+ * A text config can't begin with NUL, that's how we tell.
+ */
+
+#define AN_COMPILED_VERSION 1
+
+struct an_compiled_header {
+  char magic[4]; // "\0ANC"
+  int32_t version; // Also catches the wrong byte order.
+  int32_t facec,framec,hasha,namec;
+};
+
+struct an_compiled_face {
+  int32_t namep,namec;
+  int32_t w,h,anchor;
+  int32_t framec;
+};
+
+struct an_compiled_frame {
+  int32_t x,y,w,h,delay,anchor;
+};
+
+static int an_config_is_compiled(const void *src,int srcc) {
+  return (srcc>=4)&&!memcmp(src,"\0ANC",4);
+}
+
+int an_animator_compile_config(void *dstpp,const struct an_animator *animator) {
+  struct an_compiled_header hdr;
+  memset(&hdr,0,sizeof(hdr));
+  memcpy(hdr.magic,"\0ANC",4);
+  hdr.version=AN_COMPILED_VERSION;
+  int facec=animator->facec;
+  if ((facec>0)&&animator->facev[facec-1].apng) facec--;
+  if ((facec<1)||(animator->facehasha<=facec)) return -1;
+  hdr.facec=facec;
+  hdr.framec=animator->cfgframec;
+  hdr.hasha=animator->facehasha;
+  hdr.namec=animator->cfgnamec;
+  int64_t dstc=sizeof(hdr)+
+    (int64_t)sizeof(struct an_compiled_face)*hdr.facec+
+    (int64_t)sizeof(struct an_compiled_frame)*hdr.framec+
+    (int64_t)sizeof(int32_t)*hdr.hasha+
+    hdr.namec;
+  if (dstc>INT_MAX) return -1;
+  uint8_t *dst=malloc(dstc);
+  if (!dst) return -1;
+  uint8_t *p=dst;
+  memcpy(p,&hdr,sizeof(hdr));
+  p+=sizeof(hdr);
+  
+  const struct an_face *face=animator->facev;
+  int i=facec;
+  for (;i-->0;face++) {
+    struct an_compiled_face cface={
+      face->name-animator->cfgnamev,face->namec,
+      face->w,face->h,face->anchor,
+      face->framec,
+    };
+    memcpy(p,&cface,sizeof(cface));
+    p+=sizeof(cface);
+  }
   
+  const struct an_frame *frame=animator->cfgframev;
+  for (i=animator->cfgframec;i-->0;frame++) {
+    struct an_compiled_frame cframe={frame->x,frame->y,frame->w,frame->h,frame->delay,frame->anchor};
+    memcpy(p,&cframe,sizeof(cframe));
+    p+=sizeof(cframe);
+  }
+  
+  for (i=0;i<animator->facehasha;i++,p+=sizeof(int32_t)) {
+    int32_t faceid=animator->facehashv[i];
+    memcpy(p,&faceid,sizeof(int32_t));
+  }
+  
+  memcpy(p,animator->cfgnamev,animator->cfgnamec);
+  *(void**)dstpp=dst;
+  return (int)dstc;
+}
+
+/* Load a compiled config. Faces are dropped and the arenas ready.
+ * We trust the compiler for values, but check every offset and count, so a bad file fails cleanly.
+ * The whole file is checked before we touch the animator: On failure, it still has no faces and its arenas and index are intact.
+ */
+ 
+static int an_compiled_config_malformed(const char *path) {
+  fprintf(stderr,"%s: Compiled config is malformed.\n",path);
+  return -1;
+}
+
+static int an_animator_load_compiled_config(
+  struct an_animator *animator,
+  const uint8_t *src,int srcc,
+  const char *path
+) {
+  struct an_compiled_header hdr;
+  if (srcc<sizeof(hdr)) return -1;
+  memcpy(&hdr,src,sizeof(hdr));
+  if (hdr.version!=AN_COMPILED_VERSION) {
+    fprintf(stderr,"%s: Compiled config version %d, expected %d. Please recompile it.\n",path,hdr.version,AN_COMPILED_VERSION);
+    return -1;
+  }
+  if (
+    (hdr.facec<1)||(hdr.framec<hdr.facec)||(hdr.namec<hdr.facec)||
+    (hdr.hasha<=hdr.facec)||(hdr.hasha&(hdr.hasha-1))||(hdr.hasha>INT_MAX/sizeof(int))||
+    (hdr.facec>INT_MAX/sizeof(struct an_compiled_face))||(hdr.framec>INT_MAX/sizeof(struct an_compiled_frame))||
+    ((int64_t)sizeof(hdr)+
+      (int64_t)sizeof(struct an_compiled_face)*hdr.facec+
+      (int64_t)sizeof(struct an_compiled_frame)*hdr.framec+
+      (int64_t)sizeof(int32_t)*hdr.hasha+
+      hdr.namec!=srcc)
+  ) return an_compiled_config_malformed(path);
+  const uint8_t *facesrc=src+sizeof(hdr);
+  const uint8_t *framesrc=facesrc+sizeof(struct an_compiled_face)*hdr.facec;
+  const uint8_t *hashsrc=framesrc+sizeof(struct an_compiled_frame)*hdr.framec;
+  const uint8_t *namesrc=hashsrc+sizeof(int32_t)*hdr.hasha;
+  if (namesrc[hdr.namec-1]) return an_compiled_config_malformed(path);
+  
+  // Check everything.
+  struct an_compiled_frame cframe;
+  struct an_compiled_face cface;
+  int32_t faceid;
+  int i,framep=0,emptyc=0;
+  for (i=0;i<hdr.framec;i++) {
+    memcpy(&cframe,framesrc+sizeof(cframe)*i,sizeof(cframe));
+    if ((cframe.w<1)||(cframe.h<1)||(cframe.delay<1)||(cframe.anchor<AN_ANCHOR_NW)||(cframe.anchor>AN_ANCHOR_SE)) {
+      return an_compiled_config_malformed(path);
+    }
+  }
+  for (i=0;i<hdr.facec;i++) {
+    memcpy(&cface,facesrc+sizeof(cface)*i,sizeof(cface));
+    if (
+      (cface.namep<0)||(cface.namec<0)||(cface.namec>AN_FACE_NAME_LIMIT)||
+      (cface.namep>=hdr.namec-cface.namec)||namesrc[cface.namep+cface.namec]||
+      (cface.framec<1)||(cface.framec>hdr.framec-framep)||
+      (cface.w<1)||(cface.h<1)||(cface.anchor<AN_ANCHOR_NW)||(cface.anchor>AN_ANCHOR_SE)
+    ) return an_compiled_config_malformed(path);
+    framep+=cface.framec;
+  }
+  if (framep!=hdr.framec) return an_compiled_config_malformed(path);
+  for (i=0;i<hdr.hasha;i++) {
+    memcpy(&faceid,hashsrc+sizeof(int32_t)*i,sizeof(int32_t));
+    if (faceid<0) emptyc++;
+    else if (faceid>=hdr.facec) return an_compiled_config_malformed(path);
+  }
+  // The index must leave at least one slot empty, or a miss would probe forever.
+  if (!emptyc) return an_compiled_config_malformed(path);
+  
+  // Allocate everything.
+  if (an_animator_require_config(animator,hdr.facec,hdr.framec,hdr.namec)<0) return -1;
+  if (hdr.hasha>animator->facehasha) {
+    void *nv=realloc(animator->facehashv,sizeof(int)*hdr.hasha);
+    if (!nv) return -1;
+    animator->facehashv=nv;
+    animator->facehasha=hdr.hasha;
+  }
+  
+  // And copy it in. Nothing can fail from here.
+  memcpy(animator->cfgnamev,namesrc,hdr.namec);
+  animator->cfgnamec=hdr.namec;
+  
+  struct an_frame *frame=animator->cfgframev;
+  for (i=hdr.framec;i-->0;frame++,framesrc+=sizeof(cframe)) {
+    memcpy(&cframe,framesrc,sizeof(cframe));
+    memset(frame,0,sizeof(struct an_frame));
+    frame->x=cframe.x;
+    frame->y=cframe.y;
+    frame->w=cframe.w;
+    frame->h=cframe.h;
+    frame->delay=cframe.delay;
+    frame->anchor=cframe.anchor;
+    frame->padp=-1;
+    frame->atlasp=-1;
+    frame->trimw=-1;
+    frame->deltap=-1;
+  }
+  animator->cfgframec=hdr.framec;
+  
+  for (framep=0,i=hdr.facec;i-->0;facesrc+=sizeof(cface)) {
+    memcpy(&cface,facesrc,sizeof(cface));
+    struct an_face *face=animator->facev+animator->facec++;
+    memset(face,0,sizeof(struct an_face));
+    face->name=animator->cfgnamev+cface.namep;
+    face->namec=cface.namec;
+    face->w=cface.w;
+    face->h=cface.h;
+    face->anchor=cface.anchor;
+    face->framev=animator->cfgframev+framep;
+    face->endv=animator->cfgendv+framep;
+    face->framec=cface.framec;
+    framep+=cface.framec;
+    an_face_sum_delays(face);
+  }
+  
+  animator->facehasha=hdr.hasha;
+  for (i=0;i<hdr.hasha;i++,hashsrc+=sizeof(int32_t)) {
+    memcpy(&faceid,hashsrc,sizeof(int32_t));
+    animator->facehashv[i]=(faceid<0)?-1:faceid;
+  }
   return 0;
 }
 
@@ -352,11 +1824,18 @@ int an_animator_set_config(struct an_animator *animator,const char *src,int srcc
     pvfacenamec=face->namec;
   }
   
-  // Drop all the existing face definitions.
+  // Drop all the existing face definitions, and make room for the new ones all at once.
   while (animator->facec>0) {
     animator->facec--;
     an_face_cleanup(animator->facev+animator->facec);
   }
+  if (an_config_is_compiled(src,srcc)) {
+    if (an_animator_load_compiled_config(animator,(const uint8_t*)src,srcc,path)<0) return -1;
+    return an_animator_apply_config(animator,pvfacename,pvfacenamec);
+  }
+  int facec,framec,namec;
+  an_config_measure(&facec,&framec,&namec,src,srcc);
+  if (an_animator_require_config(animator,facec,framec,namec)<0) return -1;
   
   // Read input linewise.
   struct an_face *face=0;
@@ -409,7 +1888,7 @@ int an_animator_set_config(struct an_animator *animator,const char *src,int srcc
     
     // '-' defines a new frame.
     if (line[0]=='-') {
-      if (an_animator_decode_frame(face,line,linec)<0) {
+      if (an_animator_decode_frame(animator,face,line,linec)<0) {
         fprintf(stderr,"%s:%d: Failed to decode frame.\n",path,lineno);
         return -1;
       }
@@ -431,7 +1910,6 @@ static int an_animator_get_image_default(
   void *rgbapp,int *w,int *h,int *stride,
   const struct an_animator *animator
 ) {
-  fprintf(stderr,"...default\n");
   *(void**)rgbapp="\0\0\0\0";
   *w=1;
   *h=1;
@@ -439,112 +1917,262 @@ static int an_animator_get_image_default(
   return 0;
 }
 
-/* Copy to our private image buffer due to size mismatches or OOB.
+/* Draw a frame at its face's size into (buf), for when the pads aren't ready yet.
  */
  
 static int an_animator_get_image_pad(
   void *rgbapp,int *w,int *h,int *stride,
   struct an_animator *animator,
+  const struct an_source *src,
   const struct an_face *face,
   const struct an_frame *frame
 ) {
-  fprintf(stderr,"...pad\n");
-
-  // Calculate output size, require buffer, and zero it.
-  int dstw=face->w;
-  int dsth=face->h;
-  if (dstw<1) dstw=1;
-  if (dsth<1) dsth=1;
-  int dststride=dstw*4;
-  int dstsize=dststride*dsth;
+  if ((face->w<1)||(face->h<1)||(face->w>INT_MAX/4/face->h)) return -1;
+  int dstsize=face->w*face->h*4;
   if (dstsize>animator->bufa) {
     void *nv=realloc(animator->buf,dstsize);
     if (!nv) return -1;
     animator->buf=nv;
     animator->bufa=dstsize;
   }
-  memset(animator->buf,0,dstsize);
+  an_animator_draw_pad(animator->buf,src,face,frame);
+  *(void**)rgbapp=animator->buf;
+  *w=face->w;
+  *h=face->h;
+  *stride=face->w<<2;
+  return 0;
+}
+
+/* Alpha-composite one row of RGBA8 onto another, both straight alpha.
+ */
+ 
+static void an_blend_row(uint8_t *dst,const uint8_t *src,int c) {
+  for (;c-->0;dst+=4,src+=4) {
+    int sa=src[3];
+    if (sa==0xff) memcpy(dst,src,4);
+    else if (sa) {
+      int da=(dst[3]*(0xff-sa)+0x7f)/0xff;
+      int a=sa+da,half=a>>1;
+      dst[0]=(src[0]*sa+dst[0]*da+half)/a;
+      dst[1]=(src[1]*sa+dst[1]*da+half)/a;
+      dst[2]=(src[2]*sa+dst[2]*da+half)/a;
+      dst[3]=a;
+    }
+  }
+}
+
+/* Draw APNG frame (framei) on the canvas.
+ * Its pixels are either its own, or the image's, which we keep in the atlas like any other frame's.
+ */
+ 
+static void an_animator_draw_apng_frame(struct an_animator *animator,const struct an_face *face,int framei) {
+  const struct png_image *image=animator->image;
+  const struct png_frame *frame=image->framev+framei;
+  int canvasstride=image->canvasw<<2;
+  int w=frame->w,h=frame->h;
+  const uint8_t *src;
+  int srcstride;
+  if (frame->image) {
+    src=frame->image->pixels;
+    srcstride=frame->image->stride;
+  } else {
+    int atlasp=face->framev[framei].atlasp;
+    if (atlasp<0) return;
+    src=animator->atlas+atlasp;
+    srcstride=w<<2;
+  }
+  uint8_t *dst=animator->canvas+frame->y*canvasstride+(frame->x<<2);
   
-  // Calculate and clip bounds.
-  int dstx=0;
-  int dsty=0;
-  int srcx=frame->x;
-  int srcy=frame->y;
-  int srcw=frame->w;
-  int srch=frame->h;
-  if (dstw!=srcw) switch (frame->anchor) {
-    case AN_ANCHOR_NW: case AN_ANCHOR_W: case AN_ANCHOR_SW: dstx=0; break;
-    case AN_ANCHOR_NE: case AN_ANCHOR_E: case AN_ANCHOR_SE: dstx=dstw-srcw; break;
-    default: dstx=(dstw>>1)-(srcw>>1);
+  // The first frame blends onto transparent black, so it's the same as SOURCE.
+  if ((frame->blend==PNG_BLEND_OVER)&&framei) {
+    for (;h-->0;dst+=canvasstride,src+=srcstride) an_blend_row(dst,src,w);
+  } else {
+    for (;h-->0;dst+=canvasstride,src+=srcstride) memcpy(dst,src,w<<2);
   }
-  if (dsth!=srch) switch (frame->anchor) {
-    case AN_ANCHOR_NW: case AN_ANCHOR_N: case AN_ANCHOR_NE: dsty=0; break;
-    case AN_ANCHOR_SW: case AN_ANCHOR_S: case AN_ANCHOR_SE: dsty=dsth-srch; break;
-    default: dsty=(dsth>>1)-(srch>>1);
+}
+
+/* Save or restore the rect under APNG frame (framei), or clear it.
+ */
+ 
+static void an_animator_copy_apng_rect(struct an_animator *animator,int framei,int save) {
+  const struct png_image *image=animator->image;
+  const struct png_frame *frame=image->framev+framei;
+  int canvasstride=image->canvasw<<2;
+  int rowc=frame->w<<2;
+  uint8_t *canvas=animator->canvas+frame->y*canvasstride+(frame->x<<2);
+  uint8_t *prev=animator->prev;
+  int yi=frame->h;
+  for (;yi-->0;canvas+=canvasstride,prev+=rowc) {
+    if (save>0) memcpy(prev,canvas,rowc);
+    else if (!save) memcpy(canvas,prev,rowc);
+    else memset(canvas,0,rowc);
+  }
+}
+
+/* Get a delta frame: Bring (deltabuf) up to it, from wherever it is now if that's on the way, or from its keyframe.
+ */
+ 
+static int an_animator_get_image_delta(
+  void *rgbapp,int *w,int *h,int *stride,
+  struct an_animator *animator,
+  const struct an_face *face,
+  const struct an_frame *frame
+) {
+  int size=face->w*face->h*4;
+  if (size>animator->deltabufa) {
+    void *nv=realloc(animator->deltabuf,size);
+    if (!nv) return -1;
+    animator->deltabuf=nv;
+    animator->deltabufa=size;
+  }
+  int faceid=face-animator->facev;
+  int framei=frame-face->framev;
+  int keyi=framei;
+  while ((keyi>0)&&(face->framev[keyi].deltap>=0)) keyi--;
+  if ((animator->deltafaceid!=faceid)||(animator->deltaframe>framei)||(animator->deltaframe<keyi)) {
+    const uint8_t *key=an_animator_frame_output(animator,face,face->framev+keyi);
+    if (key) memcpy(animator->deltabuf,key,size);
+    else memset(animator->deltabuf,0,size);
+    animator->deltafaceid=faceid;
+    animator->deltaframe=keyi;
+  }
+  while (animator->deltaframe<framei) {
+    animator->deltaframe++;
+    an_face_apply_delta(animator->deltabuf,face,face->framev+animator->deltaframe);
+  }
+  *(void**)rgbapp=animator->deltabuf;
+  *w=face->w;
+  *h=face->h;
+  *stride=face->w<<2;
+  return 0;
+}
+
+/* Get the APNG face's current frame: Bring the canvas up to it, from the last one we drew or from the start.
+ */
+ 
+static int an_animator_get_image_apng(
+  void *rgbapp,int *w,int *h,int *stride,
+  struct an_animator *animator,
+  const struct an_face *face,
+  const struct an_frame *frame
+) {
+  const struct png_image *image=animator->image;
+  int target=frame->apng-1;
+  if (target<animator->canvasframe) animator->canvasframe=-1;
+  if (animator->canvasframe<0) {
+    if (image->canvasw>INT_MAX/4/image->canvash) return -1;
+    int size=image->canvasw*image->canvash*4;
+    if (size>animator->canvasa) {
+      void *nv=realloc(animator->canvas,size);
+      if (!nv) return -1;
+      animator->canvas=nv;
+      animator->canvasa=size;
+    }
+    memset(animator->canvas,0,size);
   }
-  if (srcx<0) { dstx-=srcx; srcw+=srcx; srcx=0; }
-  if (srcy<0) { dsty-=srcy; srch+=srcy; srcy=0; }
-  if (dstx<0) { srcx-=dstx; srcw+=dstx; dstx=0; }
-  if (dsty<0) { srcy-=dsty; srch+=dsty; dsty=0; }
-  if (srcx+srcw>animator->image->w) srcw=animator->image->w-srcx;
-  if (srcy+srch>animator->image->h) srch=animator->image->h-srcy;
-  if (dstx+srcw>dstw) srcw=dstw-dstx;
-  if (dsty+srch>dsth) srch=dsth-dsty;
   
-  // Copy the valid range.
-  int cpc=srcw<<2;
-  const uint8_t *srcrow=((uint8_t*)animator->image->pixels)+srcy*animator->image->stride+(srcx<<2);
-  uint8_t *dstrow=animator->buf+dsty*dststride+(dstx<<2);
-  int yi=srch;
-  for (;yi-->0;srcrow+=animator->image->stride,dstrow+=dststride) {
-    memcpy(dstrow,srcrow,cpc);
+  while (animator->canvasframe<target) {
+  
+    // Dispose of the last frame. PREVIOUS on the first frame means BACKGROUND.
+    if (animator->canvasframe>=0) {
+      switch (image->framev[animator->canvasframe].dispose) {
+        case PNG_DISPOSE_BACKGROUND: an_animator_copy_apng_rect(animator,animator->canvasframe,-1); break;
+        case PNG_DISPOSE_PREVIOUS: {
+            if (animator->canvasframe) an_animator_copy_apng_rect(animator,animator->canvasframe,0);
+            else an_animator_copy_apng_rect(animator,animator->canvasframe,-1);
+          } break;
+      }
+    }
+    
+    // Draw the next one, first saving what it covers if it's going to put that back.
+    int framei=++(animator->canvasframe);
+    const struct png_frame *next=image->framev+framei;
+    if ((next->dispose==PNG_DISPOSE_PREVIOUS)&&framei) {
+      int size=next->w*next->h*4;
+      if (size>animator->preva) {
+        void *nv=realloc(animator->prev,size);
+        if (!nv) return -1;
+        animator->prev=nv;
+        animator->preva=size;
+      }
+      an_animator_copy_apng_rect(animator,framei,1);
+    }
+    an_animator_draw_apng_frame(animator,face,framei);
   }
   
-  *(void**)rgbapp=animator->buf;
-  *w=dstw;
-  *h=dsth;
-  *stride=dststride;
+  *(void**)rgbapp=animator->canvas;
+  *w=image->canvasw;
+  *h=image->canvash;
+  *stride=image->canvasw<<2;
   return 0;
 }
 
-/* Get current image.
+/* Get current image, or any other.
  */
  
 int an_animator_get_image(
   void *rgbapp,int *w,int *h,int *stride,
   struct an_animator *animator
 ) {
+  return an_animator_get_frame_image(rgbapp,w,h,stride,animator,animator->faceid,animator->framep);
+}
+ 
+int an_animator_get_frame_image(
+  void *rgbapp,int *w,int *h,int *stride,
+  struct an_animator *animator,
+  int faceid,int framep
+) {
 
   // Is there a valid frame we can return? If not, use the default empty image.
-  if (!animator->image) return an_animator_get_image_default(rgbapp,w,h,stride,animator);
-  if ((animator->faceid<0)||(animator->faceid>=animator->facec)) {
-    return an_animator_get_image_default(rgbapp,w,h,stride,animator);
-  }
-  const struct an_face *face=animator->facev+animator->faceid;
-  if ((animator->framep<0)||(animator->framep>=face->framec)) {
+  // Before the first image finishes, we can show frames from the preview once their rows are in.
+  const struct an_face *face=an_animator_face_at(animator,faceid);
+  const struct an_frame *frame=an_animator_frame_at(animator,faceid,framep);
+  if (!frame||!an_animator_frame_ready(animator,frame)) {
     return an_animator_get_image_default(rgbapp,w,h,stride,animator);
   }
-  const struct an_frame *frame=face->framev+animator->framep;
+  if (frame->apng) return an_animator_get_image_apng(rgbapp,w,h,stride,animator,face,frame);
+  if (frame->deltap>=0) return an_animator_get_image_delta(rgbapp,w,h,stride,animator,face,frame);
   
-  // If the frame box is smaller than the shared box, draw a fresh copy of it at the face's size.
-  // Our output size is always constant within one face, wm kind of depends on it.
-  if ((frame->w!=face->w)||(frame->h!=face->h)) {
-    return an_animator_get_image_pad(rgbapp,w,h,stride,animator,face,frame);
+  // Frames that don't fit exactly are usually drawn already. If not, eg we only have a preview, draw it now.
+  if (frame->padp>=0) {
+    *(void**)rgbapp=animator->pad+frame->padp;
+    *w=face->w;
+    *h=face->h;
+    *stride=face->w<<2;
+    return 0;
   }
-  
-  // Likewise, if the frame's box exceeds the image, use pad to create a sensible size.
-  if ((frame->x<0)||(frame->y<0)||(frame->x+frame->w>animator->image->w)||(frame->y+frame->h>animator->image->h)) {
-    return an_animator_get_image_pad(rgbapp,w,h,stride,animator,face,frame);
+  struct an_source src;
+  an_animator_frame_source(&src,animator,frame);
+  if (an_animator_frame_needs_pad(&src,face,frame)) {
+    return an_animator_get_image_pad(rgbapp,w,h,stride,animator,&src,face,frame);
   }
   
-  // OK normal cases, we can return a pointer into the source image.
-  *(void**)rgbapp=((uint8_t*)(animator->image->pixels))+frame->y*animator->image->stride+(frame->x<<2);
+  // OK normal cases, we can return a pointer into the atlas or preview.
+  *(void**)rgbapp=(void*)(src.v+src.y*src.stride+(src.x<<2));
   *w=frame->w;
   *h=frame->h;
-  *stride=animator->image->stride;
+  *stride=src.stride;
   return 0;
 }
 
+/* Opaque bounds of the current image or any other, if we measured them.
+ */
+ 
+int an_animator_get_image_bounds(int *x,int *y,int *w,int *h,const struct an_animator *animator) {
+  return an_animator_get_frame_bounds(x,y,w,h,animator,animator->faceid,animator->framep);
+}
+ 
+int an_animator_get_frame_bounds(int *x,int *y,int *w,int *h,const struct an_animator *animator,int faceid,int framep) {
+  const struct an_frame *frame=an_animator_frame_at(animator,faceid,framep);
+  if (!frame||!an_animator_frame_ready(animator,frame)) return 0;
+  if (frame->trimw<0) return 0;
+  *x=frame->trimx;
+  *y=frame->trimy;
+  *w=frame->trimw;
+  *h=frame->trimh;
+  return 1;
+}
+
 /* Public access to face list.
  */
 
@@ -552,6 +2180,18 @@ int an_animator_count_faces(const struct an_animator *animator) {
   return animator->facec;
 }
 
+int an_animator_count_frames(const struct an_animator *animator,int faceid) {
+  const struct an_face *face=an_animator_face_at(animator,faceid);
+  if (!face) return -1;
+  return face->framec;
+}
+
+int an_animator_get_frame_delay(const struct an_animator *animator,int faceid,int framep) {
+  const struct an_frame *frame=an_animator_frame_at(animator,faceid,framep);
+  if (!frame) return -1;
+  return frame->delay;
+}
+
 int an_animator_get_face_name(char **name,const struct an_animator *animator,int faceid) {
   if ((faceid<0)||(faceid>=animator->facec)) return -1;
   const struct an_face *face=animator->facev+faceid;
@@ -566,7 +2206,7 @@ int an_animator_use_face(struct an_animator *animator,int faceid) {
   if (face->framec<1) return -1;
   animator->faceid=faceid;
   animator->framep=0;
-  animator->delay=face->framev[0].delay;
+  animator->due=animator->now+face->framev[0].delay;
   animator->dirty=1;
   return 0;
 }
@@ -574,14 +2214,9 @@ int an_animator_use_face(struct an_animator *animator,int faceid) {
 int an_animator_use_face_by_name(struct an_animator *animator,const char *name,int namec) {
   if (!name) return -1;
   if (namec<0) { namec=0; while (name[namec]) namec++; }
-  int faceid=0;
-  const struct an_face *face=animator->facev;
-  for (;faceid<animator->facec;faceid++,face++) {
-    if (face->namec!=namec) continue;
-    if (memcmp(name,face->name,namec)) continue;
-    return an_animator_use_face(animator,faceid);
-  }
-  return -1;
+  int faceid=an_animator_find_face(animator,name,namec);
+  if (faceid<0) return -1;
+  return an_animator_use_face(animator,faceid);
 }
 
 /* Update.
@@ -589,9 +2224,9 @@ int an_animator_use_face_by_name(struct an_animator *animator,const char *name,i
 
 int an_animator_update(struct an_animator *animator) {
 
-  // We have some delay pending, so just tick it off.
-  if (animator->delay>1) {
-    animator->delay--;
+  // Current frame isn't done yet? Nothing to do, unless something else changed.
+  animator->now++;
+  if (animator->now<animator->due) {
     if (animator->dirty) {
       animator->dirty=0;
       return 1;
@@ -606,13 +2241,74 @@ int an_animator_update(struct an_animator *animator) {
     fprintf(stderr,"Face '%.*s' somehow has no frames.\n",face->namec,face->name);
     return -1;
   }
-  animator->framep++;
-  if (animator->framep>=face->framec) animator->framep=0;
-  animator->delay=face->framev[animator->framep].delay;
+  int framep=animator->framep+1;
+  if (framep>=face->framec) framep=0;
+  
+  // Still decoding the first image, and the next frame isn't in yet? Hold this one.
+  if (!an_animator_frame_ready(animator,face->framev+framep)) {
+    if (animator->dirty) {
+      animator->dirty=0;
+      return 1;
+    }
+    return 0;
+  }
+  animator->framep=framep;
+  animator->due=animator->now+face->framev[animator->framep].delay;
 
   return 1;
 }
 
+/* Put the current face at some point in its cycle, as of (animator->now).
+ * Returns the frame it lands on, or <0 if it isn't ready to draw yet, and then changes nothing.
+ */
+
+static int an_animator_jump(struct an_animator *animator,const struct an_face *face,int64_t t) {
+  int64_t cycle=face->endv[face->framec-1];
+  t%=cycle;
+  if (t<0) t+=cycle;
+  int lo=0,hi=face->framec-1;
+  while (lo<hi) {
+    int ck=(lo+hi)>>1;
+    if (face->endv[ck]>t) hi=ck;
+    else lo=ck+1;
+  }
+  if (!an_animator_frame_ready(animator,face->framev+lo)) return -1;
+  animator->framep=lo;
+  animator->due=animator->now+face->endv[lo]-t;
+  return lo;
+}
+
+/* Skip ahead, or go straight to a point in the face's cycle.
+ */
+
+int an_animator_advance(struct an_animator *animator,int64_t tickc) {
+  if (tickc<1) return 0;
+  if (animator->due<=animator->now) animator->due=animator->now+1; // update() never starts a frame late either.
+  animator->now+=tickc;
+  const struct an_face *face=an_animator_current_face(animator);
+  if ((animator->now>=animator->due)&&face&&(face->framec>0)) {
+    // Frame (framep+1) started at (due), so that's how far into the cycle we are.
+    int64_t t=face->endv[animator->framep]+animator->now-animator->due;
+    if (an_animator_jump(animator,face,t)>=0) {
+      animator->dirty=0;
+      return 1;
+    }
+  }
+  if (animator->dirty) {
+    animator->dirty=0;
+    return 1;
+  }
+  return 0;
+}
+
+int an_animator_seek(struct an_animator *animator,int64_t t) {
+  const struct an_face *face=an_animator_current_face(animator);
+  if (!face||(face->framec<1)) return -1;
+  if (an_animator_jump(animator,face,t)<0) return 0;
+  animator->dirty=1;
+  return 0;
+}
+
 /* Evaluate a digit (a..z = 10..35).
  */
  
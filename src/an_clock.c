@@ -52,6 +52,7 @@ struct an_clock *an_clock_new(int ratehz) {
 }
 
 /* Update.
+ * If we're a whole period or more late, count the frames we missed, and start over from now.
  */
 
 int an_clock_update(struct an_clock *clock) {
@@ -61,8 +62,11 @@ int an_clock_update(struct an_clock *clock) {
     if (now>=clock->nexttime) {
       clock->nexttime+=clock->period;
       if (clock->nexttime<now) {
+        int64_t missed=(now-clock->nexttime)/clock->period+1;
         clock->skipc++;
         clock->nexttime=now+clock->period;
+        if (missed>INT_MAX) return INT_MAX;
+        return (int)missed;
       }
       return 0;
     }
@@ -76,3 +80,13 @@ int an_clock_update(struct an_clock *clock) {
   }
   return 0;
 }
+
+/* Time remaining.
+ */
+ 
+int an_clock_get_remaining(const struct an_clock *clock) {
+  int64_t remaining=clock->nexttime-an_now();
+  if (remaining>INT_MAX) return INT_MAX;
+  if (remaining<INT_MIN) return INT_MIN;
+  return (int)remaining;
+}
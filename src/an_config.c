@@ -27,6 +27,10 @@ static void an_print_help(const char *exename) {
     "OPTIONS:\n"
     "  --help            Print this message and exit.\n"
     "  --config=PATH     Use this config file instead of guessing.\n"
+    "  --trim[=0|1]      Measure each frame's opaque bounds, and only redraw those.\n"
+    "  --delta=N         Keep every Nth frame whole, and the rest as changes from the one before.\n"
+    "  --compile-config=PATH\n"
+    "                    Write the config in binary to PATH and quit. Give that as --config to skip parsing at startup.\n"
     "\n"
   );
 }
@@ -36,6 +40,15 @@ static int an_config_short_option(struct an_config *config,char option) {
   return -1;
 }
 
+/* Flags never take the next argument as their value, only "--flag=N".
+ */
+ 
+static int an_config_long_option_is_flag(const char *k,int kc) {
+  if ((kc==4)&&!memcmp(k,"help",4)) return 1;
+  if ((kc==4)&&!memcmp(k,"trim",4)) return 1;
+  return 0;
+}
+
 static int an_config_long_option(struct an_config *config,const char *k,int kc,const char *v) {
   if (!k) kc=0; else if (kc<0) { kc=0; while (k[kc]) kc++; }
   int vc=0; if (v) while (v[vc]) vc++;
@@ -54,6 +67,27 @@ static int an_config_long_option(struct an_config *config,const char *k,int kc,c
     return 0;
   }
   
+  if ((kc==4)&&!memcmp(k,"trim",4)) {
+    if (an_eval_int(&config->trim,v,vc)!=vc) {
+      fprintf(stderr,"%s: Expected integer for '--trim', found '%.*s'.\n",config->exename,vc,v);
+      return -1;
+    }
+    return 0;
+  }
+  
+  if ((kc==5)&&!memcmp(k,"delta",5)) {
+    if ((an_eval_int(&config->delta,v,vc)!=vc)||(config->delta<0)) {
+      fprintf(stderr,"%s: Expected keyframe interval for '--delta', found '%.*s'.\n",config->exename,vc,v);
+      return -1;
+    }
+    return 0;
+  }
+  
+  if ((kc==14)&&!memcmp(k,"compile-config",14)) {
+    config->compilepath=v;
+    return 0;
+  }
+  
   fprintf(stderr,"%s: Unknown long option '%.*s' = '%.*s'.\n",config->exename,kc,k,vc,v);
   return -1;
 }
@@ -108,7 +142,7 @@ int an_config_init(struct an_config *config,int argc,char **argv) {
     int kc=0;
     while (k[kc]&&(k[kc]!='=')) kc++;
     if (k[kc]=='=') v=k+kc+1;
-    else if ((argp<argc)&&(argv[argp][0]!='-')) v=argv[argp++];
+    else if (!an_config_long_option_is_flag(k,kc)&&(argp<argc)&&(argv[argp][0]!='-')) v=argv[argp++];
     else v="1";
     if (an_config_long_option(config,k,kc,v)<0) return -1;
     continue;
@@ -118,7 +152,8 @@ int an_config_init(struct an_config *config,int argc,char **argv) {
     return -1;
   }
   
-  // PNG path required.
+  // PNG path required. Except to compile a config, then we only need the config's path.
+  if (config->compilepath&&config->cfgpath&&!config->pngpath) return 0;
   if (!config->pngpath) {
     //fprintf(stderr,"%s: Input PNG file required.\n",config->exename);
     an_print_help(config->exename);
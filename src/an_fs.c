@@ -1,8 +1,10 @@
 #include "animaniac.h"
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 // This is for MS Windows compatibility.
 // Though... we're using '/' literally as path separator, so it will still be a challenge.
@@ -13,6 +15,9 @@
 // Seekless read is technically unbounded, so we need to enforce some crazy high limit.
 #define FS_SEEKLESS_SANITY_LIMIT 0x10000000
 
+// Streaming read holds one buffer this size, on the stack.
+#define FS_STREAM_BUFFER_SIZE 0x8000
+
 /* Read from open file into new buffer until EOF.
  */
  
@@ -24,7 +29,7 @@ static int file_read_seekless(void *dstpp,int fd) {
     if (dstc>=dsta) {
       if (dsta>=FS_SEEKLESS_SANITY_LIMIT) break;
       dsta<<=1;
-      char *nv=malloc(dsta);
+      char *nv=realloc(dst,dsta);
       if (!nv) {
         free(dst);
         return -1;
@@ -42,6 +47,8 @@ static int file_read_seekless(void *dstpp,int fd) {
     }
     dstc+=err;
   }
+  free(dst);
+  return -1;
 }
 
 /* Read file.
@@ -83,6 +90,122 @@ int an_file_read(void *dstpp,const char *path) {
   return dstc;
 }
 
+/* Map file, or read it into an anonymous mapping if it can't be mapped.
+ * Either way, the caller releases it with munmap, via an_file_unmap().
+ */
+ 
+int an_file_map(void *dstpp,const char *path) {
+  if (!dstpp||!path) return -1;
+  int fd=open(path,O_RDONLY|O_BINARY);
+  if (fd<0) return -1;
+  
+  struct stat st={0};
+  if ((fstat(fd,&st)<0)||!S_ISREG(st.st_mode)||!st.st_size) {
+    // Pipes, empty files, and procfs-style files that report no size:
+    // Read it the usual way, then copy into a mapping.
+    void *tmp=0;
+    int tmpc=file_read_seekless(&tmp,fd);
+    close(fd);
+    if (tmpc<=0) {
+      if (tmp) free(tmp);
+      if (tmpc<0) return -1;
+      *(void**)dstpp="";
+      return 0;
+    }
+    void *dst=mmap(0,tmpc,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (dst==MAP_FAILED) {
+      free(tmp);
+      return -1;
+    }
+    memcpy(dst,tmp,tmpc);
+    free(tmp);
+    *(void**)dstpp=dst;
+    return tmpc;
+  }
+  if (st.st_size>INT_MAX) {
+    close(fd);
+    return -1;
+  }
+  int dstc=st.st_size;
+  
+  void *dst=mmap(0,dstc,PROT_READ,MAP_PRIVATE,fd,0);
+  if (dst!=MAP_FAILED) {
+    close(fd);
+    *(void**)dstpp=dst;
+    return dstc;
+  }
+  
+  // Filesystem doesn't support mmap. Read into an anonymous mapping.
+  if ((dst=mmap(0,dstc,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0))==MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  int dstp=0;
+  while (dstp<dstc) {
+    int err=read(fd,(char*)dst+dstp,dstc-dstp);
+    if (err<=0) {
+      close(fd);
+      munmap(dst,dstc);
+      return -1;
+    }
+    dstp+=err;
+  }
+  close(fd);
+  *(void**)dstpp=dst;
+  return dstc;
+}
+
+void an_file_unmap(void *v,int c) {
+  if (c>0) munmap(v,c);
+}
+
+/* Read file in pieces, handing each to (cb) as it arrives.
+ */
+ 
+int an_file_stream(const char *path,int (*cb)(const void *src,int srcc,void *userdata),void *userdata) {
+  if (!path||!cb) return -1;
+  int fd=open(path,O_RDONLY|O_BINARY);
+  if (fd<0) return -1;
+  char buf[FS_STREAM_BUFFER_SIZE];
+  while (1) {
+    int bufc=read(fd,buf,sizeof(buf));
+    if (bufc<0) {
+      if (errno==EINTR) continue;
+      close(fd);
+      return -1;
+    }
+    if (!bufc) break;
+    int err=cb(buf,bufc,userdata);
+    if (err) {
+      close(fd);
+      return err;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+/* Read file in pieces at the caller's pace.
+ */
+
+int an_file_open(const char *path) {
+  if (!path) return -1;
+  return open(path,O_RDONLY|O_BINARY);
+}
+
+int an_file_read_piece(void *dst,int dsta,int fd) {
+  if ((fd<0)||!dst||(dsta<1)) return -1;
+  while (1) {
+    int err=read(fd,dst,dsta);
+    if ((err<0)&&(errno==EINTR)) continue;
+    return err;
+  }
+}
+
+void an_file_close(int fd) {
+  if (fd>=0) close(fd);
+}
+
 /* Write file.
  */
 
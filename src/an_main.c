@@ -1,5 +1,11 @@
 #include "animaniac.h"
 
+// Mapped images decode in pieces this size, between frames.
+#define AN_LOAD_PIECE 32768
+
+// Stop decoding for this tick when the next frame is due within so many microseconds.
+#define AN_LOAD_MARGIN 2000
+
 /* Context.
  */
  
@@ -10,9 +16,21 @@ struct an_app {
   struct an_wm *wm;
   struct an_animator *animator;
   int quit;
+  
+  // Image file we're decoding in the background, if (loadfd) >=0.
+  // We read it rather than map it: It's usually being rewritten while we load, and a truncated mapping faults.
+  int loadfd;
+  uint8_t loadbuf[AN_LOAD_PIECE];
 };
 
+static void an_app_drop_load(struct an_app *app) {
+  if (app->loadfd<0) return;
+  an_file_close(app->loadfd);
+  app->loadfd=-1;
+}
+
 static void an_app_cleanup(struct an_app *app) {
+  an_app_drop_load(app);
   an_clock_del(app->clock);
   an_inmgr_del(app->inmgr);
   an_wm_del(app->wm);
@@ -22,35 +40,86 @@ static void an_app_cleanup(struct an_app *app) {
 /* File changed.
  */
  
+static int an_stream_image(const void *src,int srcc,void *userdata) {
+  struct an_app *app=userdata;
+  if (an_animator_provide_image(app->animator,src,srcc)<0) return 1; // Stop reading; end reports the error.
+  return 0;
+}
+ 
 static int an_read_image(struct an_app *app,const char *path) {
-  void *src=0;
-  int srcc=an_file_read(&src,path);
-  if (srcc<0) {
+
+  // Whatever we were loading is stale now.
+  an_app_drop_load(app);
+
+  // Pipes and devices: Decode as it arrives, we never hold the whole file.
+  if (an_file_get_type(path)!='f') {
+    if (an_animator_begin_image(app->animator)<0) return -1;
+    if (an_file_stream(path,an_stream_image,app)<0) {
+      fprintf(stderr,"%s: Failed to read image file.\n",path);
+      an_animator_end_image(app->animator,path);
+      return -1;
+    }
+    if (an_animator_end_image(app->animator,path)<0) {
+      fprintf(stderr,"%s: Failed to decode or apply image file.\n",path);
+      return -1;
+    }
+    return 0;
+  }
+
+  // Regular files: Decode a piece at a time between frames. See an_continue_image().
+  // Playback continues meanwhile, and if it's the first image, we show frames as soon as they're ready.
+  int fd=an_file_open(path);
+  if (fd<0) {
     fprintf(stderr,"%s: Failed to read image file.\n",path);
     return -1;
   }
-  int err=an_animator_set_image(app->animator,src,srcc,path);
-  free(src);
-  if (err<0) {
+  if (an_animator_begin_image(app->animator)<0) {
+    an_file_close(fd);
     fprintf(stderr,"%s: Failed to decode or apply image file.\n",path);
     return -1;
   }
+  app->loadfd=fd;
+  return 0;
+}
+
+/* Decode more of the image in progress, until it's done or the next frame is nearly due.
+ * Always at least one piece, so we make progress even when the clock is behind.
+ */
+ 
+static int an_continue_image(struct an_app *app) {
+  if (app->loadfd<0) return 0;
+  while (1) {
+    // EOF, or a read error, or a decode error: All end here, and end reports whether the image is complete.
+    int c=an_file_read_piece(app->loadbuf,sizeof(app->loadbuf),app->loadfd);
+    if (c<=0) break;
+    if (an_animator_provide_image(app->animator,app->loadbuf,c)<0) break;
+    if (an_clock_get_remaining(app->clock)<AN_LOAD_MARGIN) return 0;
+  }
+  an_app_drop_load(app);
+  if (an_animator_end_image(app->animator,app->config.pngpath)<0) {
+    fprintf(stderr,"%s: Failed to decode or apply image file.\n",app->config.pngpath);
+    return -1;
+  }
+  // APNG whose first frame is the image itself, and we only decoded the part our config uses? Go get the rest.
+  if (an_animator_needs_image(app->animator)) return an_read_image(app,app->config.pngpath);
   return 0;
 }
  
 static int an_read_config(struct an_app *app,const char *path) {
   void *src=0;
-  int srcc=an_file_read(&src,path);
+  int srcc=an_file_map(&src,path);
   if (srcc<0) {
     fprintf(stderr,"%s: Failed to read config file.\n",path);
     return -1;
   }
   int err=an_animator_set_config(app->animator,src,srcc,path);
-  free(src);
+  an_file_unmap(src,srcc);
   if (err<0) {
     fprintf(stderr,"%s: Failed to decode or apply config file.\n",path);
     return -1;
   }
+  // Restart the image if the new frames need more of it. Also if it's loading, since it might be for the old frames.
+  if ((app->loadfd>=0)||an_animator_needs_image(app->animator)) return an_read_image(app,app->config.pngpath);
   return 0;
 }
  
@@ -95,6 +164,39 @@ static int cb_stdin(const void *src,int srcc,void *userdata) {
   return 0;
 }
 
+/* --compile-config: Read the text config, write it compiled, and that's all.
+ */
+
+static int an_compile_config(struct an_app *app) {
+  if (!(app->animator=an_animator_new())) return -1;
+  void *src=0;
+  int srcc=an_file_map(&src,app->config.cfgpath);
+  if (srcc<0) {
+    fprintf(stderr,"%s: Failed to read config file.\n",app->config.cfgpath);
+    return -1;
+  }
+  int err=an_animator_set_config(app->animator,src,srcc,app->config.cfgpath);
+  an_file_unmap(src,srcc);
+  if (err<0) {
+    fprintf(stderr,"%s: Failed to decode config file.\n",app->config.cfgpath);
+    return -1;
+  }
+  void *dst=0;
+  int dstc=an_animator_compile_config(&dst,app->animator);
+  if (dstc<0) {
+    fprintf(stderr,"%s: Failed to compile config.\n",app->config.cfgpath);
+    return -1;
+  }
+  err=an_file_write(app->config.compilepath,dst,dstc);
+  free(dst);
+  if (err<0) {
+    fprintf(stderr,"%s: Failed to write compiled config.\n",app->config.compilepath);
+    return -1;
+  }
+  fprintf(stderr,"%s: Compiled %d faces from %s, %d bytes.\n",app->config.compilepath,an_animator_count_faces(app->animator),app->config.cfgpath,dstc);
+  return 0;
+}
+
 /* Window closed.
  */
  
@@ -109,13 +211,21 @@ static int cb_close(void *userdata) {
  
 int main(int argc,char **argv) {
   struct an_app app={0};
+  app.loadfd=-1;
 
   if (an_config_init(&app.config,argc,argv)<0) return 1;
   
+  if (app.config.compilepath) {
+    int err=an_compile_config(&app);
+    an_app_cleanup(&app);
+    return (err<0)?1:0;
+  }
+  
   if (
     !(app.inmgr=an_inmgr_new(cb_file,cb_stdin,&app))||
-    (an_inmgr_add_file(app.inmgr,app.config.pngpath)<0)||
-    (an_inmgr_add_file(app.inmgr,app.config.cfgpath)<0)
+    // Config first, so the image decodes only what its frames use.
+    (an_inmgr_add_file(app.inmgr,app.config.cfgpath)<0)||
+    (an_inmgr_add_file(app.inmgr,app.config.pngpath)<0)
   ) {
     fprintf(stderr,"%s: Failed to initialize input.\n",app.config.exename);
     an_app_cleanup(&app);
@@ -134,6 +244,8 @@ int main(int argc,char **argv) {
     an_app_cleanup(&app);
     return 1;
   }
+  an_animator_set_trim(app.animator,app.config.trim);
+  an_animator_set_delta(app.animator,app.config.delta);
   
   if (!(app.clock=an_clock_new(app.config.rate))) {
     fprintf(stderr,"%s: Failed to create clock for rate %d Hz.\n",app.config.exename,app.config.rate);
@@ -142,9 +254,11 @@ int main(int argc,char **argv) {
   }
   
   while (!app.quit) {
-    an_clock_update(app.clock);
-    
-    int err=an_animator_update(app.animator);
+    // Normally one frame per pass. After a hitch, jump straight to where we should be.
+    int missed=an_clock_update(app.clock);
+    int err;
+    if (missed>0) err=an_animator_advance(app.animator,1+(int64_t)missed);
+    else err=an_animator_update(app.animator);
     if (err<0) {
       fprintf(stderr,"%s: Internal error updating animation.\n",app.config.exename);
       an_app_cleanup(&app);
@@ -153,10 +267,13 @@ int main(int argc,char **argv) {
     if (err>0) {
       const void *rgba=0;
       int w=0,h=0,stride=0;
-      if (
-        (an_animator_get_image(&rgba,&w,&h,&stride,app.animator)<0)||
-        (an_wm_set_image(app.wm,rgba,w,h,stride)<0)
-      ) {
+      if (an_animator_get_image(&rgba,&w,&h,&stride,app.animator)<0) err=-1;
+      else {
+        int x=0,y=0,bw=w,bh=h;
+        an_animator_get_image_bounds(&x,&y,&bw,&bh,app.animator);
+        err=an_wm_set_image_bounds(app.wm,rgba,w,h,stride,x,y,bw,bh);
+      }
+      if (err<0) {
         fprintf(stderr,"%s: Failed to retrieve or apply image.\n",app.config.exename);
         an_app_cleanup(&app);
         return 1;
@@ -173,6 +290,10 @@ int main(int argc,char **argv) {
       an_app_cleanup(&app);
       return 1;
     }
+    if (an_continue_image(&app)<0) {
+      an_app_cleanup(&app);
+      return 1;
+    }
   }
   
   an_app_cleanup(&app);
@@ -0,0 +1,281 @@
+#include "animaniac.h"
+
+/* Timing wheel: AN_WHEEL_LEVELS rings of AN_WHEEL_SIZE slots.
+ * Level zero has a slot per tick for the next AN_WHEEL_SIZE ticks, and each level up is AN_WHEEL_SIZE times coarser.
+ * When level zero comes around, the next level's current slot is spread out below, and so on up.
+ * Anything due beyond the top level waits in its farthest slot, and gets sorted again each time that comes around.
+ */
+#define AN_WHEEL_BITS 6
+#define AN_WHEEL_SIZE (1<<AN_WHEEL_BITS)
+#define AN_WHEEL_MASK (AN_WHEEL_SIZE-1)
+#define AN_WHEEL_LEVELS 4
+
+/* Object definition.
+ * Instances are structure-of-arrays, indexed by instance id. Removed ids have (faceidv<0), and chain through (framepv).
+ * Each scheduled instance is in one slot of (wheel), a list through (nextv,prevv), and (slotv) says which.
+ */
+
+struct an_playset {
+  struct an_animator *animator; // WEAK
+  int64_t now; // ticks since creation
+
+  int *faceidv;
+  int *framepv;
+  int64_t *duev; // tick when the next frame starts
+  int *nextv,*prevv; // -1 at the ends
+  int *slotv; // level*AN_WHEEL_SIZE+slot, or -1 if not scheduled
+  uint8_t *changedv; // 1 if it's in (changev), 2 if it's in (pendingv)
+  int c,a;
+  int freeid; // first removed id, or -1
+
+  int wheel[AN_WHEEL_LEVELS*AN_WHEEL_SIZE]; // first instance in each slot, or -1
+
+  // What the last update reported. (pendingv) is what add and use_face changed since, for the next one.
+  int *changev;
+  int changec;
+  int *pendingv;
+  int pendingc;
+};
+
+/* Cleanup.
+ */
+
+void an_playset_del(struct an_playset *playset) {
+  if (!playset) return;
+  if (playset->faceidv) free(playset->faceidv);
+  if (playset->framepv) free(playset->framepv);
+  if (playset->duev) free(playset->duev);
+  if (playset->nextv) free(playset->nextv);
+  if (playset->prevv) free(playset->prevv);
+  if (playset->slotv) free(playset->slotv);
+  if (playset->changedv) free(playset->changedv);
+  if (playset->changev) free(playset->changev);
+  if (playset->pendingv) free(playset->pendingv);
+  free(playset);
+}
+
+/* New.
+ */
+
+struct an_playset *an_playset_new(struct an_animator *animator) {
+  if (!animator) return 0;
+  struct an_playset *playset=calloc(1,sizeof(struct an_playset));
+  if (!playset) return 0;
+  playset->animator=animator;
+  playset->freeid=-1;
+  memset(playset->wheel,0xff,sizeof(playset->wheel));
+  return playset;
+}
+
+/* Grow every array together.
+ */
+
+static int an_playset_require(struct an_playset *playset) {
+  if (playset->c<playset->a) return 0;
+  int na=playset->a+256;
+  if (na>INT_MAX/sizeof(int64_t)) return -1;
+  #define GROW(field,type) { \
+    void *nv=realloc(playset->field,sizeof(type)*na); \
+    if (!nv) return -1; \
+    playset->field=nv; \
+  }
+  GROW(faceidv,int)
+  GROW(framepv,int)
+  GROW(duev,int64_t)
+  GROW(nextv,int)
+  GROW(prevv,int)
+  GROW(slotv,int)
+  GROW(changedv,uint8_t)
+  GROW(changev,int)
+  GROW(pendingv,int)
+  #undef GROW
+  playset->a=na;
+  return 0;
+}
+
+/* Wheel.
+ */
+
+static void an_playset_unschedule(struct an_playset *playset,int id) {
+  int slot=playset->slotv[id];
+  if (slot<0) return;
+  int next=playset->nextv[id],prev=playset->prevv[id];
+  if (prev>=0) playset->nextv[prev]=next;
+  else playset->wheel[slot]=next;
+  if (next>=0) playset->prevv[next]=prev;
+  playset->slotv[id]=-1;
+}
+
+static void an_playset_schedule(struct an_playset *playset,int id) {
+  int64_t due=playset->duev[id];
+  int64_t delta=due-playset->now;
+  int level=0,shift=0;
+  while ((level<AN_WHEEL_LEVELS-1)&&(delta>=(int64_t)AN_WHEEL_SIZE<<shift)) {
+    level++;
+    shift+=AN_WHEEL_BITS;
+  }
+  if (delta>=(int64_t)AN_WHEEL_SIZE<<shift) due=playset->now+((int64_t)AN_WHEEL_SIZE<<shift)-1;
+  int slot=level*AN_WHEEL_SIZE+((due>>shift)&AN_WHEEL_MASK);
+  int next=playset->wheel[slot];
+  playset->nextv[id]=next;
+  playset->prevv[id]=-1;
+  if (next>=0) playset->prevv[next]=id;
+  playset->wheel[slot]=id;
+  playset->slotv[id]=slot;
+}
+
+/* Take a slot's whole list out of the wheel. Returns its first instance.
+ */
+
+static int an_playset_detach_slot(struct an_playset *playset,int slot) {
+  int head=playset->wheel[slot];
+  playset->wheel[slot]=-1;
+  int id=head;
+  for (;id>=0;id=playset->nextv[id]) playset->slotv[id]=-1;
+  return head;
+}
+
+/* Spread the current slot of each level above zero that just came around, down into the levels below.
+ */
+
+static void an_playset_cascade(struct an_playset *playset) {
+  int level=1,shift=AN_WHEEL_BITS;
+  for (;level<AN_WHEEL_LEVELS;level++,shift+=AN_WHEEL_BITS) {
+    if (playset->now&(((int64_t)1<<shift)-1)) break;
+    int id=an_playset_detach_slot(playset,level*AN_WHEEL_SIZE+((playset->now>>shift)&AN_WHEEL_MASK));
+    while (id>=0) {
+      int next=playset->nextv[id];
+      an_playset_schedule(playset,id);
+      id=next;
+    }
+  }
+}
+
+/* Start a frame: Schedule the next one, and note that this one changed, in this update or the next.
+ * If the config changed under us, an out-of-range face or frame starts over at zero.
+ */
+
+static void an_playset_start_frame(struct an_playset *playset,int id,int pending) {
+  int framec=an_animator_count_frames(playset->animator,playset->faceidv[id]);
+  if (framec<1) {
+    playset->faceidv[id]=0;
+    framec=an_animator_count_frames(playset->animator,0);
+  }
+  if ((playset->framepv[id]<0)||(playset->framepv[id]>=framec)) playset->framepv[id]=0;
+  int delay=an_animator_get_frame_delay(playset->animator,playset->faceidv[id],playset->framepv[id]);
+  if (delay<1) delay=1;
+  playset->duev[id]=playset->now+delay;
+  an_playset_unschedule(playset,id);
+  an_playset_schedule(playset,id);
+  if (pending) {
+    if (playset->changedv[id]&2) return;
+    playset->changedv[id]|=2;
+    playset->pendingv[playset->pendingc++]=id;
+  } else {
+    if (playset->changedv[id]&1) return;
+    playset->changedv[id]|=1;
+    playset->changev[playset->changec++]=id;
+  }
+}
+
+/* Add and remove instances.
+ */
+
+int an_playset_add(struct an_playset *playset,int faceid) {
+  if (an_animator_count_frames(playset->animator,faceid)<1) return -1;
+  int id;
+  if (playset->freeid>=0) {
+    id=playset->freeid;
+    playset->freeid=playset->framepv[id];
+  } else {
+    if (an_playset_require(playset)<0) return -1;
+    id=playset->c++;
+    playset->changedv[id]=0;
+  }
+  playset->faceidv[id]=faceid;
+  playset->framepv[id]=0;
+  playset->slotv[id]=-1;
+  an_playset_start_frame(playset,id,1);
+  return id;
+}
+
+int an_playset_remove(struct an_playset *playset,int id) {
+  if ((id<0)||(id>=playset->c)||(playset->faceidv[id]<0)) return -1;
+  an_playset_unschedule(playset,id);
+  playset->faceidv[id]=-1;
+  playset->framepv[id]=playset->freeid;
+  playset->freeid=id;
+  // It might still be pending. Leave it there, update will skip it, or report it again if the id gets reused.
+  return 0;
+}
+
+int an_playset_use_face(struct an_playset *playset,int id,int faceid) {
+  if ((id<0)||(id>=playset->c)||(playset->faceidv[id]<0)) return -1;
+  if (an_animator_count_frames(playset->animator,faceid)<1) return -1;
+  if (faceid==playset->faceidv[id]) return 0;
+  playset->faceidv[id]=faceid;
+  playset->framepv[id]=0;
+  an_playset_start_frame(playset,id,1);
+  return 0;
+}
+
+int an_playset_count(const struct an_playset *playset) {
+  return playset->c;
+}
+
+int an_playset_get_face(const struct an_playset *playset,int id) {
+  if ((id<0)||(id>=playset->c)) return -1;
+  return playset->faceidv[id];
+}
+
+int an_playset_get_frame(const struct an_playset *playset,int id) {
+  if ((id<0)||(id>=playset->c)||(playset->faceidv[id]<0)) return -1;
+  return playset->framepv[id];
+}
+
+/* Tick.
+ * Only the instances due now are touched: Everything in level zero's current slot, after any cascade.
+ */
+
+int an_playset_update(const int **idv,struct an_playset *playset) {
+  int i;
+  for (i=0;i<playset->changec;i++) playset->changedv[playset->changev[i]]&=~1;
+  playset->changec=0;
+  playset->now++;
+
+  // Carry over adds and use_face changes since last time, unless they were removed since.
+  for (i=0;i<playset->pendingc;i++) {
+    int id=playset->pendingv[i];
+    playset->changedv[id]&=~2;
+    if (playset->faceidv[id]<0) continue;
+    if (playset->changedv[id]&1) continue;
+    playset->changedv[id]|=1;
+    playset->changev[playset->changec++]=id;
+  }
+  playset->pendingc=0;
+
+  an_playset_cascade(playset);
+  int id=an_playset_detach_slot(playset,playset->now&AN_WHEEL_MASK);
+  while (id>=0) {
+    int next=playset->nextv[id];
+    playset->framepv[id]++;
+    an_playset_start_frame(playset,id,0);
+    id=next;
+  }
+
+  if (idv) *idv=playset->changev;
+  return playset->changec;
+}
+
+/* Images.
+ */
+
+int an_playset_get_image(void *rgbapp,int *w,int *h,int *stride,struct an_playset *playset,int id) {
+  if ((id<0)||(id>=playset->c)||(playset->faceidv[id]<0)) return -1;
+  return an_animator_get_frame_image(rgbapp,w,h,stride,playset->animator,playset->faceidv[id],playset->framepv[id]);
+}
+
+int an_playset_get_image_bounds(int *x,int *y,int *w,int *h,const struct an_playset *playset,int id) {
+  if ((id<0)||(id>=playset->c)||(playset->faceidv[id]<0)) return 0;
+  return an_animator_get_frame_bounds(x,y,w,h,playset->animator,playset->faceidv[id],playset->framepv[id]);
+}
@@ -40,6 +40,7 @@ struct an_wm {
   int rshift,gshift,bshift;
   int scale;
   int srcw,srch; // Size of most recent image (ie image->(w,h)/scale)
+  int boundx,boundy,boundw,boundh; // Part of the most recent image that might not be background, in its pixels.
   uint32_t bgcolor;
   
   Atom atom_WM_PROTOCOLS;
@@ -189,20 +190,20 @@ static int an_wm_recalculate_output_bounds(struct an_wm *wm) {
   return 0;
 }
 
-/* Scale user's RGBA image into our final-size buffer.
- * Input dimensions must already be stored as (wm->srcw,wm->srch).
+/* Scale a rect of user's RGBA image into the same place in our final-size buffer.
+ * Input dimensions must already be stored as (wm->srcw,wm->srch), and the rect must be within them.
  * Size of (wm->image) must already agree with (scale,dstw,dsth,srcw,srch).
  */
  
-static void an_wm_scale_image(struct an_wm *wm,const void *src,int stride) {
-  const uint8_t *srcrow=src;
-  uint32_t *dst=(void*)wm->image->data;
-  int cpc=wm->image->width*4;
-  int yi=wm->srch;
-  for (;yi-->0;srcrow+=stride) {
+static void an_wm_scale_image(struct an_wm *wm,const void *src,int stride,int x,int y,int w,int h) {
+  const uint8_t *srcrow=(uint8_t*)src+y*stride+(x<<2);
+  uint32_t *dstrow=((uint32_t*)wm->image->data)+y*wm->scale*wm->image->width+x*wm->scale;
+  int cpc=w*wm->scale*4;
+  int yi=h;
+  for (;yi-->0;srcrow+=stride,dstrow+=wm->image->width*wm->scale) {
     const uint8_t *srcp=srcrow;
-    uint32_t *dststart=dst;
-    int xi=wm->srcw;
+    uint32_t *dst=dstrow;
+    int xi=w;
     for (;xi-->0;srcp+=4) {
       // Nonzero alpha becomes fully opaque, zero alpha becomes background color.
       uint32_t pixel;
@@ -215,7 +216,7 @@ static void an_wm_scale_image(struct an_wm *wm,const void *src,int stride) {
       for (;ri-->0;dst++) *dst=pixel;
     }
     int ri=wm->scale-1;
-    for (;ri-->0;dst+=wm->image->width) memcpy(dst,dststart,cpc);
+    for (dst=dstrow+wm->image->width;ri-->0;dst+=wm->image->width) memcpy(dst,dstrow,cpc);
   }
 }
 
@@ -226,17 +227,67 @@ int an_wm_set_image(
   struct an_wm *wm,
   const void *rgba,
   int w,int h,int stride
+) {
+  return an_wm_set_image_bounds(wm,rgba,w,h,stride,0,0,w,h);
+}
+
+/* Send new image, redrawing only what's opaque now or was last time.
+ * After a resize, everything was last time.
+ */
+ 
+int an_wm_set_image_bounds(
+  struct an_wm *wm,
+  const void *rgba,
+  int w,int h,int stride,
+  int x,int y,int bw,int bh
 ) {
   if (!rgba||(w<1)||(h<1)||(stride<w<<2)) return -1;
+  if (x<0) { bw+=x; x=0; }
+  if (y<0) { bh+=y; y=0; }
+  if (x+bw>w) bw=w-x;
+  if (y+bh>h) bh=h-y;
+  if ((bw<1)||(bh<1)) x=y=bw=bh=0;
   if (wm->dstdirty||(w!=wm->srcw)||(h!=wm->srch)) {
     wm->srcw=w;
     wm->srch=h;
     if (an_wm_recalculate_output_bounds(wm)<0) return -1;
     wm->dstdirty=0;
     XClearWindow(wm->dpy,wm->win);
+    wm->boundx=0;
+    wm->boundy=0;
+    wm->boundw=w;
+    wm->boundh=h;
   }
-  an_wm_scale_image(wm,rgba,stride);
-  XPutImage(wm->dpy,wm->win,wm->gc,wm->image,0,0,wm->dstx,wm->dsty,wm->image->width,wm->image->height);
+  
+  // Redraw the union of old and new bounds. Outside the new ones, the image is transparent, so it draws as background.
+  int ux=x,uy=y,uw=bw,uh=bh;
+  if (!uw) {
+    ux=wm->boundx;
+    uy=wm->boundy;
+    uw=wm->boundw;
+    uh=wm->boundh;
+  } else if (wm->boundw) {
+    int r=ux+uw,b=uy+uh;
+    if (wm->boundx<ux) ux=wm->boundx;
+    if (wm->boundy<uy) uy=wm->boundy;
+    if (wm->boundx+wm->boundw>r) r=wm->boundx+wm->boundw;
+    if (wm->boundy+wm->boundh>b) b=wm->boundy+wm->boundh;
+    uw=r-ux;
+    uh=b-uy;
+  }
+  wm->boundx=x;
+  wm->boundy=y;
+  wm->boundw=bw;
+  wm->boundh=bh;
+  if (!uw) return 0;
+  
+  an_wm_scale_image(wm,rgba,stride,ux,uy,uw,uh);
+  XPutImage(
+    wm->dpy,wm->win,wm->gc,wm->image,
+    ux*wm->scale,uy*wm->scale,
+    wm->dstx+ux*wm->scale,wm->dsty+uy*wm->scale,
+    uw*wm->scale,uh*wm->scale
+  );
   return 0;
 }
 
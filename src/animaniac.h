@@ -15,6 +15,9 @@ struct an_config {
   const char *pngpath;
   const char *cfgpath;
   int rate;
+  int trim;
+  int delta;
+  const char *compilepath; // Compile the config to here, and quit.
 };
 
 // Logs errors.
@@ -45,11 +48,34 @@ struct an_animator *an_animator_new();
 int an_animator_set_image(struct an_animator *animator,const void *src,int srcc,const char *path);
 int an_animator_set_config(struct an_animator *animator,const char *src,int srcc,const char *path);
 
+/* The current config, resolved, in a binary form that an_animator_set_config() loads without parsing.
+ * Not the APNG face. Native byte order, so compile on the machine you'll run on.
+ * Returns length of the new buffer at (*dstpp), caller frees it.
+ */
+int an_animator_compile_config(void *dstpp,const struct an_animator *animator);
+
+/* Replace image in pieces, as it arrives from a pipe or whatever.
+ * The old image stays in effect until an_animator_end_image() succeeds.
+ * If there is no old image, we show frames from the new one as soon as their rows are decoded.
+ * Provide errors are sticky; end reports them.
+ */
+int an_animator_begin_image(struct an_animator *animator);
+int an_animator_provide_image(struct an_animator *animator,const void *src,int srcc);
+int an_animator_end_image(struct an_animator *animator,const char *path);
+
+/* We decode only the part of the image that the config's frames use, and keep only the frames' own rects of that.
+ * True if the config changed since, and now needs pixels we didn't keep. Call an_animator_set_image() again.
+ */
+int an_animator_needs_image(const struct an_animator *animator);
+
 /* faceid are 0..c-1.
  * Each face has a name, and you can borrow it.
+ * If the image is an APNG, its animation is one more face named "apng", after the config's.
  */
 int an_animator_count_faces(const struct an_animator *animator);
 int an_animator_get_face_name(char **name,const struct an_animator *animator,int faceid);
+int an_animator_count_frames(const struct an_animator *animator,int faceid);
+int an_animator_get_frame_delay(const struct an_animator *animator,int faceid,int framep); // => frames
 int an_animator_use_face(struct an_animator *animator,int faceid);
 int an_animator_use_face_by_name(struct an_animator *animator,const char *name,int namec);
 
@@ -58,6 +84,16 @@ int an_animator_use_face_by_name(struct an_animator *animator,const char *name,i
  */
 int an_animator_update(struct an_animator *animator);
 
+/* Same as (tickc) updates, but takes about as long as one, however far it goes.
+ * eg to catch up after the clock reports missed frames.
+ */
+int an_animator_advance(struct an_animator *animator,int64_t tickc);
+
+/* Jump to (t) frames into the current face's cycle, from its first frame. Any (t), we wrap it.
+ * Reports the change at the next update. If the frame isn't decoded yet, stays put.
+ */
+int an_animator_seek(struct an_animator *animator,int64_t t);
+
 /* Borrow a pointer to the current image.
  * an_animator_set_image() may invalidate this pointer.
  * It's formatted to plug right in to an_wm_set_image().
@@ -67,6 +103,31 @@ int an_animator_get_image(
   struct an_animator *animator
 );
 
+/* Same, for any frame of any face, regardless of what's playing. For an_playset.
+ * Delta and APNG frames are rebuilt in a buffer shared by all of them, so only the last one you got is valid.
+ */
+int an_animator_get_frame_image(
+  void *rgbapp,int *w,int *h,int *stride,
+  struct an_animator *animator,
+  int faceid,int framep
+);
+
+/* Optionally, measure each frame's bounds of nonzero alpha when the image or config changes.
+ * If we have them for the current image, an_animator_get_image_bounds() fills them in and returns 1.
+ * Otherwise it returns 0 and leaves them alone, and you should assume the whole image.
+ * Empty bounds (w==0) mean the image is entirely transparent.
+ */
+int an_animator_set_trim(struct an_animator *animator,int trim);
+int an_animator_get_image_bounds(int *x,int *y,int *w,int *h,const struct an_animator *animator);
+int an_animator_get_frame_bounds(int *x,int *y,int *w,int *h,const struct an_animator *animator,int faceid,int framep);
+
+/* Optionally, keep every (keyframes)th frame of each face whole, and the others only as changes from the frame before.
+ * Zero or one to keep them all whole (default).
+ * Only the keyframes' rects stay in memory, so any config change will need the image again.
+ * Takes effect at the next image; if we already have one, an_animator_needs_image() says so.
+ */
+int an_animator_set_delta(struct an_animator *animator,int keyframes);
+
 /* (rate,anchor) expect a cut token and return the result or <0.
  * (int) consumes leading and trailing space and returns length consumed, or <0 if no int present.
  */
@@ -74,6 +135,32 @@ int an_eval_rate(const char *src,int srcc); // => frames
 int an_eval_int(int *dst,const char *src,int srcc);
 int an_eval_anchor(const char *src,int srcc);
 
+/* Many playheads over one animator's image and config.
+ * Instances are just a face, a frame, and when the next frame is due. The animator holds everything else (WEAK).
+ * an_playset_update() ticks them all at once, and lists the ones whose frame changed, including new ones and use_face.
+ * It only touches those, so a tick costs about the same for 10 instances or 10000, if they change equally often.
+ * The list is valid until the next update.
+ * Removed ids get reused by later adds.
+ ************************************************************/
+
+struct an_playset;
+
+void an_playset_del(struct an_playset *playset);
+
+struct an_playset *an_playset_new(struct an_animator *animator);
+
+int an_playset_add(struct an_playset *playset,int faceid); // => id
+int an_playset_remove(struct an_playset *playset,int id);
+int an_playset_use_face(struct an_playset *playset,int id,int faceid);
+int an_playset_count(const struct an_playset *playset); // => limit of ids, including removed ones
+int an_playset_get_face(const struct an_playset *playset,int id); // <0 if removed
+int an_playset_get_frame(const struct an_playset *playset,int id);
+
+int an_playset_update(const int **idv,struct an_playset *playset);
+
+int an_playset_get_image(void *rgbapp,int *w,int *h,int *stride,struct an_playset *playset,int id);
+int an_playset_get_image_bounds(int *x,int *y,int *w,int *h,const struct an_playset *playset,int id);
+
 /* Timing.
  ***********************************************************/
  
@@ -83,13 +170,39 @@ void an_clock_del(struct an_clock *clock);
 
 struct an_clock *an_clock_new(int ratehz);
 
+/* Sleep until the next frame is due.
+ * Returns how many frames we missed before this one, if we fell behind.
+ */
 int an_clock_update(struct an_clock *clock);
 
+/* Microseconds until the next frame is due, for fitting background work in between. Can be negative.
+ */
+int an_clock_get_remaining(const struct an_clock *clock);
+
 /* Filesystem.
- * Copied this all from my 'bits' collection... we only actually use an_file_read().
+ * Copied this all from my 'bits' collection... we only actually use an_file_map().
  ************************************************************/
  
 int an_file_read(void *dstpp,const char *path);
+
+/* Map a file read-only, without copying it. Unmap with the same pointer and length.
+ * Falls back to reading, for files that can't be mapped; still use an_file_unmap() after.
+ * Don't hold on to it: If someone truncates the file while it's mapped, touching it raises SIGBUS.
+ */
+int an_file_map(void *dstpp,const char *path);
+void an_file_unmap(void *v,int c);
+
+/* Read a file of any kind in fixed-size pieces, calling (cb) with each. Memory use doesn't depend on the file's size.
+ * Stops if (cb) returns nonzero, and returns the same.
+ */
+int an_file_stream(const char *path,int (*cb)(const void *src,int srcc,void *userdata),void *userdata);
+
+/* Read a file in pieces at your own pace: Open, read until it returns 0 at EOF or <0 on error, then close.
+ * Safe to hold across frames, unlike a mapping: If someone truncates the file meanwhile, reads just come up short.
+ */
+int an_file_open(const char *path);
+int an_file_read_piece(void *dst,int dsta,int fd);
+void an_file_close(int fd);
 int an_file_write(const char *path,const void *src,int srcc);
 int an_dir_read(
   const char *path,
@@ -144,6 +257,15 @@ int an_wm_set_image(
   int w,int h,int stride
 );
 
+/* Same, but only pixels within (x,y,bw,bh) may be opaque, and we only touch that and whatever was opaque last time.
+ */
+int an_wm_set_image_bounds(
+  struct an_wm *wm,
+  const void *rgba,
+  int w,int h,int stride,
+  int x,int y,int bw,int bh
+);
+
 /* PNG decoder and image type.
  ************************************************************/
 
@@ -159,6 +281,9 @@ int an_wm_set_image(
 
 struct png_decoder;
 
+typedef uint32_t (*png_pxrd_fn)(const void *src,int x);
+typedef void (*png_pxwr_fn)(void *dst,int x,uint32_t src);
+
 struct png_image {
   int refc; // 0=immortal
 
@@ -170,15 +295,34 @@ struct png_image {
   int32_t w,h;
   uint8_t depth,colortype;
   
-  // All chunks except IHDR,IDAT,IEND:
+  // All chunks except IHDR,IDAT,IEND, and APNG's acTL,fcTL,fdAT:
   struct png_chunk {
     uint32_t id; // big-endian
     void *v;
     int c;
   } *chunkv;
   int chunkc,chunka;
+  
+  // APNG, if the file has acTL. Each frame is a rect to draw on a canvas the size of the file (canvasw,canvash).
+  // (image) is the rect's pixels, in this image's format, or null if the frame is this image (ie IDAT).
+  // When that's so, this image might be cropped to a region; the frame's pixels are only those inside it.
+  struct png_frame {
+    struct png_image *image; // STRONG
+    int x,y,w,h; // in file pixels
+    int delaynum,delayden; // seconds, as in fcTL, except we've already replaced a zero (delayden) with 100
+    uint8_t dispose,blend;
+  } *framev;
+  int framec,framea;
+  int plays; // zero to loop forever
+  int32_t canvasw,canvash;
 };
 
+#define PNG_DISPOSE_NONE       0 /* Leave the canvas as is. */
+#define PNG_DISPOSE_BACKGROUND 1 /* Clear the frame's rect to transparent black. */
+#define PNG_DISPOSE_PREVIOUS   2 /* Restore the frame's rect to what it was before. */
+#define PNG_BLEND_SOURCE       0 /* Replace the canvas. */
+#define PNG_BLEND_OVER         1 /* Alpha-composite onto the canvas. */
+
 /* Make a static image by initializing to zero (in particular, (refc) must be zero).
  * You can safely (del) static images same as dynamic ones.
  * Cleanup zeroes the struct, so you won't accidentally do something else with it later.
@@ -198,6 +342,45 @@ int png_image_convert(
   const struct png_image *src
 );
 
+/* Convert pixels row by row, for when you don't have the whole image at once.
+ * (chunks) is OPTIONAL, we read PLTE and tRNS from it. We borrow those and they must remain valid.
+ * Rows are packed, ie no filter byte, and (w) is in pixels.
+ */
+struct png_converter;
+typedef void (*png_convert_fn)(const struct png_converter *converter,void *dst,const void *src,int w);
+
+struct png_converter {
+  uint8_t srcdepth,srccolortype;
+  uint8_t dstdepth,dstcolortype;
+  int srcpixelsize,dstpixelsize; // bits
+  png_pxrd_fn rd;
+  png_pxwr_fn wr;
+  const uint8_t *plte; int pltec; // pixels, ie bytes/3
+  const uint8_t *trns; int trnsc;
+  uint8_t lut[1024]; // INDEX: RGBA8 for each index, PLTE and tRNS merged
+  png_convert_fn cvt;
+};
+int png_converter_init(
+  struct png_converter *converter,
+  uint8_t dstdepth,uint8_t dstcolortype,
+  uint8_t srcdepth,uint8_t srccolortype,
+  const struct png_image *chunks
+);
+void png_convert_row(const struct png_converter *converter,void *dst,const void *src,int w);
+
+/* Specialized row converters, see png_convert.c. You shouldn't need these; png_converter_init() uses them.
+ * png_convert_select() returns a (cvt) for the pair, or null if only the generic path can do it.
+ * png_convert_select_palette() is for INDEX sources with a PLTE; they read (lut), so call png_converter_init() first.
+ * png_convert_set_level() chooses kernels explicitly, or <0 to detect the CPU. Returns the level actually in effect.
+ */
+#define PNG_CONVERT_LEVEL_SCALAR 0
+#define PNG_CONVERT_LEVEL_SSE2   1
+#define PNG_CONVERT_LEVEL_SSSE3  2
+#define PNG_CONVERT_LEVEL_AVX2   3
+png_convert_fn png_convert_select(uint8_t dstdepth,uint8_t dstcolortype,uint8_t srcdepth,uint8_t srccolortype);
+png_convert_fn png_convert_select_palette(uint8_t dstdepth,uint8_t dstcolortype,uint8_t srcdepth);
+int png_convert_set_level(int level);
+
 /* Free existing pixels and replace: pixels,stride,pixelsize,w,h,depth,colortype
  */
 int png_image_allocate_pixels(
@@ -208,6 +391,11 @@ int png_image_allocate_pixels(
 
 int png_image_add_chunk_handoff(struct png_image *image,uint32_t id,void *v,int c);
 int png_image_add_chunk_copy(struct png_image *image,uint32_t id,const void *v,int c);
+void png_image_clear_chunks(struct png_image *image);
+
+// Append a zeroed APNG frame, or drop them all.
+struct png_frame *png_image_add_frame(struct png_image *image);
+void png_image_clear_frames(struct png_image *image);
 
 // Return WEAK the first chunk matching (id).
 int png_image_get_chunk_by_id(void *dstpp,const struct png_image *image,uint32_t id);
@@ -220,17 +408,110 @@ int png_pixelsize_for_format(uint8_t depth,uint8_t colortype);
  * INDEX behaves like GRAY (NB It does normalize values).
  * 16-bit channels work, but there can be some data loss.
  */
-typedef uint32_t (*png_pxrd_fn)(const void *src,int x);
-typedef void (*png_pxwr_fn)(void *dst,int x,uint32_t src);
 png_pxrd_fn png_get_pxrd(uint8_t depth,uint8_t colortype);
 png_pxwr_fn png_get_pxwr(uint8_t depth,uint8_t colortype);
 
-// Convenience so you don't have to deal with a decoder, if you've got the full serial data.
+/* Reverse one row's filter. (len) excludes the filter byte.
+ * (pv) is the previous row, already unfiltered, or null for the first row.
+ * (xstride) is bytes per pixel for filter purposes, minimum 1.
+ * png_unfilter_row() uses the fastest kernel available; png_unfilter_row_scalar() is the portable reference.
+ * png_unfilter_set_level() chooses kernels explicitly, or <0 to detect the CPU. Returns the level actually in effect.
+ * You don't need to set level; we detect at the first unfilter.
+ */
+#define PNG_UNFILTER_LEVEL_SCALAR 0
+#define PNG_UNFILTER_LEVEL_SSE2   1
+#define PNG_UNFILTER_LEVEL_AVX2   2
+int png_unfilter_row(uint8_t *dst,const uint8_t *src,const uint8_t *pv,uint8_t filter,int len,int xstride);
+int png_unfilter_row_scalar(uint8_t *dst,const uint8_t *src,const uint8_t *pv,uint8_t filter,int len,int xstride);
+int png_unfilter_set_level(int level);
+
+/* In-tree inflate, see png_inflate.c. The decoder uses it instead of zlib when built with -DPNG_BUILTIN_INFLATE=1.
+ * Output goes to one buffer that will hold the whole decompressed stream, which is also the window.
+ * (dsta) is the most we'll produce; (dst) must have PNG_INFLATE_SLACK more bytes after that, for fast copies.
+ * png_inflate_provide() returns 0 if it wants more input, 1 if the stream or the output buffer is finished, or <0.
+ * Input is buffered internally as needed; you can provide it in pieces of any size.
+ * With png_inflate_set_verify(), we check the stream's Adler-32, if it ends before the output buffer does.
+ */
+#ifndef PNG_BUILTIN_INFLATE
+  #define PNG_BUILTIN_INFLATE 0
+#endif
+#define PNG_INFLATE_SLACK 16
+struct png_inflate;
+void png_inflate_del(struct png_inflate *inflate);
+struct png_inflate *png_inflate_new();
+void png_inflate_reset(struct png_inflate *inflate,void *dst,int dsta);
+int png_inflate_provide(struct png_inflate *inflate,const void *src,int srcc);
+int png_inflate_get_output_size(const struct png_inflate *inflate);
+const char *png_inflate_get_message(const struct png_inflate *inflate);
+void png_inflate_set_verify(struct png_inflate *inflate,int verify);
+
+/* Checksums, see png_checksum.c. Start with zero for CRC and one for Adler, or continue from a previous result.
+ */
+uint32_t png_crc32(uint32_t crc,const void *src,int srcc);
+uint32_t png_adler32(uint32_t adler,const void *src,int srcc);
+
+/* Convenience so you don't have to deal with a decoder, if you've got the full serial data.
+ * png_decode_format() is the same as png_decoder_set_format() on the decoder.
+ */
 struct png_image *png_decode(const void *src,int srcc);
+struct png_image *png_decode_format(const void *src,int srcc,uint8_t depth,uint8_t colortype);
  
 void png_decoder_del(struct png_decoder *decoder);
 struct png_decoder *png_decoder_new();
 
+/* Prepare to decode another file, as if new, but keep what we can from the last one:
+ * Inflate state, row buffers, output format, threading policy, verification, and row callback. The region is cleared.
+ * If nobody else holds the last image, we reuse its pixels when the next one is the same size and format.
+ * png_decoder_recycle_image() hands one back for the same purpose. It takes over your reference.
+ */
+int png_decoder_reset(struct png_decoder *decoder);
+void png_decoder_recycle_image(struct png_decoder *decoder,struct png_image *image);
+
+/* Ask for pixels in some format other than the file's. Must call before the IHDR arrives.
+ * We convert each row as it's decoded, so there's never a native copy of the whole image.
+ * The image's (depth,colortype) will be the requested format; its chunks are still as in the file.
+ * Zero for both to decode in the native format, that's the default.
+ */
+int png_decoder_set_format(struct png_decoder *decoder,uint8_t depth,uint8_t colortype);
+
+/* Decode only part of the image, in file pixels. Must call before the IHDR arrives.
+ * The decoded image covers just the region, clipped to the file's bounds.
+ * If it misses the image entirely, you get the nearest single pixel.
+ * For images under 8 bits per pixel, we may extend it leftward to a byte boundary.
+ * We stop inflating as soon as the region's last row is done, and ignore the rest of the image data.
+ * png_decoder_get_region() tells you what we actually used, after the IHDR.
+ * (w,h) <1 to decode the whole image, that's the default.
+ */
+int png_decoder_set_region(struct png_decoder *decoder,int x,int y,int w,int h);
+int png_decoder_get_region(int *x,int *y,int *w,int *h,const struct png_decoder *decoder);
+
+/* Unfilter and convert on a second thread, while the caller's thread inflates.
+ * (threaded) <0 to decide based on image size (default), 0 never, >0 always.
+ * Must call before the first IDAT.
+ * While threaded, the image's pixels are written from the other thread; don't look until COMPLETE.
+ * Ignored when built with PNG_BUILTIN_INFLATE.
+ */
+int png_decoder_set_threaded(struct png_decoder *decoder,int threaded);
+
+/* Get called with each row of the image as soon as it's finished: unfiltered, converted, and cropped to the region.
+ * (y) is the row in the image, and (row) points into the image's pixels, (stride) bytes long.
+ * Rows always arrive in order, top to bottom, each exactly once.
+ * Uninterlaced images report each row as it's decoded. Interlaced ones report nothing until the last pass,
+ * which completes the rows in order. Return <0 to abort decoding.
+ * When threaded, it's called from the unfilter thread. Must call before the first IDAT; it survives png_decoder_reset().
+ */
+int png_decoder_set_row_callback(
+  struct png_decoder *decoder,
+  int (*cb)(int y,const void *row,void *userdata),
+  void *userdata
+);
+
+/* Check each chunk's CRC, and the image data's Adler-32, failing at the first mismatch. On by default.
+ * Chunks are acted on only after their CRC checks out, except IDAT, which we decode as it arrives.
+ * We can't check Adler-32 when decoding a region, since we stop before the end of the stream.
+ */
+int png_decoder_set_verify(struct png_decoder *decoder,int verify);
+
 /* Give some input to a decoder.
  * You can give it the whole file at once, or one byte at a time, or anything in between.
  * At each call to this function, we advance the decode process as far as possible.
@@ -0,0 +1,193 @@
+/* png_checksum.c
+ * CRC-32 for chunks, and Adler-32 for the zlib stream when we inflate it ourselves.
+ * CRC is slice-by-8 everywhere: Eight tables, so each step folds 8 input bytes with 8 independent lookups.
+ * On x86 with PCLMULQDQ, runs of 64 bytes or more use carry-less multiply folding instead,
+ * per Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ" (same constants as zlib and Linux).
+ */
+
+#include "animaniac.h"
+#include <pthread.h>
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+  #define PNG_CRC_X86 1
+  #include <immintrin.h>
+  #define PNG_CLMUL __attribute__((target("pclmul,sse4.1")))
+#else
+  #define PNG_CRC_X86 0
+#endif
+
+static uint32_t png_crc_table[8][256];
+static int png_crc_level=0; // 0=tables, 1=pclmul
+static pthread_once_t png_crc_once=PTHREAD_ONCE_INIT;
+
+/* Build the tables and detect the CPU, once. Decoders verify on worker threads, so the first call can come from any of them.
+ */
+
+static void png_crc_init() {
+  int i,k;
+  for (i=0;i<256;i++) {
+    uint32_t c=i;
+    for (k=0;k<8;k++) c=(c&1)?(0xedb88320^(c>>1)):(c>>1);
+    png_crc_table[0][i]=c;
+  }
+  for (i=0;i<256;i++) {
+    uint32_t c=png_crc_table[0][i];
+    for (k=1;k<8;k++) {
+      c=png_crc_table[0][c&0xff]^(c>>8);
+      png_crc_table[k][i]=c;
+    }
+  }
+  int level=0;
+  #if PNG_CRC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul")&&__builtin_cpu_supports("sse4.1")) level=1;
+  #endif
+  png_crc_level=level;
+}
+
+/* Slice-by-8 on the inverted register. Any length.
+ */
+
+static uint32_t png_crc32_tables(uint32_t crc,const uint8_t *p,int c) {
+  while ((c>0)&&((uintptr_t)p&7)) {
+    crc=png_crc_table[0][(crc^*(p++))&0xff]^(crc>>8);
+    c--;
+  }
+  for (;c>=8;c-=8,p+=8) {
+    uint32_t a,b;
+    memcpy(&a,p,4);
+    memcpy(&b,p+4,4);
+    #if defined(__BYTE_ORDER__)&&(__BYTE_ORDER__==__ORDER_BIG_ENDIAN__)
+      a=__builtin_bswap32(a);
+      b=__builtin_bswap32(b);
+    #endif
+    a^=crc;
+    crc=
+      png_crc_table[7][a&0xff]^png_crc_table[6][(a>>8)&0xff]^
+      png_crc_table[5][(a>>16)&0xff]^png_crc_table[4][a>>24]^
+      png_crc_table[3][b&0xff]^png_crc_table[2][(b>>8)&0xff]^
+      png_crc_table[1][(b>>16)&0xff]^png_crc_table[0][b>>24];
+  }
+  while (c-->0) {
+    crc=png_crc_table[0][(crc^*(p++))&0xff]^(crc>>8);
+  }
+  return crc;
+}
+
+/* PCLMULQDQ folding on the inverted register. (c) must be a multiple of 16, at least 64.
+ * Four 128-bit accumulators fold 64 bytes per step, then fold together, then Barrett reduction to 32 bits.
+ */
+
+#if PNG_CRC_X86
+
+PNG_CLMUL static uint32_t png_crc32_clmul(uint32_t crc,const uint8_t *p,int c) {
+  const __m128i k1k2=_mm_set_epi64x(0x01c6e41596ll,0x0154442bd4ll);
+  const __m128i k3k4=_mm_set_epi64x(0x00ccaa009ell,0x01751997d0ll);
+  const __m128i k5k0=_mm_set_epi64x(0,0x0163cd6124ll);
+  const __m128i poly=_mm_set_epi64x(0x01f7011641ll,0x01db710641ll);
+  const __m128i mask32=_mm_setr_epi32(~0,0,~0,0);
+  __m128i x0,x1,x2,x3,x4,x5,x6,x7,x8;
+
+  x1=_mm_loadu_si128((const __m128i*)p);
+  x2=_mm_loadu_si128((const __m128i*)(p+16));
+  x3=_mm_loadu_si128((const __m128i*)(p+32));
+  x4=_mm_loadu_si128((const __m128i*)(p+48));
+  x1=_mm_xor_si128(x1,_mm_cvtsi32_si128(crc));
+  p+=64;
+  c-=64;
+
+  for (;c>=64;c-=64,p+=64) {
+    x5=_mm_clmulepi64_si128(x1,k1k2,0x00);
+    x6=_mm_clmulepi64_si128(x2,k1k2,0x00);
+    x7=_mm_clmulepi64_si128(x3,k1k2,0x00);
+    x8=_mm_clmulepi64_si128(x4,k1k2,0x00);
+    x1=_mm_clmulepi64_si128(x1,k1k2,0x11);
+    x2=_mm_clmulepi64_si128(x2,k1k2,0x11);
+    x3=_mm_clmulepi64_si128(x3,k1k2,0x11);
+    x4=_mm_clmulepi64_si128(x4,k1k2,0x11);
+    x1=_mm_xor_si128(_mm_xor_si128(x1,x5),_mm_loadu_si128((const __m128i*)p));
+    x2=_mm_xor_si128(_mm_xor_si128(x2,x6),_mm_loadu_si128((const __m128i*)(p+16)));
+    x3=_mm_xor_si128(_mm_xor_si128(x3,x7),_mm_loadu_si128((const __m128i*)(p+32)));
+    x4=_mm_xor_si128(_mm_xor_si128(x4,x8),_mm_loadu_si128((const __m128i*)(p+48)));
+  }
+
+  #define FOLD(next) \
+    x5=_mm_clmulepi64_si128(x1,k3k4,0x00); \
+    x1=_mm_clmulepi64_si128(x1,k3k4,0x11); \
+    x1=_mm_xor_si128(_mm_xor_si128(x1,next),x5);
+  FOLD(x2)
+  FOLD(x3)
+  FOLD(x4)
+  for (;c>=16;c-=16,p+=16) {
+    x2=_mm_loadu_si128((const __m128i*)p);
+    FOLD(x2)
+  }
+  #undef FOLD
+
+  // 128 to 64 bits.
+  x2=_mm_clmulepi64_si128(x1,k3k4,0x10);
+  x1=_mm_xor_si128(_mm_srli_si128(x1,8),x2);
+  x2=_mm_srli_si128(x1,4);
+  x1=_mm_and_si128(x1,mask32);
+  x1=_mm_clmulepi64_si128(x1,k5k0,0x00);
+  x1=_mm_xor_si128(x1,x2);
+
+  // Barrett reduction to 32 bits.
+  x0=_mm_and_si128(x1,mask32);
+  x0=_mm_clmulepi64_si128(x0,poly,0x10);
+  x0=_mm_and_si128(x0,mask32);
+  x0=_mm_clmulepi64_si128(x0,poly,0x00);
+  x1=_mm_xor_si128(x1,x0);
+  return _mm_extract_epi32(x1,1);
+}
+
+#endif
+
+/* CRC-32.
+ */
+
+uint32_t png_crc32(uint32_t crc,const void *src,int srcc) {
+  pthread_once(&png_crc_once,png_crc_init);
+  const uint8_t *p=src;
+  crc=~crc;
+  #if PNG_CRC_X86
+    if ((png_crc_level>0)&&(srcc>=64)) {
+      int c=srcc&~15;
+      crc=png_crc32_clmul(crc,p,c);
+      p+=c;
+      srcc-=c;
+    }
+  #endif
+  crc=png_crc32_tables(crc,p,srcc);
+  return ~crc;
+}
+
+/* Adler-32.
+ * 5552 is the most bytes we can sum before (b) might overflow 32 bits.
+ */
+
+uint32_t png_adler32(uint32_t adler,const void *src,int srcc) {
+  const uint8_t *p=src;
+  uint32_t a=adler&0xffff,b=adler>>16;
+  while (srcc>0) {
+    int c=(srcc<5552)?srcc:5552;
+    srcc-=c;
+    for (;c>=8;c-=8,p+=8) {
+      a+=p[0]; b+=a;
+      a+=p[1]; b+=a;
+      a+=p[2]; b+=a;
+      a+=p[3]; b+=a;
+      a+=p[4]; b+=a;
+      a+=p[5]; b+=a;
+      a+=p[6]; b+=a;
+      a+=p[7]; b+=a;
+    }
+    for (;c>0;c--,p++) {
+      a+=*p;
+      b+=a;
+    }
+    a%=65521;
+    b%=65521;
+  }
+  return (b<<16)|a;
+}
@@ -0,0 +1,436 @@
+/* png_convert.c
+ * Row converters specialized per format pair, for the pairs we actually use.
+ * png_converter_init() asks us first, and falls back to the generic pixel accessors if we have nothing.
+ * Results must match the generic path exactly: 16-bit channels narrow by taking the high byte,
+ * and sub-byte gray expands by bit replication.
+ * On x86 we pick SSE2, SSSE3, or AVX2 kernels at runtime, same idea as png_unfilter.c.
+ *
+ * Indexed sources read the converter's (lut), PLTE and tRNS merged into 256 RGBA8 entries.
+ * Sub-byte indices can only reach the first 16 entries, so with SSSE3 we keep those as four 16-byte
+ * channel planes and look up 16 pixels per shuffle.
+ */
+
+#include "animaniac.h"
+#include <pthread.h>
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+  #define PNG_CONVERT_X86 1
+  #include <immintrin.h>
+  #define PNG_SSE2 __attribute__((target("sse2")))
+  #define PNG_SSSE3 __attribute__((target("ssse3")))
+  #define PNG_AVX2 __attribute__((target("avx2")))
+#else
+  #define PNG_CONVERT_X86 0
+#endif
+
+/* Scalar: Anything to RGBA8, one pixel at a time with each channel as an expression of (s).
+ */
+
+#define PNG_CONVERT_RGBA8(name,srcbytes,r,g,b,a) \
+  static void png_convert_row_##name##_rgba8(const struct png_converter *converter,void *dst,const void *src,int w) { \
+    uint8_t *dstp=dst; \
+    const uint8_t *s=src; \
+    for (;w-->0;dstp+=4,s+=srcbytes) { \
+      dstp[0]=(r); \
+      dstp[1]=(g); \
+      dstp[2]=(b); \
+      dstp[3]=(a); \
+    } \
+  }
+
+PNG_CONVERT_RGBA8(y8,1,s[0],s[0],s[0],0xff)
+PNG_CONVERT_RGBA8(y16,2,s[0],s[0],s[0],0xff)
+PNG_CONVERT_RGBA8(ya8,2,s[0],s[0],s[0],s[1])
+PNG_CONVERT_RGBA8(ya16,4,s[0],s[0],s[0],s[2])
+PNG_CONVERT_RGBA8(rgb8,3,s[0],s[1],s[2],0xff)
+PNG_CONVERT_RGBA8(rgb16,6,s[0],s[2],s[4],0xff)
+
+#undef PNG_CONVERT_RGBA8
+
+/* Scalar: Sub-byte gray to RGBA8, a whole source byte at a time.
+ * (scale) replicates the bits to fill a byte.
+ */
+
+#define PNG_CONVERT_GRAY_SMALL(depth,scale) \
+  static void png_convert_row_y##depth##_rgba8(const struct png_converter *converter,void *dst,const void *src,int w) { \
+    uint8_t *dstp=dst; \
+    const uint8_t *s=src; \
+    const uint8_t mask=(1<<depth)-1; \
+    for (;w>0;s++) { \
+      int shift=8-depth; \
+      for (;(shift>=0)&&(w>0);shift-=depth,w--,dstp+=4) { \
+        uint8_t y=((*s>>shift)&mask)*scale; \
+        dstp[0]=dstp[1]=dstp[2]=y; \
+        dstp[3]=0xff; \
+      } \
+    } \
+  }
+
+PNG_CONVERT_GRAY_SMALL(1,0xff)
+PNG_CONVERT_GRAY_SMALL(2,0x55)
+PNG_CONVERT_GRAY_SMALL(4,0x11)
+
+#undef PNG_CONVERT_GRAY_SMALL
+
+/* Scalar: 16-bit to 8-bit, same colortype. Keep every other byte.
+ */
+
+static void png_convert_row_narrow16(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  int c=w*(converter->srcpixelsize>>4);
+  for (;c-->0;dstp++,s+=2) *dstp=*s;
+}
+
+/* Scalar: Indexed to RGBA8, one table entry per pixel.
+ * Sub-byte depths unpack a whole source byte per step.
+ */
+
+static void png_convert_row_i8_rgba8(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  for (;w-->0;dstp+=4,s++) memcpy(dstp,converter->lut+((*s)<<2),4);
+}
+
+#define PNG_CONVERT_INDEX_SMALL(depth) \
+  static void png_convert_row_i##depth##_rgba8(const struct png_converter *converter,void *dst,const void *src,int w) { \
+    uint8_t *dstp=dst; \
+    const uint8_t *s=src; \
+    const uint8_t mask=(1<<depth)-1; \
+    for (;w>=8/depth;w-=8/depth,s++) { \
+      int shift=8-depth; \
+      for (;shift>=0;shift-=depth,dstp+=4) memcpy(dstp,converter->lut+(((*s>>shift)&mask)<<2),4); \
+    } \
+    if (w>0) { \
+      int shift=8-depth; \
+      for (;w-->0;shift-=depth,dstp+=4) memcpy(dstp,converter->lut+(((*s>>shift)&mask)<<2),4); \
+    } \
+  }
+
+PNG_CONVERT_INDEX_SMALL(1)
+PNG_CONVERT_INDEX_SMALL(2)
+PNG_CONVERT_INDEX_SMALL(4)
+
+#undef PNG_CONVERT_INDEX_SMALL
+
+#if PNG_CONVERT_X86
+
+/* Keep the high byte of each big-endian 16-bit channel, 16 channels from 32 bytes.
+ */
+
+static PNG_SSE2 inline __m128i png_narrow16_sse2(const uint8_t *s) {
+  __m128i mask=_mm_set1_epi16(0x00ff);
+  __m128i a=_mm_and_si128(_mm_loadu_si128((const __m128i*)s),mask);
+  __m128i b=_mm_and_si128(_mm_loadu_si128((const __m128i*)(s+16)),mask);
+  return _mm_packus_epi16(a,b);
+}
+
+/* Expand 16 gray bytes to 16 RGBA8 pixels (64 bytes).
+ */
+
+static PNG_SSE2 inline void png_expand_y8_sse2(uint8_t *dst,__m128i y) {
+  __m128i ff=_mm_set1_epi8(-1);
+  __m128i yylo=_mm_unpacklo_epi8(y,y),yyhi=_mm_unpackhi_epi8(y,y);
+  __m128i yalo=_mm_unpacklo_epi8(y,ff),yahi=_mm_unpackhi_epi8(y,ff);
+  _mm_storeu_si128((__m128i*)dst,_mm_unpacklo_epi16(yylo,yalo));
+  _mm_storeu_si128((__m128i*)(dst+16),_mm_unpackhi_epi16(yylo,yalo));
+  _mm_storeu_si128((__m128i*)(dst+32),_mm_unpacklo_epi16(yyhi,yahi));
+  _mm_storeu_si128((__m128i*)(dst+48),_mm_unpackhi_epi16(yyhi,yahi));
+}
+
+/* Expand 8 gray+alpha pairs (16 bytes) to 8 RGBA8 pixels (32 bytes).
+ */
+
+static PNG_SSE2 inline void png_expand_ya8_sse2(uint8_t *dst,__m128i ya) {
+  __m128i y=_mm_and_si128(ya,_mm_set1_epi16(0x00ff));
+  __m128i yy=_mm_or_si128(y,_mm_slli_epi16(y,8));
+  _mm_storeu_si128((__m128i*)dst,_mm_unpacklo_epi16(yy,ya));
+  _mm_storeu_si128((__m128i*)(dst+16),_mm_unpackhi_epi16(yy,ya));
+}
+
+static PNG_SSE2 void png_convert_row_y8_rgba8_sse2(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  for (;w>=16;w-=16,s+=16,dstp+=64) png_expand_y8_sse2(dstp,_mm_loadu_si128((const __m128i*)s));
+  png_convert_row_y8_rgba8(converter,dstp,s,w);
+}
+
+static PNG_SSE2 void png_convert_row_y16_rgba8_sse2(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  for (;w>=16;w-=16,s+=32,dstp+=64) png_expand_y8_sse2(dstp,png_narrow16_sse2(s));
+  png_convert_row_y16_rgba8(converter,dstp,s,w);
+}
+
+static PNG_SSE2 void png_convert_row_ya8_rgba8_sse2(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  for (;w>=8;w-=8,s+=16,dstp+=32) png_expand_ya8_sse2(dstp,_mm_loadu_si128((const __m128i*)s));
+  png_convert_row_ya8_rgba8(converter,dstp,s,w);
+}
+
+static PNG_SSE2 void png_convert_row_ya16_rgba8_sse2(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  for (;w>=8;w-=8,s+=32,dstp+=32) png_expand_ya8_sse2(dstp,png_narrow16_sse2(s));
+  png_convert_row_ya16_rgba8(converter,dstp,s,w);
+}
+
+static PNG_SSE2 void png_convert_row_narrow16_sse2(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  int c=w*(converter->srcpixelsize>>4);
+  for (;c>=16;c-=16,s+=32,dstp+=16) _mm_storeu_si128((__m128i*)dstp,png_narrow16_sse2(s));
+  for (;c-->0;dstp++,s+=2) *dstp=*s;
+}
+
+/* RGB8 to RGBA8 with a byte shuffle, 4 pixels per shuffle.
+ * Each load takes 16 bytes to use 12, so we stop 6 pixels short of the end and finish with scalar.
+ */
+
+static PNG_SSSE3 void png_convert_row_rgb8_rgba8_ssse3(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  __m128i shuf=_mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+  __m128i alpha=_mm_set1_epi32(0xff000000);
+  for (;w>=18;w-=16,s+=48,dstp+=64) {
+    __m128i a=_mm_loadu_si128((const __m128i*)s);
+    __m128i b=_mm_loadu_si128((const __m128i*)(s+12));
+    __m128i c=_mm_loadu_si128((const __m128i*)(s+24));
+    __m128i d=_mm_loadu_si128((const __m128i*)(s+36));
+    _mm_storeu_si128((__m128i*)dstp,_mm_or_si128(_mm_shuffle_epi8(a,shuf),alpha));
+    _mm_storeu_si128((__m128i*)(dstp+16),_mm_or_si128(_mm_shuffle_epi8(b,shuf),alpha));
+    _mm_storeu_si128((__m128i*)(dstp+32),_mm_or_si128(_mm_shuffle_epi8(c,shuf),alpha));
+    _mm_storeu_si128((__m128i*)(dstp+48),_mm_or_si128(_mm_shuffle_epi8(d,shuf),alpha));
+  }
+  for (;w>=6;w-=4,s+=12,dstp+=16) {
+    __m128i a=_mm_loadu_si128((const __m128i*)s);
+    _mm_storeu_si128((__m128i*)dstp,_mm_or_si128(_mm_shuffle_epi8(a,shuf),alpha));
+  }
+  png_convert_row_rgb8_rgba8(converter,dstp,s,w);
+}
+
+/* Split the first 16 (lut) entries into R,G,B,A planes of 16 bytes each.
+ */
+
+static void png_palette_planes(uint8_t *planes,const struct png_converter *converter) {
+  const uint8_t *src=converter->lut;
+  int i=0;
+  for (;i<16;i++,src+=4) {
+    planes[i]=src[0];
+    planes[16+i]=src[1];
+    planes[32+i]=src[2];
+    planes[48+i]=src[3];
+  }
+}
+
+/* Look up 16 indices (0..15) and write 16 RGBA8 pixels (64 bytes).
+ */
+
+static PNG_SSSE3 inline void png_palette_expand_ssse3(uint8_t *dst,__m128i ix,__m128i r,__m128i g,__m128i b,__m128i a) {
+  r=_mm_shuffle_epi8(r,ix);
+  g=_mm_shuffle_epi8(g,ix);
+  b=_mm_shuffle_epi8(b,ix);
+  a=_mm_shuffle_epi8(a,ix);
+  __m128i rglo=_mm_unpacklo_epi8(r,g),rghi=_mm_unpackhi_epi8(r,g);
+  __m128i balo=_mm_unpacklo_epi8(b,a),bahi=_mm_unpackhi_epi8(b,a);
+  _mm_storeu_si128((__m128i*)dst,_mm_unpacklo_epi16(rglo,balo));
+  _mm_storeu_si128((__m128i*)(dst+16),_mm_unpackhi_epi16(rglo,balo));
+  _mm_storeu_si128((__m128i*)(dst+32),_mm_unpacklo_epi16(rghi,bahi));
+  _mm_storeu_si128((__m128i*)(dst+48),_mm_unpackhi_epi16(rghi,bahi));
+}
+
+#define PNG_PALETTE_BEGIN \
+  uint8_t planes[64]; \
+  png_palette_planes(planes,converter); \
+  __m128i r=_mm_loadu_si128((const __m128i*)planes); \
+  __m128i g=_mm_loadu_si128((const __m128i*)(planes+16)); \
+  __m128i b=_mm_loadu_si128((const __m128i*)(planes+32)); \
+  __m128i a=_mm_loadu_si128((const __m128i*)(planes+48)); \
+  uint8_t *dstp=dst; \
+  const uint8_t *s=src;
+
+/* 4-bit: 16 source bytes make 32 pixels. High nibble first.
+ */
+
+static PNG_SSSE3 void png_convert_row_i4_rgba8_ssse3(const struct png_converter *converter,void *dst,const void *src,int w) {
+  PNG_PALETTE_BEGIN
+  __m128i lomask=_mm_set1_epi8(0x0f);
+  for (;w>=32;w-=32,s+=16,dstp+=128) {
+    __m128i v=_mm_loadu_si128((const __m128i*)s);
+    __m128i hi=_mm_and_si128(_mm_srli_epi16(v,4),lomask);
+    __m128i lo=_mm_and_si128(v,lomask);
+    png_palette_expand_ssse3(dstp,_mm_unpacklo_epi8(hi,lo),r,g,b,a);
+    png_palette_expand_ssse3(dstp+64,_mm_unpackhi_epi8(hi,lo),r,g,b,a);
+  }
+  png_convert_row_i4_rgba8(converter,dstp,s,w);
+}
+
+/* 2-bit: 16 source bytes make 64 pixels.
+ */
+
+static PNG_SSSE3 void png_convert_row_i2_rgba8_ssse3(const struct png_converter *converter,void *dst,const void *src,int w) {
+  PNG_PALETTE_BEGIN
+  __m128i mask=_mm_set1_epi8(0x03);
+  for (;w>=64;w-=64,s+=16,dstp+=256) {
+    __m128i v=_mm_loadu_si128((const __m128i*)s);
+    __m128i p0=_mm_and_si128(_mm_srli_epi16(v,6),mask);
+    __m128i p1=_mm_and_si128(_mm_srli_epi16(v,4),mask);
+    __m128i p2=_mm_and_si128(_mm_srli_epi16(v,2),mask);
+    __m128i p3=_mm_and_si128(v,mask);
+    __m128i p01lo=_mm_unpacklo_epi8(p0,p1),p01hi=_mm_unpackhi_epi8(p0,p1);
+    __m128i p23lo=_mm_unpacklo_epi8(p2,p3),p23hi=_mm_unpackhi_epi8(p2,p3);
+    png_palette_expand_ssse3(dstp,_mm_unpacklo_epi16(p01lo,p23lo),r,g,b,a);
+    png_palette_expand_ssse3(dstp+64,_mm_unpackhi_epi16(p01lo,p23lo),r,g,b,a);
+    png_palette_expand_ssse3(dstp+128,_mm_unpacklo_epi16(p01hi,p23hi),r,g,b,a);
+    png_palette_expand_ssse3(dstp+192,_mm_unpackhi_epi16(p01hi,p23hi),r,g,b,a);
+  }
+  png_convert_row_i2_rgba8(converter,dstp,s,w);
+}
+
+/* 1-bit: 2 source bytes make 16 pixels.
+ * Broadcast each byte across 8 lanes, then test a different bit in each lane.
+ */
+
+static PNG_SSSE3 void png_convert_row_i1_rgba8_ssse3(const struct png_converter *converter,void *dst,const void *src,int w) {
+  PNG_PALETTE_BEGIN
+  __m128i spread=_mm_setr_epi8(0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1);
+  __m128i bits=_mm_setr_epi8(-128,64,32,16,8,4,2,1,-128,64,32,16,8,4,2,1);
+  __m128i one=_mm_set1_epi8(1);
+  for (;w>=16;w-=16,s+=2,dstp+=64) {
+    uint16_t pair;
+    memcpy(&pair,s,2);
+    __m128i v=_mm_shuffle_epi8(_mm_cvtsi32_si128(pair),spread);
+    __m128i ix=_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v,bits),bits),one);
+    png_palette_expand_ssse3(dstp,ix,r,g,b,a);
+  }
+  png_convert_row_i1_rgba8(converter,dstp,s,w);
+}
+
+#undef PNG_PALETTE_BEGIN
+
+/* 8-bit: Gather 8 table entries at a time.
+ */
+
+static PNG_AVX2 void png_convert_row_i8_rgba8_avx2(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *s=src;
+  const int *lut=(const int*)converter->lut;
+  for (;w>=8;w-=8,s+=8,dstp+=32) {
+    __m256i ix=_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)s));
+    _mm256_storeu_si256((__m256i*)dstp,_mm256_i32gather_epi32(lut,ix,4));
+  }
+  png_convert_row_i8_rgba8(converter,dstp,s,w);
+}
+
+#endif
+
+/* Choose kernels.
+ * Decoders pick converters on worker threads: Detect the CPU once, and keep the chosen level atomic.
+ * (png_convert_level) <0 means use what we detected.
+ */
+
+static int png_convert_level=-1;
+static int png_convert_detected=PNG_CONVERT_LEVEL_SCALAR;
+static pthread_once_t png_convert_once=PTHREAD_ONCE_INIT;
+
+static void png_convert_detect() {
+  #if PNG_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) png_convert_detected=PNG_CONVERT_LEVEL_SSE2;
+    if (__builtin_cpu_supports("ssse3")) png_convert_detected=PNG_CONVERT_LEVEL_SSSE3;
+    if (__builtin_cpu_supports("avx2")) png_convert_detected=PNG_CONVERT_LEVEL_AVX2;
+  #endif
+}
+
+static int png_convert_get_level() {
+  int level=__atomic_load_n(&png_convert_level,__ATOMIC_RELAXED);
+  if (level>=0) return level;
+  pthread_once(&png_convert_once,png_convert_detect);
+  return png_convert_detected;
+}
+
+int png_convert_set_level(int level) {
+  if (level<0) {
+    pthread_once(&png_convert_once,png_convert_detect);
+    level=png_convert_detected;
+  } else {
+    #if PNG_CONVERT_X86
+      if (level>PNG_CONVERT_LEVEL_AVX2) level=PNG_CONVERT_LEVEL_AVX2;
+    #else
+      if (level>PNG_CONVERT_LEVEL_SCALAR) level=PNG_CONVERT_LEVEL_SCALAR;
+    #endif
+  }
+  __atomic_store_n(&png_convert_level,level,__ATOMIC_RELAXED);
+  return level;
+}
+
+/* Find a specialized kernel.
+ * INDEX here means no PLTE, so it reads like GRAY; the caller handles real palettes.
+ */
+
+png_convert_fn png_convert_select(uint8_t dstdepth,uint8_t dstcolortype,uint8_t srcdepth,uint8_t srccolortype) {
+  int level=png_convert_get_level();
+  if (srccolortype==PNG_COLORTYPE_INDEX) srccolortype=PNG_COLORTYPE_GRAY;
+
+  #if PNG_CONVERT_X86
+    #define PICK(scalar,sse2) return (level>=PNG_CONVERT_LEVEL_SSE2)?(sse2):(scalar);
+  #else
+    #define PICK(scalar,sse2) return (scalar);
+  #endif
+
+  // 16 to 8 with the same colortype.
+  if ((srcdepth==16)&&(dstdepth==8)&&(srccolortype==dstcolortype)) {
+    PICK(png_convert_row_narrow16,png_convert_row_narrow16_sse2)
+  }
+
+  // Anything to RGBA8.
+  if ((dstdepth==8)&&(dstcolortype==PNG_COLORTYPE_RGBA)) switch (srccolortype) {
+    case PNG_COLORTYPE_GRAY: switch (srcdepth) {
+        case 1: return png_convert_row_y1_rgba8;
+        case 2: return png_convert_row_y2_rgba8;
+        case 4: return png_convert_row_y4_rgba8;
+        case 8: PICK(png_convert_row_y8_rgba8,png_convert_row_y8_rgba8_sse2)
+        case 16: PICK(png_convert_row_y16_rgba8,png_convert_row_y16_rgba8_sse2)
+      } break;
+    case PNG_COLORTYPE_GRAYA: switch (srcdepth) {
+        case 8: PICK(png_convert_row_ya8_rgba8,png_convert_row_ya8_rgba8_sse2)
+        case 16: PICK(png_convert_row_ya16_rgba8,png_convert_row_ya16_rgba8_sse2)
+      } break;
+    case PNG_COLORTYPE_RGB: switch (srcdepth) {
+        case 8: {
+            #if PNG_CONVERT_X86
+              if (level>=PNG_CONVERT_LEVEL_SSSE3) return png_convert_row_rgb8_rgba8_ssse3;
+            #endif
+            return png_convert_row_rgb8_rgba8;
+          }
+        case 16: return png_convert_row_rgb16_rgba8;
+      } break;
+  }
+
+  #undef PICK
+  return 0;
+}
+
+/* Find a palette kernel.
+ */
+
+png_convert_fn png_convert_select_palette(uint8_t dstdepth,uint8_t dstcolortype,uint8_t srcdepth) {
+  int level=png_convert_get_level();
+  if ((dstdepth!=8)||(dstcolortype!=PNG_COLORTYPE_RGBA)) return 0;
+  #if PNG_CONVERT_X86
+    if (level>=PNG_CONVERT_LEVEL_SSSE3) switch (srcdepth) {
+      case 1: return png_convert_row_i1_rgba8_ssse3;
+      case 2: return png_convert_row_i2_rgba8_ssse3;
+      case 4: return png_convert_row_i4_rgba8_ssse3;
+    }
+    if ((level>=PNG_CONVERT_LEVEL_AVX2)&&(srcdepth==8)) return png_convert_row_i8_rgba8_avx2;
+  #endif
+  switch (srcdepth) {
+    case 1: return png_convert_row_i1_rgba8;
+    case 2: return png_convert_row_i2_rgba8;
+    case 4: return png_convert_row_i4_rgba8;
+    case 8: return png_convert_row_i8_rgba8;
+  }
+  return 0;
+}
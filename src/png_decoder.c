@@ -1,6 +1,8 @@
 #include "animaniac.h"
 #include <stdarg.h>
 #include <zlib.h>
+#include <pthread.h>
+#include <unistd.h>
 
 /* Decoder object.
  */
@@ -11,6 +13,35 @@
 #define PNG_PSTATUS_IDAT      3
 #define PNG_PSTATUS_CRC       4
 #define PNG_PSTATUS_VERIFY    5
+
+// Pipelined decode: Above this much filtered data, we unfilter on a second thread by default.
+#define PNG_THREAD_THRESHOLD 0x100000
+#define PNG_RING_BLOCKC 4
+#define PNG_RING_BLOCK_SIZE 0x10000
+
+/* Inflated data handed from the input thread to the unfilter thread.
+ * Blocks are arbitrary spans of the filtered stream; rows may straddle them.
+ * The consumer owns blocks (blockp..blockp+blockc-1), and the producer fills the next one after that.
+ */
+struct png_ring {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; // broadcast on any change
+  int joined;
+  struct png_ring_block {
+    uint8_t *v;
+    int c;
+  } blockv[PNG_RING_BLOCKC];
+  int blocka; // capacity of each block
+  int blockp,blockc;
+  int fillp; // block the producer is filling
+  int eof; // producer is done
+  int abort; // consumer should stop, eg we're being deleted
+  int failed; // consumer failed; (message) says why
+  int done; // consumer has all the rows it needs
+  char message[256];
+  int rowc; // consumer: bytes of (decoder->rowbuf) filled from a straddling row
+};
  
 struct png_decoder {
 
@@ -21,6 +52,7 @@ struct png_decoder {
   // Private status.
   int pstatus;
   int have_IHDR;
+  int have_IDAT;
   int have_IEND;
   
   // Intake buffer. Long enough to hold signature, chunk header, or CRC.
@@ -34,21 +66,125 @@ struct png_decoder {
   int chunkc; // amount actually read
   int chunka; // expected total length
   int idatexpect; // counts down while receiving IDAT body
+  uint32_t crc; // running CRC of the current chunk's type and body, when (verify)
+  int verify;
   
   // Image decode state.
   uint8_t *rowbuf;
-  int rowbufc; // includes filter byte
-  int y;
+  int rowbufc; // includes filter byte; varies per pass
+  int rowbufa;
+  int y; // row within the current pass
   int xstride; // bytes pixel-to-pixel for filter purposes
   z_stream *z;
+  int zend; // zlib reported the end of the stream, so it has checked the Adler-32
+  
+  // Output format, if the caller wants one other than the file's.
+  uint8_t dstdepth,dstcolortype;
+  int convert;
+  struct png_converter converter; // only when (convert)
+  int converter_ready;
+  
+  // Native format, from IHDR.
+  int w,h;
+  uint8_t depth,colortype;
+  int pixelsize; // bits
+  int stride; // bytes, excluding filter byte
+  
+  // Interlace. Uninterlaced images are one pass covering the whole image.
+  // When interlaced or converting, we unfilter into (unfv) in the native format, then convert and/or scatter into (image).
+  int interlace;
+  int pass; // 0..passc-1, or passc when pixels are complete
+  int passc; // 1 or 7
+  int passx,passy,passdx,passdy; // first pixel and spacing of the current pass
+  int passw,passh; // pixels in the current pass
+  int passstride; // bytes per row in the current pass, native, excluding filter byte
+  int direct; // native, uninterlaced, and uncropped: unfilter straight into (image)
+  uint8_t *unfv; // 2 rows of (stride), unless (direct)
+  uint8_t *cvtrow; // interlaced and converting: one output row, before scattering
+  int unfva,cvtrowa; // buffers outlive png_decoder_reset(); these are their capacities
+  
+  // Region of interest, in file pixels. It's the whole image if the caller didn't ask for one.
+  // (image) covers just the region, and we stop inflating once we have its last row.
+  int regionx,regiony,regionw,regionh;
+  int crop; // region is not the whole image
+  int lastpass; // last pass that touches the region
+  int passylimit; // rows of the current pass that we need: in the region or above it
+  int passi0,passic; // pixels of the current pass within the region: first and count
+  int pixels_done; // input thread: everything we need has been inflated
+  
+  // Row delivery. (rowsready) counts image rows already reported, from the top.
+  int (*cb_row)(int y,const void *row,void *userdata);
+  void *cb_row_userdata;
+  int rowsready;
+  
+  // Image we can reuse at the next IHDR, from png_decoder_reset() or png_decoder_recycle_image().
+  struct png_image *spare;
+  
+  // Pipelined decode. When (ring) exists, the unfilter thread owns everything about rows and passes.
+  int threaded; // <0=auto, 0=never, >0=always
+  struct png_ring *ring;
+  
+  // In-tree inflate, if PNG_BUILTIN_INFLATE. The whole filtered stream, as far as we need it, goes to (scratch).
+  // No threading in this mode; rows are taken from (scratch) as they complete.
+  struct png_inflate *inflate;
+  uint8_t *scratch;
+  int scratchc,scratcha; // (scratchc) excludes PNG_INFLATE_SLACK
+  int scratchp; // start of the next row
+  int idat_started;
+  
+  // APNG, once we've seen acTL. Each frame's fdAT chunks go to (framedecoder), as the IDAT of a little PNG of its own.
+  // (framepending) while it's working on the last of (image->framev). It survives png_decoder_reset().
+  int apng;
+  int apngseq; // next sequence number expected in fcTL or fdAT
+  struct png_decoder *framedecoder;
+  int framepending;
 };
 
+/* Adam7 pass geometry.
+ */
+ 
+static const struct png_adam7_pass {
+  uint8_t x,y,dx,dy;
+} png_adam7[7]={
+  {0,0,8,8},
+  {4,0,8,8},
+  {0,4,4,8},
+  {2,0,4,4},
+  {0,2,2,4},
+  {1,0,2,2},
+  {0,1,1,2},
+};
+
+static void png_ring_del(struct png_ring *ring) {
+  if (!ring) return;
+  if (!ring->joined) {
+    pthread_mutex_lock(&ring->mutex);
+    ring->abort=1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+    pthread_join(ring->thread,0);
+  }
+  pthread_mutex_destroy(&ring->mutex);
+  pthread_cond_destroy(&ring->cond);
+  int i=PNG_RING_BLOCKC; while (i-->0) {
+    if (ring->blockv[i].v) free(ring->blockv[i].v);
+  }
+  free(ring);
+}
+
 void png_decoder_del(struct png_decoder *decoder) {
   if (!decoder) return;
+  png_ring_del(decoder->ring);
   png_image_del(decoder->image);
+  png_image_del(decoder->spare);
   if (decoder->message) free(decoder->message);
   if (decoder->chunkv) free(decoder->chunkv);
   if (decoder->rowbuf) free(decoder->rowbuf);
+  if (decoder->unfv) free(decoder->unfv);
+  if (decoder->cvtrow) free(decoder->cvtrow);
+  if (decoder->scratch) free(decoder->scratch);
+  png_inflate_del(decoder->inflate);
+  png_decoder_del(decoder->framedecoder);
   if (decoder->z) {
     inflateEnd(decoder->z);
     free(decoder->z);
@@ -61,10 +197,136 @@ struct png_decoder *png_decoder_new() {
   if (!decoder) return 0;
   
   decoder->pstatus=PNG_PSTATUS_SIGNATURE;
+  decoder->threaded=-1;
+  decoder->verify=1;
   
   return decoder;
 }
 
+/* Reset for another file.
+ */
+ 
+int png_decoder_reset(struct png_decoder *decoder) {
+  if (!decoder) return -1;
+  
+  png_ring_del(decoder->ring);
+  decoder->ring=0;
+  if (decoder->message) free(decoder->message);
+  if (decoder->chunkv) free(decoder->chunkv);
+  
+  // If nobody else is using the last image, hold on to it.
+  if (decoder->image) {
+    png_decoder_recycle_image(decoder,decoder->image);
+    decoder->image=0;
+  }
+  
+  // Keep allocations, inflate state, and settings. Wipe everything else.
+  struct png_decoder keep=*decoder;
+  memset(decoder,0,sizeof(struct png_decoder));
+  decoder->rowbuf=keep.rowbuf;
+  decoder->rowbufa=keep.rowbufa;
+  decoder->unfv=keep.unfv;
+  decoder->unfva=keep.unfva;
+  decoder->cvtrow=keep.cvtrow;
+  decoder->cvtrowa=keep.cvtrowa;
+  decoder->spare=keep.spare;
+  decoder->z=keep.z;
+  decoder->inflate=keep.inflate;
+  decoder->scratch=keep.scratch;
+  decoder->scratcha=keep.scratcha;
+  decoder->framedecoder=keep.framedecoder;
+  decoder->dstdepth=keep.dstdepth;
+  decoder->dstcolortype=keep.dstcolortype;
+  decoder->threaded=keep.threaded;
+  decoder->verify=keep.verify;
+  decoder->cb_row=keep.cb_row;
+  decoder->cb_row_userdata=keep.cb_row_userdata;
+  decoder->pstatus=PNG_PSTATUS_SIGNATURE;
+  
+  if (decoder->z&&(inflateReset(decoder->z)<0)) {
+    inflateEnd(decoder->z);
+    free(decoder->z);
+    decoder->z=0;
+  }
+  return 0;
+}
+
+/* Take back an image for reuse.
+ */
+ 
+void png_decoder_recycle_image(struct png_decoder *decoder,struct png_image *image) {
+  if (!image) return;
+  if (!decoder||(image->refc!=1)||(image==decoder->spare)) {
+    png_image_del(image);
+    return;
+  }
+  png_image_del(decoder->spare);
+  decoder->spare=image;
+}
+
+/* Set output format.
+ */
+ 
+int png_decoder_set_format(struct png_decoder *decoder,uint8_t depth,uint8_t colortype) {
+  if (!decoder) return -1;
+  if (decoder->have_IHDR) return -1;
+  if (!depth&&!colortype) {
+    decoder->dstdepth=0;
+    decoder->dstcolortype=0;
+    return 0;
+  }
+  if (!png_pixelsize_for_format(depth,colortype)) return -1;
+  decoder->dstdepth=depth;
+  decoder->dstcolortype=colortype;
+  return 0;
+}
+
+/* Set region of interest.
+ */
+ 
+int png_decoder_set_region(struct png_decoder *decoder,int x,int y,int w,int h) {
+  if (!decoder) return -1;
+  if (decoder->have_IHDR) return -1;
+  if ((w<1)||(h<1)) {
+    decoder->regionx=decoder->regiony=decoder->regionw=decoder->regionh=0;
+  } else {
+    decoder->regionx=x;
+    decoder->regiony=y;
+    decoder->regionw=w;
+    decoder->regionh=h;
+  }
+  return 0;
+}
+
+/* Set threading policy.
+ */
+ 
+int png_decoder_set_threaded(struct png_decoder *decoder,int threaded) {
+  if (!decoder) return -1;
+  if (decoder->ring) return -1;
+  decoder->threaded=threaded;
+  return 0;
+}
+
+int png_decoder_set_row_callback(
+  struct png_decoder *decoder,
+  int (*cb)(int y,const void *row,void *userdata),
+  void *userdata
+) {
+  if (!decoder) return -1;
+  if (decoder->ring) return -1;
+  decoder->cb_row=cb;
+  decoder->cb_row_userdata=userdata;
+  return 0;
+}
+
+int png_decoder_set_verify(struct png_decoder *decoder,int verify) {
+  if (!decoder) return -1;
+  if ((decoder->pstatus!=PNG_PSTATUS_SIGNATURE)||decoder->inc) return -1;
+  decoder->verify=verify;
+  return 0;
+}
+
 /* Accessors.
  */
  
@@ -76,6 +338,15 @@ int png_decoder_get_status(const struct png_decoder *decoder) {
   return decoder->status;
 }
 
+int png_decoder_get_region(int *x,int *y,int *w,int *h,const struct png_decoder *decoder) {
+  if (!decoder->have_IHDR) return -1;
+  if (x) *x=decoder->regionx;
+  if (y) *y=decoder->regiony;
+  if (w) *w=decoder->regionw;
+  if (h) *h=decoder->regionh;
+  return 0;
+}
+
 const char *png_decoder_get_error_message(const struct png_decoder *decoder) {
   return decoder->message;
 }
@@ -85,6 +356,18 @@ const char *png_decoder_get_error_message(const struct png_decoder *decoder) {
  */
  
 static int png_fail(struct png_decoder *decoder,const char *fmt,...) {
+
+  // On the unfilter thread, leave it in the ring for the input thread to pick up.
+  if (decoder->ring&&pthread_equal(pthread_self(),decoder->ring->thread)) {
+    if (fmt&&fmt[0]) {
+      va_list vargs;
+      va_start(vargs,fmt);
+      vsnprintf(decoder->ring->message,sizeof(decoder->ring->message),fmt,vargs);
+      va_end(vargs);
+    }
+    return -1;
+  }
+  
   if (fmt&&fmt[0]) {
     int na=256;
     char *nv=malloc(na);
@@ -120,106 +403,455 @@ static void png_decoder_clear_chunkv(struct png_decoder *decoder) {
  
 static int png_decoder_require_image(struct png_decoder *decoder) {
   if (decoder->image) return 0;
+  if (decoder->spare) {
+    decoder->image=decoder->spare;
+    decoder->spare=0;
+    png_image_clear_chunks(decoder->image);
+    png_image_clear_frames(decoder->image);
+    return 0;
+  }
   if (!(decoder->image=png_image_new())) return -1;
   return 0;
 }
 
-/* Unfilter one row, no context.
+/* Grow a buffer if needed. Doesn't preserve content.
  */
  
-static inline uint8_t png_paeth(uint8_t a,uint8_t b,uint8_t c) {
-  int p=a+b-c;
-  int pa=a-p; if (pa<0) pa=-pa;
-  int pb=b-p; if (pb<0) pb=-pb;
-  int pc=c-p; if (pc<0) pc=-pc;
-  if ((pa<=pb)&&(pa<=pc)) return a;
-  if (pb<=pc) return b;
-  return c;
+static int png_decoder_require_buffer(uint8_t **v,int *a,int c) {
+  if (c<=*a) return 0;
+  uint8_t *nv=malloc(c);
+  if (!nv) return -1;
+  if (*v) free(*v);
+  *v=nv;
+  *a=c;
+  return 0;
 }
+
+/* Calculate the part of the current pass that we need: (passylimit,passi0,passic).
+ * Rows above the region are needed too, for unfiltering the ones in it.
+ * (passylimit) is zero if the pass doesn't touch the region at all.
+ */
  
-static int png_unfilter_row(
-  uint8_t *dst,
-  const uint8_t *src,
-  const uint8_t *pv, // OPTIONAL
-  uint8_t filter,
-  int len,
-  int xstride
-) {
-  switch (filter) {
-    case 0: {
-        memcpy(dst,src,len);
-      } return 0;
-    case 1: {
-        memcpy(dst,src,xstride);
-        int i=xstride; for (;i<len;i++) {
-          dst[i]=src[i]+dst[i-xstride];
-        }
-      } return 0;
-    case 2: if (pv) {
-        int i=len; for (;i-->0;dst++,src++,pv++) {
-          *dst=(*src)+(*pv);
+static void png_decoder_clip_pass(struct png_decoder *decoder) {
+  int dx=decoder->passdx,dy=decoder->passdy;
+  int bottom=decoder->regiony+decoder->regionh;
+  int right=decoder->regionx+decoder->regionw;
+  int j0=0,j1=0,i1=0;
+  if (decoder->regiony>decoder->passy) j0=(decoder->regiony-decoder->passy+dy-1)/dy;
+  if (bottom>decoder->passy) j1=(bottom-decoder->passy+dy-1)/dy;
+  if (j1>decoder->passh) j1=decoder->passh;
+  decoder->passi0=0;
+  if (decoder->regionx>decoder->passx) decoder->passi0=(decoder->regionx-decoder->passx+dx-1)/dx;
+  if (right>decoder->passx) i1=(right-decoder->passx+dx-1)/dx;
+  if (i1>decoder->passw) i1=decoder->passw;
+  decoder->passic=i1-decoder->passi0;
+  if ((j0>=j1)||(decoder->passic<1)) {
+    decoder->passylimit=0;
+    decoder->passic=0;
+  } else {
+    decoder->passylimit=j1;
+  }
+}
+
+/* Start the current pass, or the next one with any pixels in it.
+ * Sets up pass geometry and (rowbufc).
+ * Leaves (pass==passc) if there are no more, ie the pixels are complete.
+ */
+ 
+static void png_decoder_begin_pass(struct png_decoder *decoder) {
+  decoder->y=0;
+  for (;decoder->pass<decoder->passc;decoder->pass++) {
+    if (decoder->interlace) {
+      const struct png_adam7_pass *adam7=png_adam7+decoder->pass;
+      decoder->passx=adam7->x;
+      decoder->passy=adam7->y;
+      decoder->passdx=adam7->dx;
+      decoder->passdy=adam7->dy;
+    } else {
+      decoder->passx=decoder->passy=0;
+      decoder->passdx=decoder->passdy=1;
+    }
+    if ((decoder->passx>=decoder->w)||(decoder->passy>=decoder->h)) continue;
+    decoder->passw=(decoder->w-decoder->passx+decoder->passdx-1)/decoder->passdx;
+    decoder->passh=(decoder->h-decoder->passy+decoder->passdy-1)/decoder->passdy;
+    decoder->passstride=(decoder->pixelsize*decoder->passw+7)>>3;
+    decoder->rowbufc=1+decoder->passstride;
+    png_decoder_clip_pass(decoder);
+    return;
+  }
+}
+
+/* Copy (c) pixels from a packed row starting at (srcx), to every (dx)th pixel of another, starting at (x).
+ */
+ 
+static void png_scatter_row(uint8_t *dst,const uint8_t *src,int srcx,int pixelsize,int x,int dx,int c) {
+  if (pixelsize&7) {
+    uint8_t mask=(1<<pixelsize)-1;
+    int srcbit=srcx*pixelsize,dstbit=x*pixelsize,dstdbit=dx*pixelsize;
+    if ((dx==1)&&!(srcbit&7)&&!(dstbit&7)&&!((c*pixelsize)&7)) {
+      memcpy(dst+(dstbit>>3),src+(srcbit>>3),(c*pixelsize)>>3);
+      return;
+    }
+    for (;c-->0;srcbit+=pixelsize,dstbit+=dstdbit) {
+      uint8_t v=(src[srcbit>>3]>>(8-pixelsize-(srcbit&7)))&mask;
+      int shift=8-pixelsize-(dstbit&7);
+      dst[dstbit>>3]=(dst[dstbit>>3]&~(mask<<shift))|(v<<shift);
+    }
+  } else {
+    int bpp=pixelsize>>3;
+    int dstd=dx*bpp;
+    dst+=x*bpp;
+    src+=srcx*bpp;
+    if (dx==1) {
+      memcpy(dst,src,c*bpp);
+      return;
+    }
+    switch (bpp) {
+      case 1: for (;c-->0;dst+=dstd,src++) *dst=*src; break;
+      case 4: for (;c-->0;dst+=dstd,src+=4) memcpy(dst,src,4); break;
+      default: for (;c-->0;dst+=dstd,src+=bpp) memcpy(dst,src,bpp);
+    }
+  }
+}
+
+/* Prepare the converter, the first time we need it.
+ * We wait until the first row, because PLTE and tRNS come after IHDR.
+ */
+ 
+static int png_decoder_require_converter(struct png_decoder *decoder) {
+  if (decoder->converter_ready) return 0;
+  if (png_converter_init(
+    &decoder->converter,
+    decoder->image->depth,decoder->image->colortype,
+    decoder->depth,decoder->colortype,
+    decoder->image
+  )<0) return png_fail(decoder,"Unable to convert to depth %d colortype %d",decoder->image->depth,decoder->image->colortype);
+  decoder->converter_ready=1;
+  return 0;
+}
+
+/* Report image rows (rowsready..ready-1) to the row callback.
+ */
+ 
+static int png_decoder_report_rows(struct png_decoder *decoder,int ready) {
+  if (ready>decoder->image->h) ready=decoder->image->h;
+  for (;decoder->rowsready<ready;decoder->rowsready++) {
+    const uint8_t *row=((uint8_t*)decoder->image->pixels)+decoder->rowsready*decoder->image->stride;
+    if (decoder->cb_row(decoder->rowsready,row,decoder->cb_row_userdata)<0) {
+      return png_fail(decoder,"Row callback failed at row %d.",decoder->rowsready);
+    }
+  }
+  return 0;
+}
+
+/* Unfilter one row, including its leading filter byte, and add it to the image.
+ */
+ 
+static int png_receive_filtered_row(struct png_decoder *decoder,const uint8_t *row) {
+  if (decoder->pass>=decoder->passc) return 0;
+  int rowpass=decoder->pass;
+  int dsty=decoder->passy+decoder->y*decoder->passdy-decoder->regiony;
+  if (decoder->y<decoder->passylimit) {
+    const uint8_t *src=row+1;
+    uint8_t filter=row[0];
+    struct png_image *image=decoder->image;
+    uint8_t *dst=0; // null if above the region
+    if (dsty>=0) dst=((uint8_t*)image->pixels)+dsty*image->stride;
+    
+    // Native, uninterlaced, and uncropped: Unfilter straight into the image.
+    if (decoder->direct) {
+      uint8_t *pv=0;
+      if (decoder->y) pv=dst-image->stride;
+      if (png_unfilter_row(dst,src,pv,filter,decoder->passstride,decoder->xstride)<0) {
+        return png_fail(decoder,"Unexpected filter byte 0x%02x at row %d",filter,decoder->y);
+      }
+    
+    // Otherwise unfilter into alternating native rows, then convert and scatter as needed.
+    } else {
+      uint8_t *unf=decoder->unfv+(decoder->y&1)*decoder->stride;
+      uint8_t *pv=0;
+      if (decoder->y) pv=decoder->unfv+((decoder->y&1)^1)*decoder->stride;
+      if (png_unfilter_row(unf,src,pv,filter,decoder->passstride,decoder->xstride)<0) {
+        return png_fail(decoder,"Unexpected filter byte 0x%02x at row %d of pass %d",filter,decoder->y,decoder->pass);
+      }
+      if (!dst) {
+      } else if (decoder->convert) {
+        if (png_decoder_require_converter(decoder)<0) return -1;
+        if (decoder->interlace) {
+          png_convert_row(&decoder->converter,decoder->cvtrow,unf,decoder->passw);
+          png_scatter_row(
+            dst,decoder->cvtrow,decoder->passi0,image->pixelsize,
+            decoder->passx+decoder->passi0*decoder->passdx-decoder->regionx,decoder->passdx,decoder->passic
+          );
+        } else {
+          // (regionx) is aligned to a byte, see png_decode_IHDR().
+          png_convert_row(&decoder->converter,dst,unf+((decoder->regionx*decoder->pixelsize)>>3),decoder->passic);
         }
       } else {
-        memcpy(dst,src,len);
-      } return 0;
-    case 3: if (pv) {
-        int i=0;
-        for (;i<xstride;i++) dst[i]=src[i]+(pv[i]>>1);
-        for (;i<len;i++) dst[i]=src[i]+((pv[i]+dst[i-xstride])>>1);
-      } else {
-        int i=0;
-        for (;i<xstride;i++) dst[i]=src[i];
-        for (;i<len;i++) dst[i]=src[i]+(dst[i-xstride]>>1);
-      } return 0;
-    case 4: if (pv) {
-        int i=0;
-        for (;i<xstride;i++) dst[i]=src[i]+pv[i];
-        for (;i<len;i++) dst[i]=src[i]+png_paeth(dst[i-xstride],pv[i],pv[i-xstride]);
-      } else {
-        int i=0;
-        for (;i<xstride;i++) dst[i]=src[i];
-        for (;i<len;i++) dst[i]=src[i]+dst[i-xstride];
-      } return 0;
+        png_scatter_row(
+          dst,unf,decoder->passi0,image->pixelsize,
+          decoder->passx+decoder->passi0*decoder->passdx-decoder->regionx,decoder->passdx,decoder->passic
+        );
+      }
+    }
   }
-  return -1;
+  
+  if (++(decoder->y)>=decoder->passh) {
+    decoder->pass++;
+    png_decoder_begin_pass(decoder);
+  }
+  
+  // Anything we need after this? If not, we're done, regardless of what's left in the file.
+  if ((decoder->pass>decoder->lastpass)||((decoder->pass==decoder->lastpass)&&(decoder->y>=decoder->passylimit))) {
+    decoder->pass=decoder->passc;
+  }
+  
+  // Rows are finished once the image's final pass reaches them; that's every row, for uninterlaced images.
+  // If the final pass doesn't touch the region, they all finish together at the end.
+  if (decoder->cb_row) {
+    int ready=0;
+    if (decoder->pass>=decoder->passc) ready=decoder->image->h;
+    else if (rowpass==decoder->passc-1) ready=dsty+1;
+    if (png_decoder_report_rows(decoder,ready)<0) return -1;
+  }
+  return 0;
+}
+
+/* Unfilter thread.
+ * Split blocks into rows, copying only the ones that straddle blocks.
+ */
+ 
+static int png_ring_consume(struct png_decoder *decoder,const uint8_t *src,int srcc) {
+  struct png_ring *ring=decoder->ring;
+  while ((srcc>0)&&(decoder->pass<decoder->passc)) {
+    int rowbufc=decoder->rowbufc;
+    if (!ring->rowc&&(srcc>=rowbufc)) {
+      if (png_receive_filtered_row(decoder,src)<0) return -1;
+      src+=rowbufc;
+      srcc-=rowbufc;
+    } else {
+      int cpc=rowbufc-ring->rowc;
+      if (cpc>srcc) cpc=srcc;
+      memcpy(decoder->rowbuf+ring->rowc,src,cpc);
+      src+=cpc;
+      srcc-=cpc;
+      if ((ring->rowc+=cpc)>=rowbufc) {
+        ring->rowc=0;
+        if (png_receive_filtered_row(decoder,decoder->rowbuf)<0) return -1;
+      }
+    }
+  }
+  return 0;
+}
+ 
+static void *png_ring_main(void *arg) {
+  struct png_decoder *decoder=arg;
+  struct png_ring *ring=decoder->ring;
+  pthread_mutex_lock(&ring->mutex);
+  while (1) {
+    while (!ring->blockc&&!ring->eof&&!ring->abort) pthread_cond_wait(&ring->cond,&ring->mutex);
+    if (ring->abort||!ring->blockc) break;
+    struct png_ring_block *block=ring->blockv+ring->blockp;
+    pthread_mutex_unlock(&ring->mutex);
+    int err=png_ring_consume(decoder,block->v,block->c);
+    pthread_mutex_lock(&ring->mutex);
+    if (err<0) {
+      ring->failed=1;
+      break;
+    }
+    if (decoder->pass>=decoder->passc) ring->done=1;
+    ring->blockp=(ring->blockp+1)%PNG_RING_BLOCKC;
+    ring->blockc--;
+    pthread_cond_broadcast(&ring->cond);
+  }
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->mutex);
+  return 0;
 }
 
-/* Unfilter (decoder->rowbuf) and add it to the image.
+/* Input thread: Start the unfilter thread, if we want it.
+ * Failure to create the thread is not an error; we just carry on single-threaded.
  */
  
-static int png_receive_filtered_row(struct png_decoder *decoder) {
-  if (decoder->y<decoder->image->h) {
-    const uint8_t *src=decoder->rowbuf+1;
-    uint8_t *dst=((uint8_t*)decoder->image->pixels)+decoder->y*decoder->image->stride;
-    uint8_t *pv=0;
-    if (decoder->y) pv=dst-decoder->image->stride;
-    if (png_unfilter_row(dst,src,pv,decoder->rowbuf[0],decoder->image->stride,decoder->xstride)<0) {
-      return png_fail(decoder,"Unexpected filter byte 0x%02x at row %d",decoder->rowbuf[0],decoder->y);
+static int png_ring_start(struct png_decoder *decoder) {
+  if (!decoder->threaded) return 0;
+  if (decoder->threaded<0) {
+    if (decoder->h<PNG_THREAD_THRESHOLD/(1+decoder->stride)) return 0;
+    if (sysconf(_SC_NPROCESSORS_ONLN)<2) return 0;
+  }
+  struct png_ring *ring=calloc(1,sizeof(struct png_ring));
+  if (!ring) return -1;
+  ring->blocka=PNG_RING_BLOCK_SIZE;
+  int i=PNG_RING_BLOCKC; while (i-->0) {
+    if (!(ring->blockv[i].v=malloc(ring->blocka))) {
+      while (i<PNG_RING_BLOCKC) { if (ring->blockv[i].v) free(ring->blockv[i].v); i++; }
+      free(ring);
+      return -1;
     }
-    decoder->y++;
   }
+  pthread_mutex_init(&ring->mutex,0);
+  pthread_cond_init(&ring->cond,0);
+  decoder->ring=ring;
+  if (pthread_create(&ring->thread,0,png_ring_main,decoder)) {
+    ring->joined=1;
+    png_ring_del(ring);
+    decoder->ring=0;
+    return 0;
+  }
+  decoder->z->next_out=(Bytef*)ring->blockv[0].v;
+  decoder->z->avail_out=ring->blocka;
+  return 0;
+}
+
+/* Input thread: Hand off the block we're filling and wait for a free one.
+ */
+ 
+static int png_ring_publish(struct png_decoder *decoder) {
+  struct png_ring *ring=decoder->ring;
+  pthread_mutex_lock(&ring->mutex);
+  ring->blockv[ring->fillp].c=ring->blocka-decoder->z->avail_out;
+  ring->blockc++;
+  pthread_cond_broadcast(&ring->cond);
+  while ((ring->blockc>=PNG_RING_BLOCKC)&&!ring->failed) pthread_cond_wait(&ring->cond,&ring->mutex);
+  ring->fillp=(ring->blockp+ring->blockc)%PNG_RING_BLOCKC;
+  int failed=ring->failed;
+  if (ring->done) decoder->pixels_done=1;
+  pthread_mutex_unlock(&ring->mutex);
+  if (failed) return png_fail(decoder,"%s",ring->message);
+  decoder->z->next_out=(Bytef*)ring->blockv[ring->fillp].v;
+  decoder->z->avail_out=ring->blocka;
+  return 0;
+}
+
+/* Input thread: Hand off the last partial block, and wait for the unfilter thread to finish.
+ */
+ 
+static int png_ring_finish(struct png_decoder *decoder) {
+  struct png_ring *ring=decoder->ring;
+  pthread_mutex_lock(&ring->mutex);
+  if ((ring->blockv[ring->fillp].c=ring->blocka-decoder->z->avail_out)>0) ring->blockc++;
+  ring->eof=1;
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->mutex);
+  pthread_join(ring->thread,0);
+  ring->joined=1;
+  if (ring->failed) return png_fail(decoder,"%s",ring->message);
+  return 0;
+}
+
+/* After the last row we need, the rest of the stream only matters for its Adler-32, if we're verifying.
+ * zlib checks that itself; we just inflate whatever input is pending, discarding the output.
+ */
+ 
+static int png_decoder_check_adler(struct png_decoder *decoder) {
+  if (!decoder->verify||decoder->crop||decoder->zend) return 0;
+  Bytef *next_out=decoder->z->next_out;
+  uInt avail_out=decoder->z->avail_out;
+  uint8_t discard[256];
+  int err=Z_OK;
+  while (1) {
+    decoder->z->next_out=discard;
+    decoder->z->avail_out=sizeof(discard);
+    if ((err=inflate(decoder->z,Z_NO_FLUSH))!=Z_OK) break;
+    if (decoder->z->avail_out) break;
+  }
+  decoder->z->next_out=next_out;
+  decoder->z->avail_out=avail_out;
+  if (err==Z_STREAM_END) decoder->zend=1;
+  else if ((err<0)&&(err!=Z_BUF_ERROR)) return png_fail(decoder,"inflate: error %d",err);
+  return 0;
+}
+
+#if PNG_BUILTIN_INFLATE
+
+/* In-tree inflate: Take whatever rows are complete in (scratch).
+ */
+ 
+static int png_builtin_receive_rows(struct png_decoder *decoder) {
+  int c=png_inflate_get_output_size(decoder->inflate);
+  while (decoder->pass<decoder->passc) {
+    int rowbufc=decoder->rowbufc;
+    if (decoder->scratchp>c-rowbufc) break;
+    if (png_receive_filtered_row(decoder,decoder->scratch+decoder->scratchp)<0) return -1;
+    decoder->scratchp+=rowbufc;
+  }
+  if (decoder->pass>=decoder->passc) decoder->pixels_done=1;
+  return 0;
+}
+
+static int png_builtin_decode_IDAT(struct png_decoder *decoder,const uint8_t *src,int srcc) {
+  if (!decoder->idat_started) {
+    if (decoder->convert&&(png_decoder_require_converter(decoder)<0)) return -1;
+    decoder->idat_started=1;
+  }
+  // With the whole stream in (scratch), keep going after the last row, to reach the Adler-32.
+  if (decoder->pixels_done&&(!decoder->verify||decoder->crop)) return 0;
+  if (png_inflate_provide(decoder->inflate,src,srcc)<0) {
+    return png_fail(decoder,"inflate: %s",png_inflate_get_message(decoder->inflate));
+  }
+  if (png_builtin_receive_rows(decoder)<0) return -1;
+  if (decoder->pixels_done) decoder->status=PNG_DECODER_IEND;
+  return 0;
+}
+
+static int png_builtin_decode_finish(struct png_decoder *decoder) {
+  if (!decoder->idat_started) return png_fail(decoder,"Missing or empty IDAT");
+  if (png_builtin_receive_rows(decoder)<0) return -1;
+  if (decoder->pass<decoder->passc) return png_fail(decoder,"Image data ends early.");
+  if (decoder->verify&&!decoder->crop&&!png_inflate_provide(decoder->inflate,0,0)) {
+    return png_fail(decoder,"Image data ends before its Adler-32.");
+  }
+  decoder->status=PNG_DECODER_COMPLETE;
   return 0;
 }
 
+#endif
+
 /* Decode IDAT chunk.
  */
  
 static int png_decode_IDAT(struct png_decoder *decoder,const uint8_t *src,int srcc) {
   
   if (!decoder->have_IHDR) return png_fail(decoder,"IDAT before IHDR");
+  #if PNG_BUILTIN_INFLATE
+    return png_builtin_decode_IDAT(decoder,src,srcc);
+  #endif
+  
+  // First IDAT: Prepare conversion and maybe the unfilter thread.
+  // PLTE and tRNS must be in place by now, and must not change after.
+  if (!decoder->z->total_in) {
+    if (decoder->convert&&(png_decoder_require_converter(decoder)<0)) return -1;
+    if (png_ring_start(decoder)<0) return -1;
+  }
   
+  // Once we have all the rows we need, ignore the rest, except to verify it.
   decoder->z->next_in=(Bytef*)src;
   decoder->z->avail_in=srcc;
+  if (decoder->pixels_done) return png_decoder_check_adler(decoder);
+
   while (decoder->z->avail_in>0) {
   
     if (!decoder->z->avail_out) {
-      if (png_receive_filtered_row(decoder)<0) return -1;
-      decoder->z->next_out=(Bytef*)decoder->rowbuf;
-      decoder->z->avail_out=decoder->rowbufc;
+      if (decoder->ring) {
+        if (png_ring_publish(decoder)<0) return -1;
+      } else {
+        if (png_receive_filtered_row(decoder,decoder->rowbuf)<0) return -1;
+        if (decoder->pass>=decoder->passc) decoder->pixels_done=1;
+        decoder->z->next_out=(Bytef*)decoder->rowbuf;
+        decoder->z->avail_out=decoder->rowbufc;
+      }
+      if (decoder->pixels_done) {
+        decoder->status=PNG_DECODER_IEND;
+        return png_decoder_check_adler(decoder);
+      }
     }
     
     int err=inflate(decoder->z,Z_NO_FLUSH);
     if (err<0) return png_fail(decoder,"inflate: error %d",err);
+    if (err==Z_STREAM_END) {
+      decoder->zend=1;
+      break;
+    }
   }
   
   return 0;
@@ -230,21 +862,48 @@ static int png_decode_IDAT(struct png_decoder *decoder,const uint8_t *src,int sr
  
 static int png_decode_finish(struct png_decoder *decoder) {
   if (!decoder->have_IHDR) return png_fail(decoder,"No IHDR");
+  #if PNG_BUILTIN_INFLATE
+    return png_builtin_decode_finish(decoder);
+  #endif
   if (!decoder->z->total_in) return png_fail(decoder,"Missing or empty IDAT");
   
-  while (decoder->y<decoder->image->h) {
+  if (decoder->ring) {
+    while (!decoder->pixels_done) {
+      if (!decoder->z->avail_out) {
+        if (png_ring_publish(decoder)<0) return -1;
+      }
+      int err=inflate(decoder->z,Z_FINISH);
+      if (err==Z_STREAM_END) {
+        decoder->zend=1;
+        break;
+      }
+      if (err==Z_BUF_ERROR) break; // Input exhausted. It's an error only if rows are missing.
+      if (err<0) return png_fail(decoder,"inflate: error %d",err);
+    }
+    if (png_ring_finish(decoder)<0) return -1;
+    if (decoder->pass<decoder->passc) return png_fail(decoder,"Image data ends early.");
+    
+  } else while (decoder->pass<decoder->passc) {
 
     if (!decoder->z->avail_out) {
-      if (png_receive_filtered_row(decoder)<0) return -1;
-      if (decoder->y>=decoder->image->h) break;
+      if (png_receive_filtered_row(decoder,decoder->rowbuf)<0) return -1;
+      if (decoder->pass>=decoder->passc) break;
       decoder->z->next_out=(Bytef*)decoder->rowbuf;
       decoder->z->avail_out=decoder->rowbufc;
     }
     
     int err=inflate(decoder->z,Z_FINISH);
     if (err<0) return png_fail(decoder,"inflate: error %d",err);
+    if (err==Z_STREAM_END) {
+      decoder->zend=1;
+      if (decoder->z->avail_out) return png_fail(decoder,"Image data ends early.");
+    }
   }
   
+  if (decoder->verify&&!decoder->crop) {
+    if (png_decoder_check_adler(decoder)<0) return -1;
+    if (!decoder->zend) return png_fail(decoder,"Image data ends before its Adler-32.");
+  }
   decoder->status=PNG_DECODER_COMPLETE;
   return 0;
 }
@@ -261,34 +920,251 @@ static int png_decode_IHDR(struct png_decoder *decoder,const uint8_t *src,int sr
   int h=(src[4]<<24)|(src[5]<<16)|(src[6]<<8)|src[7];
   if ((w<1)||(h<1)) return png_fail(decoder,"Invalid dimensions %dx%d.",w,h);
   
-  if (src[10]||src[11]||src[12]) {
+  if (src[10]||src[11]||(src[12]>1)) {
     return png_fail(decoder,
       "Unsupported compression/filter/interlace: %d/%d/%d",
       src[10],src[11],src[12]
     );
   }
   
-  if (png_decoder_require_image(decoder)<0) return -1;
-  if (png_image_allocate_pixels(decoder->image,w,h,src[8],src[9])<0) return -1;
+  decoder->w=w;
+  decoder->h=h;
+  decoder->depth=src[8];
+  decoder->colortype=src[9];
+  decoder->interlace=src[12];
+  if (!(decoder->pixelsize=png_pixelsize_for_format(decoder->depth,decoder->colortype))) {
+    return png_fail(decoder,"Invalid depth %d for colortype %d.",decoder->depth,decoder->colortype);
+  }
+  if (decoder->pixelsize>(INT_MAX-7)/w) return png_fail(decoder,"Invalid dimensions %dx%d.",w,h);
+  decoder->stride=(decoder->pixelsize*w+7)>>3;
+  decoder->xstride=decoder->pixelsize>>3;
+  if (!decoder->xstride) decoder->xstride=1;
   
-  if (decoder->rowbuf||decoder->z) return -1;
+  // Clip region. Sub-byte pixels, extend it left to a byte boundary.
+  if (decoder->regionw<1) {
+    decoder->regionx=decoder->regiony=0;
+    decoder->regionw=w;
+    decoder->regionh=h;
+  } else {
+    if (decoder->regionx<0) { decoder->regionw+=decoder->regionx; decoder->regionx=0; }
+    if (decoder->regiony<0) { decoder->regionh+=decoder->regiony; decoder->regiony=0; }
+    if (decoder->regionx>w-decoder->regionw) decoder->regionw=w-decoder->regionx;
+    if (decoder->regiony>h-decoder->regionh) decoder->regionh=h-decoder->regiony;
+    // Region misses the image entirely? Take the nearest pixel, so there's still an image to return.
+    if (decoder->regionw<1) {
+      decoder->regionx=(decoder->regionx>=w)?(w-1):0;
+      decoder->regionw=1;
+    }
+    if (decoder->regionh<1) {
+      decoder->regiony=(decoder->regiony>=h)?(h-1):0;
+      decoder->regionh=1;
+    }
+    if (decoder->pixelsize<8) {
+      int align=8/decoder->pixelsize;
+      int mod=decoder->regionx%align;
+      decoder->regionx-=mod;
+      decoder->regionw+=mod;
+    }
+    if ((decoder->regionx||decoder->regiony||(decoder->regionw<w)||(decoder->regionh<h))) decoder->crop=1;
+  }
   
-  decoder->rowbufc=1+decoder->image->stride;
-  if (!(decoder->rowbuf=malloc(decoder->rowbufc))) return -1;
-  decoder->xstride=decoder->image->pixelsize>>3;
-  if (!decoder->xstride) decoder->xstride=1;
+  uint8_t dstdepth=decoder->depth,dstcolortype=decoder->colortype;
+  if (decoder->dstdepth&&((decoder->dstdepth!=dstdepth)||(decoder->dstcolortype!=dstcolortype))) {
+    dstdepth=decoder->dstdepth;
+    dstcolortype=decoder->dstcolortype;
+    decoder->convert=1;
+  }
   
-  if (!(decoder->z=calloc(1,sizeof(z_stream)))) return -1;
-  if (inflateInit(decoder->z)<0) return -1;
+  // A recycled image keeps its pixels if the size and format match.
+  // We don't need them zeroed; every pixel will be overwritten.
+  if (png_decoder_require_image(decoder)<0) return -1;
+  struct png_image *image=decoder->image;
+  if (
+    !image->pixels||(image->w!=decoder->regionw)||(image->h!=decoder->regionh)||
+    (image->depth!=dstdepth)||(image->colortype!=dstcolortype)
+  ) {
+    if (png_image_allocate_pixels(image,decoder->regionw,decoder->regionh,dstdepth,dstcolortype)<0) return -1;
+  }
   
-  decoder->y=0;
-  decoder->z->next_out=(Bytef*)decoder->rowbuf;
-  decoder->z->avail_out=decoder->rowbufc;
+  // Buffers and inflate state may be left over from before png_decoder_reset().
+  if (decoder->stride>=INT_MAX>>1) return -1;
+  if (png_decoder_require_buffer(&decoder->rowbuf,&decoder->rowbufa,1+decoder->stride)<0) return -1;
+  decoder->rowbufc=1+decoder->stride;
+  decoder->direct=!(decoder->convert||decoder->interlace||decoder->crop);
+  if (!decoder->direct) {
+    if (png_decoder_require_buffer(&decoder->unfv,&decoder->unfva,decoder->stride<<1)<0) return -1;
+  }
+  if (decoder->convert&&decoder->interlace) {
+    if (image->pixelsize>(INT_MAX-7)/w) return -1;
+    if (png_decoder_require_buffer(&decoder->cvtrow,&decoder->cvtrowa,(image->pixelsize*w+7)>>3)<0) return -1;
+  }
+  
+  // Find the last pass touching the region, then start over at the first.
+  // Along the way, builtin inflate measures the filtered stream up to the region's last row.
+  #if PNG_BUILTIN_INFLATE
+    int64_t streamc=0,needc=0;
+  #endif
+  decoder->passc=decoder->interlace?7:1;
+  decoder->lastpass=-1;
+  for (decoder->pass=0;decoder->pass<decoder->passc;decoder->pass++) {
+    png_decoder_begin_pass(decoder);
+    if (decoder->pass>=decoder->passc) break;
+    if (decoder->passylimit) {
+      decoder->lastpass=decoder->pass;
+      #if PNG_BUILTIN_INFLATE
+        needc=streamc+(int64_t)decoder->passylimit*decoder->rowbufc;
+      #endif
+    }
+    #if PNG_BUILTIN_INFLATE
+      streamc+=(int64_t)decoder->passh*decoder->rowbufc;
+    #endif
+  }
+  if (decoder->lastpass<0) return png_fail(decoder,"Region outside %dx%d image.",w,h);
+  decoder->pass=0;
+  png_decoder_begin_pass(decoder);
+  decoder->status=PNG_DECODER_IDAT;
+  
+  #if PNG_BUILTIN_INFLATE
+    if (needc>INT_MAX-PNG_INFLATE_SLACK) return png_fail(decoder,"Image too large for builtin inflate.");
+    decoder->scratchc=needc;
+    if (png_decoder_require_buffer(&decoder->scratch,&decoder->scratcha,decoder->scratchc+PNG_INFLATE_SLACK)<0) return -1;
+    if (!decoder->inflate&&!(decoder->inflate=png_inflate_new())) return -1;
+    png_inflate_reset(decoder->inflate,decoder->scratch,decoder->scratchc);
+    png_inflate_set_verify(decoder->inflate,decoder->verify&&!decoder->crop);
+  #else
+    if (!decoder->z) {
+      if (!(decoder->z=calloc(1,sizeof(z_stream)))) return -1;
+      if (inflateInit(decoder->z)<0) {
+        free(decoder->z);
+        decoder->z=0;
+        return -1;
+      }
+    }
+    decoder->z->next_out=(Bytef*)decoder->rowbuf;
+    decoder->z->avail_out=decoder->rowbufc;
+  #endif
   
   decoder->have_IHDR=1;
   return 0;
 }
 
+/* APNG: Read a 32-bit big-endian field.
+ */
+ 
+static inline uint32_t png_rd32(const uint8_t *src) {
+  return ((uint32_t)src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
+}
+
+/* APNG: Animation control. Only valid before the first IDAT; otherwise it's just another opaque chunk.
+ */
+ 
+static int png_decode_acTL(struct png_decoder *decoder,const uint8_t *src,int srcc) {
+  if (!decoder->have_IHDR) return png_fail(decoder,"acTL before IHDR");
+  if (decoder->apng) return png_fail(decoder,"Multiple acTL.");
+  if (srcc<8) return png_fail(decoder,"Short acTL (%d<8).",srcc);
+  uint32_t framec=png_rd32(src),plays=png_rd32(src+4);
+  if ((framec<1)||(framec>INT_MAX)||(plays>INT_MAX)) return png_fail(decoder,"Invalid acTL.");
+  decoder->apng=1;
+  decoder->image->plays=plays;
+  decoder->image->canvasw=decoder->w;
+  decoder->image->canvash=decoder->h;
+  return 0;
+}
+
+/* APNG: Finish the frame in progress, if there is one.
+ */
+ 
+static int png_decoder_finish_frame(struct png_decoder *decoder) {
+  if (!decoder->framepending) return 0;
+  decoder->framepending=0;
+  struct png_decoder *framedecoder=decoder->framedecoder;
+  if (png_decode_finish(framedecoder)<0) {
+    return png_fail(decoder,"APNG frame %d: %s",decoder->image->framec-1,framedecoder->message?framedecoder->message:"");
+  }
+  struct png_frame *frame=decoder->image->framev+decoder->image->framec-1;
+  if (png_image_ref(framedecoder->image)<0) return -1;
+  frame->image=framedecoder->image;
+  return 0;
+}
+
+/* APNG: Frame control. Begins a frame.
+ * Before the first IDAT, the frame is IDAT itself. Otherwise it's the fdAT chunks that follow, in (framedecoder).
+ */
+ 
+static int png_decode_fcTL(struct png_decoder *decoder,const uint8_t *src,int srcc) {
+  if (srcc<26) return png_fail(decoder,"Short fcTL (%d<26).",srcc);
+  if (png_rd32(src)!=decoder->apngseq) return png_fail(decoder,"APNG sequence number %u, expected %d.",png_rd32(src),decoder->apngseq);
+  decoder->apngseq++;
+  if (png_decoder_finish_frame(decoder)<0) return -1;
+  
+  uint32_t w=png_rd32(src+4),h=png_rd32(src+8),x=png_rd32(src+12),y=png_rd32(src+16);
+  if (
+    (w<1)||(h<1)||(w>decoder->w)||(h>decoder->h)||
+    (x>decoder->w-w)||(y>decoder->h-h)||
+    (src[24]>PNG_DISPOSE_PREVIOUS)||(src[25]>PNG_BLEND_OVER)
+  ) return png_fail(decoder,"Invalid fcTL: %ux%u at %u,%u, dispose %d, blend %d.",w,h,x,y,src[24],src[25]);
+  if (!decoder->have_IDAT&&(x||y||(w!=decoder->w)||(h!=decoder->h))) {
+    return png_fail(decoder,"First APNG frame must cover the whole image.");
+  }
+  
+  struct png_frame *frame=png_image_add_frame(decoder->image);
+  if (!frame) return -1;
+  frame->x=x;
+  frame->y=y;
+  frame->w=w;
+  frame->h=h;
+  frame->delaynum=(src[20]<<8)|src[21];
+  frame->delayden=(src[22]<<8)|src[23];
+  if (!frame->delayden) frame->delayden=100;
+  frame->dispose=src[24];
+  frame->blend=src[25];
+  if (!decoder->have_IDAT) return 0;
+  
+  // Frame data is encoded exactly like the image's, but (w,h). Always the whole frame, in the image's output format.
+  // The frame decoder needs our PLTE and tRNS too, if we have them.
+  if (!decoder->framedecoder) {
+    if (!(decoder->framedecoder=png_decoder_new())) return -1;
+  } else {
+    if (png_decoder_reset(decoder->framedecoder)<0) return -1;
+  }
+  struct png_decoder *framedecoder=decoder->framedecoder;
+  framedecoder->threaded=0;
+  framedecoder->verify=decoder->verify;
+  if (png_decoder_set_format(framedecoder,decoder->image->depth,decoder->image->colortype)<0) return -1;
+  uint8_t ihdr[13]={
+    w>>24,w>>16,w>>8,w,
+    h>>24,h>>16,h>>8,h,
+    decoder->depth,decoder->colortype,0,0,decoder->interlace,
+  };
+  if (png_decode_IHDR(framedecoder,ihdr,sizeof(ihdr))<0) {
+    return png_fail(decoder,"APNG frame %d: %s",decoder->image->framec-1,framedecoder->message?framedecoder->message:"");
+  }
+  const void *v=0;
+  int c;
+  if ((c=png_image_get_chunk_by_id(&v,decoder->image,PNG_ID('P','L','T','E')))>=0) {
+    if (png_image_add_chunk_copy(framedecoder->image,PNG_ID('P','L','T','E'),v,c)<0) return -1;
+  }
+  if ((c=png_image_get_chunk_by_id(&v,decoder->image,PNG_ID('t','R','N','S')))>=0) {
+    if (png_image_add_chunk_copy(framedecoder->image,PNG_ID('t','R','N','S'),v,c)<0) return -1;
+  }
+  decoder->framepending=1;
+  return 0;
+}
+
+/* APNG: Frame data. Sequence number, then a piece of the frame's zlib stream.
+ */
+ 
+static int png_decode_fdAT(struct png_decoder *decoder,const uint8_t *src,int srcc) {
+  if (srcc<4) return png_fail(decoder,"Short fdAT (%d<4).",srcc);
+  if (png_rd32(src)!=decoder->apngseq) return png_fail(decoder,"APNG sequence number %u, expected %d.",png_rd32(src),decoder->apngseq);
+  decoder->apngseq++;
+  if (!decoder->framepending) return png_fail(decoder,"fdAT without fcTL.");
+  if (png_decode_IDAT(decoder->framedecoder,src+4,srcc-4)<0) {
+    return png_fail(decoder,"APNG frame %d: %s",decoder->image->framec-1,decoder->framedecoder->message?decoder->framedecoder->message:"");
+  }
+  return 0;
+}
+
 /* Receive chunk header.
  * Input is always 8 bytes.
  * Changes (pstatus).
@@ -298,23 +1174,81 @@ static int png_decode_chunk_begin(struct png_decoder *decoder,const uint8_t *src
   int len=(src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
   uint32_t chunkid=(src[4]<<24)|(src[5]<<16)|(src[6]<<8)|src[7];
   if (len<0) return png_fail(decoder,"Improbable chunk length 0x%08x",len);
+  decoder->chunkid=chunkid;
+  if (decoder->verify) decoder->crc=png_crc32(0,src+4,4);
   if (!len) {
     decoder->pstatus=PNG_PSTATUS_CRC;
-    if (chunkid==PNG_ID('I','E','N','D')) {
-      decoder->have_IEND=1;
-    }
-    if ((chunkid!=PNG_ID('I','D','A','T'))&&(chunkid!=PNG_ID('I','H','D','R'))&&(chunkid!=PNG_ID('I','E','N','D'))) {
-      if (png_decoder_require_image(decoder)<0) return -1;
-      if (png_image_add_chunk_copy(decoder->image,chunkid,0,0)<0) return -1;
-    }
   } else if (chunkid==PNG_ID('I','D','A','T')) {
+    decoder->have_IDAT=1;
     decoder->pstatus=PNG_PSTATUS_IDAT;
     decoder->idatexpect=len;
   } else {
     decoder->pstatus=PNG_PSTATUS_BODY;
-    if (!(decoder->chunkv=malloc(len?len:1))) return -1;
+    if (!(decoder->chunkv=malloc(len))) return -1;
     decoder->chunka=len;
-    decoder->chunkid=chunkid;
+  }
+  return 0;
+}
+
+/* Receive chunk CRC, and act on the chunk now that we trust it.
+ * IDAT is the exception; we've already decoded it.
+ * Input is always 4 bytes.
+ * Changes (pstatus).
+ */
+ 
+static int png_decode_chunk_end(struct png_decoder *decoder,const uint8_t *src) {
+  if (decoder->verify) {
+    uint32_t expect=((uint32_t)src[0]<<24)|(src[1]<<16)|(src[2]<<8)|src[3];
+    if (expect!=decoder->crc) {
+      uint32_t id=decoder->chunkid;
+      return png_fail(decoder,"CRC mismatch in '%c%c%c%c' chunk.",id>>24,(id>>16)&0xff,(id>>8)&0xff,id&0xff);
+    }
+  }
+  // APNG chunks are only special after acTL, and acTL only before IDAT.
+  uint32_t chunkid=decoder->chunkid;
+  switch (chunkid) {
+    case PNG_ID('a','c','T','L'): if (decoder->have_IDAT) chunkid=0; break;
+    case PNG_ID('f','c','T','L'): case PNG_ID('f','d','A','T'): if (!decoder->apng) chunkid=0; break;
+  }
+  switch (chunkid) {
+    case PNG_ID('I','D','A','T'): break;
+    case PNG_ID('I','H','D','R'): {
+        if (png_decode_IHDR(decoder,decoder->chunkv,decoder->chunkc)<0) return -1;
+        png_decoder_clear_chunkv(decoder);
+      } break;
+    case PNG_ID('I','E','N','D'): {
+        if (png_decoder_finish_frame(decoder)<0) return -1;
+        decoder->have_IEND=1;
+        png_decoder_clear_chunkv(decoder);
+      } break;
+    case PNG_ID('a','c','T','L'): {
+        if (png_decode_acTL(decoder,decoder->chunkv,decoder->chunkc)<0) return -1;
+        png_decoder_clear_chunkv(decoder);
+      } break;
+    case PNG_ID('f','c','T','L'): {
+        if (png_decode_fcTL(decoder,decoder->chunkv,decoder->chunkc)<0) return -1;
+        png_decoder_clear_chunkv(decoder);
+      } break;
+    case PNG_ID('f','d','A','T'): {
+        if (png_decode_fdAT(decoder,decoder->chunkv,decoder->chunkc)<0) return -1;
+        png_decoder_clear_chunkv(decoder);
+      } break;
+    default: {
+        if (png_decoder_require_image(decoder)<0) return -1;
+        if (decoder->chunkv) {
+          if (png_image_add_chunk_handoff(decoder->image,decoder->chunkid,decoder->chunkv,decoder->chunkc)<0) return -1;
+          decoder->chunkv=0;
+        } else {
+          if (png_image_add_chunk_copy(decoder->image,decoder->chunkid,0,0)<0) return -1;
+        }
+        png_decoder_clear_chunkv(decoder);
+      }
+  }
+  if (decoder->have_IEND) {
+    decoder->status=PNG_DECODER_COMPLETE;
+    decoder->pstatus=PNG_PSTATUS_VERIFY;
+  } else {
+    decoder->pstatus=PNG_PSTATUS_HEADER;
   }
   return 0;
 }
@@ -381,24 +1315,12 @@ static int png_decode_partial(struct png_decoder *decoder,const uint8_t *src,int
           memcpy(decoder->inv+decoder->inc,src,cpc);
           decoder->inc+=cpc;
           if (decoder->inc>=4) {
-            // We don't actually do anything with the CRC.
-            if (decoder->have_IEND) {
-              decoder->status=PNG_DECODER_COMPLETE;
-              decoder->pstatus=PNG_PSTATUS_VERIFY;
-            } else {
-              decoder->pstatus=PNG_PSTATUS_HEADER;
-            }
-            decoder->pstatus=PNG_PSTATUS_VERIFY;
+            if (png_decode_chunk_end(decoder,decoder->inv)<0) return -1;
             decoder->inc=0;
           }
           return cpc;
         } else if (srcc>=4) {
-          if (decoder->have_IEND) {
-            decoder->status=PNG_DECODER_COMPLETE;
-            decoder->pstatus=PNG_PSTATUS_VERIFY;
-          } else {
-            decoder->pstatus=PNG_PSTATUS_HEADER;
-          }
+          if (png_decode_chunk_end(decoder,src)<0) return -1;
           return 4;
         } else {
           memcpy(decoder->inv,src,srcc);
@@ -411,25 +1333,9 @@ static int png_decode_partial(struct png_decoder *decoder,const uint8_t *src,int
         int cpc=decoder->chunka-decoder->chunkc;
         if (cpc>srcc) cpc=srcc;
         memcpy(decoder->chunkv+decoder->chunkc,src,cpc);
+        if (decoder->verify) decoder->crc=png_crc32(decoder->crc,src,cpc);
         decoder->chunkc+=cpc;
         if (decoder->chunkc>=decoder->chunka) {
-          switch (decoder->chunkid) {
-            case PNG_ID('I','H','D','R'): {
-                if (png_decode_IHDR(decoder,decoder->chunkv,decoder->chunkc)<0) return -1;
-                png_decoder_clear_chunkv(decoder);
-              } break;
-            case PNG_ID('I','E','N','D'): {
-                // We're not actually "complete" yet; we still need IEND's CRC.
-                decoder->have_IEND=1;
-                png_decoder_clear_chunkv(decoder);
-              } break;
-            default: {
-                if (png_decoder_require_image(decoder)<0) return -1;
-                if (png_image_add_chunk_handoff(decoder->image,decoder->chunkid,decoder->chunkv,decoder->chunkc)<0) return -1;
-                decoder->chunkv=0;
-                png_decoder_clear_chunkv(decoder);
-              }
-          }
           decoder->pstatus=PNG_PSTATUS_CRC;
         }
         return cpc;
@@ -438,6 +1344,7 @@ static int png_decode_partial(struct png_decoder *decoder,const uint8_t *src,int
     case PNG_PSTATUS_IDAT: {
         int cpc=decoder->idatexpect;
         if (cpc>srcc) cpc=srcc;
+        if (decoder->verify) decoder->crc=png_crc32(decoder->crc,src,cpc);
         if (png_decode_IDAT(decoder,src,cpc)<0) return -1;
         decoder->idatexpect-=cpc;
         if (decoder->idatexpect<=0) {
@@ -473,8 +1380,16 @@ int png_decoder_provide_input(struct png_decoder *decoder,const void *src,int sr
  */
  
 struct png_image *png_decode(const void *src,int srcc) {
+  return png_decode_format(src,srcc,0,0);
+}
+
+struct png_image *png_decode_format(const void *src,int srcc,uint8_t depth,uint8_t colortype) {
   struct png_decoder *decoder=png_decoder_new();
   if (!decoder) return 0;
+  if (png_decoder_set_format(decoder,depth,colortype)<0) {
+    png_decoder_del(decoder);
+    return 0;
+  }
   if (png_decoder_provide_input(decoder,src,srcc)<0) {
     png_decoder_del(decoder);
     return 0;
@@ -14,13 +14,15 @@ void png_image_cleanup(struct png_image *image) {
     }
     free(image->chunkv);
   }
+  png_image_clear_frames(image);
+  if (image->framev) free(image->framev);
   memset(image,0,sizeof(struct png_image));
 }
 
 void png_image_del(struct png_image *image) {
   if (!image) return;
   if (image->refc) {
-    if (image->refc-->0) return;
+    if (--(image->refc)>0) return;
     png_image_cleanup(image);
     free(image);
   } else {
@@ -43,143 +45,125 @@ struct png_image *png_image_new() {
   return image;
 }
 
-/* Convert from indexed image with PLTE.
+/* Row converters.
  */
  
-static void png_image_convert_from_index(
-  struct png_image *dst,
-  const struct png_image *src,
-  const uint8_t *plte,int pltec,
-  const uint8_t *trns,int trnsc
-) {
+static void png_convert_row_copy(const struct png_converter *converter,void *dst,const void *src,int w) {
+  memcpy(dst,src,(converter->srcpixelsize*w+7)>>3);
+}
+
+static void png_convert_row_generic(const struct png_converter *converter,void *dst,const void *src,int w) {
+  int x=0;
+  for (;x<w;x++) converter->wr(dst,x,converter->rd(src,x));
+}
 
-  // (pltec) is in bytes. Rephrase as pixels.
-  pltec/=3;
+/* Indexed to rgb8, straight from the merged table.
+ */
+
+static void png_convert_row_i8_rgb8(const struct png_converter *converter,void *dst,const void *src,int w) {
+  uint8_t *dstp=dst;
+  const uint8_t *srcp=src;
+  for (;w-->0;dstp+=3,srcp++) memcpy(dstp,converter->lut+((*srcp)<<2),3);
+}
+
+/* Use a generic writer, but read indices in line, for any of the 4 legal input depths.
+ * We do not provide a generic reader for indexed pixels.
+ */
+ 
+static void png_convert_row_index(const struct png_converter *converter,void *dst,const void *src,int w) {
+  const uint8_t *srcp=src;
+  int depth=converter->srcdepth;
+  int mask=(1<<depth)-1;
+  int shift=8-depth;
+  int x=0;
+  for (;x<w;x++) {
+    int ix=((*srcp)>>shift)&mask;
+    const uint8_t *p=converter->lut+(ix<<2);
+    converter->wr(dst,x,(p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3]);
+    if ((shift-=depth)<0) {
+      shift=8-depth;
+      srcp++;
+    }
+  }
+}
+
+/* Merge PLTE and tRNS into one table of RGBA8.
+ * Indices beyond PLTE are black, and beyond tRNS are opaque.
+ */
+ 
+static void png_converter_build_lut(struct png_converter *converter) {
+  uint8_t *dst=converter->lut;
+  int ix=0;
+  for (;ix<256;ix++,dst+=4) {
+    if (ix<converter->pltec) memcpy(dst,converter->plte+ix*3,3);
+    else dst[0]=dst[1]=dst[2]=0x00;
+    dst[3]=(ix<converter->trnsc)?converter->trns[ix]:0xff;
+  }
+}
+
+/* Initialize converter.
+ */
+ 
+int png_converter_init(
+  struct png_converter *converter,
+  uint8_t dstdepth,uint8_t dstcolortype,
+  uint8_t srcdepth,uint8_t srccolortype,
+  const struct png_image *chunks
+) {
+  if (!converter) return -1;
+  memset(converter,0,sizeof(struct png_converter));
+  if (!(converter->srcpixelsize=png_pixelsize_for_format(srcdepth,srccolortype))) return -1;
+  if (!(converter->dstpixelsize=png_pixelsize_for_format(dstdepth,dstcolortype))) return -1;
+  converter->srcdepth=srcdepth;
+  converter->srccolortype=srccolortype;
+  converter->dstdepth=dstdepth;
+  converter->dstcolortype=dstcolortype;
   
-  uint8_t *dstrow=dst->pixels;
-  const uint8_t *srcrow=src->pixels;
-  int y=dst->h;
+  // If format is the same, memcpy the whole thing, it's way cheaper.
+  if ((dstdepth==srcdepth)&&(dstcolortype==srccolortype)) {
+    converter->cvt=png_convert_row_copy;
+    return 0;
+  }
   
-  /* Optimize for rgb8 and rgba8 from i8.
-   * The format of PLTE is always rgb8, that's why these formats are privileged.
-   */
-  if (
-    (dst->depth==8)&&(src->depth==8)&&
-    ((dst->colortype==PNG_COLORTYPE_RGB)||(dst->colortype==PNG_COLORTYPE_RGBA))
-  ) {
-    for (;y-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-      uint8_t *dstp=dstrow;
-      const uint8_t *srcp=srcrow;
-      int x=dst->w;
-      if (dst->colortype==PNG_COLORTYPE_RGBA) {
-        for (;x-->0;dstp+=4,srcp++) {
-          if (*srcp>=pltec) dstp[0]=dstp[1]=dstp[2]=0x00;
-          else memcpy(dstp,plte+(*srcp)*3,3);
-          if (*srcp>=trnsc) dstp[3]=0xff;
-          else dstp[3]=trns[*srcp];
-        }
+  // Indexed pixels are a mess, of course.
+  if (srccolortype==PNG_COLORTYPE_INDEX) {
+    const void *plte=0,*trns=0;
+    int pltec=png_image_get_chunk_by_id(&plte,chunks,PNG_ID('P','L','T','E'));
+    if (pltec>=0) { // PLTE exists so we're doing this...
+      int trnsc=png_image_get_chunk_by_id(&trns,chunks,PNG_ID('t','R','N','S'));
+      if (trnsc<0) trnsc=0;
+      converter->plte=plte;
+      converter->pltec=pltec/3;
+      converter->trns=trns;
+      converter->trnsc=trnsc;
+      png_converter_build_lut(converter);
+      if ((converter->cvt=png_convert_select_palette(dstdepth,dstcolortype,srcdepth))) {
+      } else if ((dstdepth==8)&&(srcdepth==8)&&(dstcolortype==PNG_COLORTYPE_RGB)) {
+        converter->cvt=png_convert_row_i8_rgb8;
       } else {
-        for (;x-->0;dstp+=3,srcp++) {
-          if (*srcp>=pltec) dstp[0]=dstp[1]=dstp[2]=0x00;
-          else memcpy(dstp,plte+(*srcp)*3,3);
-        }
+        if (!(converter->wr=png_get_pxwr(dstdepth,dstcolortype))) return -1;
+        converter->cvt=png_convert_row_index;
       }
+      return 0;
     }
-    return;
+    // No PLTE, proceed and let the input behave like gray.
   }
-
-  /* Use a generic writer, but implement reading 4 times for the 4 legal input depths.
-   * We do not provide a generic reader for indexed pixels.
-   */
-  png_pxwr_fn wr=png_get_pxwr(dst->depth,dst->colortype);
-  if (!wr) return;
-  switch (src->depth) {
   
-    case 1: {
-        uint8_t tmpplte[6]={0};
-        if (pltec==1) memcpy(tmpplte,plte,3);
-        else if (pltec>=2) memcpy(tmpplte,plte,6);
-        plte=tmpplte;
-        uint8_t tmptrns[2];
-        if (trnsc<1) { tmptrns[0]=tmptrns[1]=0xff; trns=tmptrns; }
-        else if (trnsc<2) { tmptrns[0]=trns[0]; tmptrns[1]=0xff; trns=tmptrns; }
-        for (;y-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-          const uint8_t *srcp=srcrow;
-          uint8_t mask=0x80;
-          int x=0;
-          for (;x<dst->w;x++) {
-            int ix=((*srcp)&mask)?1:0;
-            uint8_t a=trns[ix];
-            ix*=3;
-            uint32_t rgba=(plte[ix]<<24)|(plte[ix+1]<<16)|(plte[ix+2]<<8)|a;
-            wr(dstrow,x,rgba);
-            if (!(mask>>=1)) {
-              mask=0x80;
-              srcp++;
-            }
-          }
-        }
-      } break;
-      
-    case 2: {
-        for (;y-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-          const uint8_t *srcp=srcrow;
-          int shift=6;
-          int x=0;
-          for (;x<dst->w;x++) {
-            int ix=((*srcp)>>shift)&3;
-            uint8_t a=(ix<trnsc)?trns[ix]:0xff;
-            uint32_t rgb=0;
-            if (ix<pltec) {
-              ix*=3;
-              rgb=(plte[ix]<<24)|(plte[ix+1]<<16)|(plte[ix+2]<<8);
-            }
-            wr(dstrow,x,rgb|a);
-            if ((shift-=2)<0) {
-              shift=6;
-              srcp++;
-            }
-          }
-        }
-      } break;
-      
-    case 4: {
-        for (;y-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-          const uint8_t *srcp=srcrow;
-          int shift=4;
-          int x=0;
-          for (;x<dst->w;x++) {
-            int ix=((*srcp)>>shift)&15;
-            uint8_t a=(ix<trnsc)?trns[ix]:0xff;
-            uint32_t rgb=0;
-            if (ix<pltec) {
-              ix*=3;
-              rgb=(plte[ix]<<24)|(plte[ix+1]<<16)|(plte[ix+2]<<8);
-            }
-            wr(dstrow,x,rgb|a);
-            if (shift) shift=0;
-            else { shift=4; srcp++; }
-          }
-        }
-      } break;
-      
-    case 8: {
-        for (;y-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-          const uint8_t *srcp=srcrow;
-          int x=0;
-          for (;x<dst->w;x++,srcp++) {
-            int ix=*srcp;
-            uint8_t a=(ix<trnsc)?trns[ix]:0xff;
-            uint32_t rgb=0;
-            if (ix<pltec) {
-              ix*=3;
-              rgb=(plte[ix]<<24)|(plte[ix+1]<<16)|(plte[ix+2]<<8);
-            }
-            wr(dstrow,x,rgb|a);
-          }
-        }
-      } break;
-  }
+  // Specialized kernels for common pairs.
+  if ((converter->cvt=png_convert_select(dstdepth,dstcolortype,srcdepth,srccolortype))) return 0;
+  
+  // Expensive generic conversion with accessor functions.
+  if (!(converter->rd=png_get_pxrd(srcdepth,srccolortype))) return -1;
+  if (!(converter->wr=png_get_pxwr(dstdepth,dstcolortype))) return -1;
+  converter->cvt=png_convert_row_generic;
+  return 0;
+}
+
+/* Convert one row.
+ */
+ 
+void png_convert_row(const struct png_converter *converter,void *dst,const void *src,int w) {
+  converter->cvt(converter,dst,src,w);
 }
 
 /* Convert.
@@ -191,49 +175,23 @@ int png_image_convert(
   const struct png_image *src
 ) {
   if (!dst||!src) return -1;
+  struct png_converter converter;
+  if (png_converter_init(&converter,depth,colortype,src->depth,src->colortype,src)<0) return -1;
   if (png_image_allocate_pixels(dst,src->w,src->h,depth,colortype)<0) return -1;
   
-  // If format is the same, memcpy the whole thing, it's way cheaper.
+  // Same format with the same stride, copy the whole thing at once.
   // This means we're being used as "copy image", which is sane, there is no literal "copy image".
-  // Check stride too. Images produced by us will always have minimal stride, but user-supplied ones maybe not.
-  if ((dst->colortype==src->colortype)&&(dst->depth==src->depth)) {
-    if (dst->stride==src->stride) {
-      memcpy(dst->pixels,src->pixels,dst->stride*dst->h);
-    } else {
-      uint8_t *dstrow=dst->pixels;
-      const uint8_t *srcrow=src->pixels;
-      int i=dst->h;
-      for (;i-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-        memcpy(dstrow,srcrow,dst->stride);
-      }
-    }
+  // Images produced by us will always have minimal stride, but user-supplied ones maybe not.
+  if ((converter.cvt==png_convert_row_copy)&&(dst->stride==src->stride)) {
+    memcpy(dst->pixels,src->pixels,dst->stride*dst->h);
     return 0;
   }
   
-  // Indexed pixels are a mess, of course.
-  if (src->colortype==PNG_COLORTYPE_INDEX) {
-    const void *srcplte=0,*srctrns=0;
-    int srcpltec=png_image_get_chunk_by_id(&srcplte,src,PNG_ID('P','L','T','E'));
-    if (srcpltec>=0) { // PLTE exists so we're doing this...
-      int srctrnsc=png_image_get_chunk_by_id(&srctrns,src,PNG_ID('t','R','N','S'));
-      if (srctrnsc<0) srctrnsc=0;
-      png_image_convert_from_index(dst,src,srcplte,srcpltec,srctrns,srctrnsc);
-      return 0;
-    }
-    // No PLTE, proceed and let the input behave like gray.
-  }
-  
-  // Expensive generic conversion with accessor functions.
-  png_pxrd_fn rd=png_get_pxrd(src->depth,src->colortype);
-  if (!rd) return -1;
-  png_pxwr_fn wr=png_get_pxwr(dst->depth,dst->colortype);
-  if (!wr) return -1;
   uint8_t *dstrow=dst->pixels;
   const uint8_t *srcrow=src->pixels;
   int y=dst->h;
   for (;y-->0;dstrow+=dst->stride,srcrow+=src->stride) {
-    int x=dst->w;
-    while (x-->0) wr(dstrow,x,rd(srcrow,x));
+    png_convert_row(&converter,dstrow,srcrow,dst->w);
   }
   return 0;
 }
@@ -271,6 +229,19 @@ int png_image_allocate_pixels(
   return 0;
 }
 
+/* Remove all chunks.
+ */
+ 
+void png_image_clear_chunks(struct png_image *image) {
+  if (!image) return;
+  struct png_chunk *chunk=image->chunkv;
+  int i=image->chunkc;
+  for (;i-->0;chunk++) {
+    if (chunk->v) free(chunk->v);
+  }
+  image->chunkc=0;
+}
+
 /* Add chunk.
  */
  
@@ -311,6 +282,34 @@ int png_image_add_chunk_copy(struct png_image *image,uint32_t id,const void *v,i
   return 0;
 }
 
+/* APNG frames.
+ */
+ 
+struct png_frame *png_image_add_frame(struct png_image *image) {
+  if (!image) return 0;
+  if (image->framec>=image->framea) {
+    int na=image->framea+8;
+    if (na>INT_MAX/sizeof(struct png_frame)) return 0;
+    void *nv=realloc(image->framev,sizeof(struct png_frame)*na);
+    if (!nv) return 0;
+    image->framev=nv;
+    image->framea=na;
+  }
+  struct png_frame *frame=image->framev+image->framec++;
+  memset(frame,0,sizeof(struct png_frame));
+  return frame;
+}
+
+void png_image_clear_frames(struct png_image *image) {
+  if (!image) return;
+  struct png_frame *frame=image->framev;
+  int i=image->framec;
+  for (;i-->0;frame++) png_image_del(frame->image);
+  image->framec=0;
+  image->plays=0;
+  image->canvasw=image->canvash=0;
+}
+
 /* Find chunk.
  */
 
@@ -0,0 +1,664 @@
+/* png_inflate.c
+ * Our own inflate, an alternative to zlib's for image data. Build with -DPNG_BUILTIN_INFLATE=1 to use it.
+ * Output goes to one flat buffer holding the whole decompressed stream, which doubles as the window:
+ * Back-references are plain copies within it, no sliding or wrapping.
+ * Input can arrive in pieces of any size. We decode one symbol at a time from a checkpoint,
+ * and if the input runs dry mid-symbol, rewind to the checkpoint and wait for more.
+ * Huffman tables are two-level, and primary literal entries hold two literals where both codes fit.
+ */
+
+#include "animaniac.h"
+
+#define PNG_INFLATE_LITLEN_BITS 10
+#define PNG_INFLATE_DIST_BITS 8
+#define PNG_INFLATE_CODELEN_BITS 7
+#define PNG_INFLATE_LITLEN_SIZE 2048 /* primary plus worst-case subtables; zlib says 1332 is enough */
+#define PNG_INFLATE_DIST_SIZE 1024 /* ...and 402 */
+
+/* Table entries, 32 bits:
+ *   0..4: Bits consumed. For subtable links, the primary bits.
+ *   5..7: Kind.
+ *   8..15: Literal, or extra bits count for LENGTH and DIST, or subtable bits for SUB.
+ *   16..23: Second literal, for PAIR.
+ *   16..31: Base, for LENGTH and DIST. Offset, for SUB.
+ */
+#define PNG_INFLATE_LITERAL (0<<5)
+#define PNG_INFLATE_PAIR    (1<<5)
+#define PNG_INFLATE_LENGTH  (2<<5)
+#define PNG_INFLATE_END     (3<<5)
+#define PNG_INFLATE_DIST    (4<<5)
+#define PNG_INFLATE_SUB     (5<<5)
+#define PNG_INFLATE_INVALID (6<<5)
+#define PNG_INFLATE_KIND(e) ((e)&0xe0)
+#define PNG_INFLATE_BITS(e) ((e)&0x1f)
+
+#define PNG_INFLATE_STATE_ZHEADER 0
+#define PNG_INFLATE_STATE_BLOCK   1
+#define PNG_INFLATE_STATE_STORED  2
+#define PNG_INFLATE_STATE_CODES   3
+#define PNG_INFLATE_STATE_ADLER   4
+#define PNG_INFLATE_STATE_DONE    5
+
+struct png_inflate {
+  uint8_t *dst;
+  int dstc,dsta;
+  uint8_t *inv;
+  int inp,inc,ina;
+  uint64_t bitbuf; // LSB first. Bits above (bitc) are either zero or copies of the next input bytes.
+  int bitc;
+  int state;
+  int final; // current block is the last
+  int storedc; // remaining in a stored block
+  int fixed; // (litlen,dist) currently hold the fixed tables
+  int overflow; // stream has more than (dsta); we stopped there
+  int verify;
+  const char *message;
+  uint32_t litlen[PNG_INFLATE_LITLEN_SIZE];
+  uint32_t dist[PNG_INFLATE_DIST_SIZE];
+};
+
+/* Symbol properties, from RFC 1951.
+ */
+
+static const uint16_t png_inflate_length_base[29]={
+  3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258,
+};
+static const uint8_t png_inflate_length_extra[29]={
+  0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,
+};
+static const uint16_t png_inflate_dist_base[30]={
+  1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,
+};
+static const uint8_t png_inflate_dist_extra[30]={
+  0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13,
+};
+static const uint8_t png_inflate_codelen_order[19]={
+  16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15,
+};
+
+static uint32_t png_inflate_litlen_entry(int sym) {
+  if (sym<256) return PNG_INFLATE_LITERAL|(sym<<8);
+  if (sym==256) return PNG_INFLATE_END;
+  if ((sym-=257)<29) return PNG_INFLATE_LENGTH|(png_inflate_length_extra[sym]<<8)|(png_inflate_length_base[sym]<<16);
+  return PNG_INFLATE_INVALID;
+}
+
+static uint32_t png_inflate_dist_entry(int sym) {
+  if (sym<30) return PNG_INFLATE_DIST|(png_inflate_dist_extra[sym]<<8)|(png_inflate_dist_base[sym]<<16);
+  return PNG_INFLATE_INVALID;
+}
+
+static uint32_t png_inflate_codelen_entry(int sym) {
+  return PNG_INFLATE_LITERAL|(sym<<8);
+}
+
+/* Build a table from code lengths.
+ * Incomplete codes are legal (a lone distance code, eg); the unused entries decode as INVALID.
+ */
+
+static inline int png_inflate_build(
+  uint32_t *table,int tablea,int root,
+  const uint8_t *lens,int symc,
+  uint32_t (*entry)(int sym)
+) {
+  int count[16]={0},remaining[16],offs[16];
+  uint16_t sorted[320];
+  int i,j,len;
+  for (i=0;i<symc;i++) count[lens[i]]++;
+  count[0]=0;
+  int tablec=1<<root;
+  int maxlen=15;
+  while (maxlen&&!count[maxlen]) maxlen--;
+  int left=1;
+  for (len=1;len<=15;len++) {
+    left<<=1;
+    if ((left-=count[len])<0) return -1;
+  }
+  if (left) for (i=0;i<tablec;i++) table[i]=PNG_INFLATE_INVALID;
+  if (!maxlen) return 0;
+  offs[1]=0;
+  for (len=1;len<15;len++) offs[len+1]=offs[len]+count[len];
+  for (i=0;i<symc;i++) if (lens[i]) sorted[offs[lens[i]]++]=i;
+  memcpy(remaining,count,sizeof(count));
+
+  // (rev) is the canonical code bit-reversed, and we increment it in reversed order, as zlib does.
+  int rev=0,symp=0,subprefix=-1,suboff=0,subbits=0;
+  for (len=1;len<=maxlen;len++) {
+    int k=count[len];
+    for (;k-->0;symp++) {
+      uint32_t e=entry(sorted[symp]);
+      if (len<=root) {
+        for (j=rev;j<(1<<root);j+=1<<len) table[j]=e|len;
+      } else {
+        int prefix=rev&((1<<root)-1);
+        if (prefix!=subprefix) {
+          // Subtable is just big enough for the codes sharing this prefix.
+          int curr=len-root;
+          int lft=1<<curr;
+          while (curr+root<maxlen) {
+            if ((lft-=remaining[curr+root])<=0) break;
+            curr++;
+            lft<<=1;
+          }
+          subbits=curr;
+          suboff=tablec;
+          if (suboff>tablea-(1<<subbits)) return -1;
+          if (left) for (j=0;j<(1<<subbits);j++) table[suboff+j]=PNG_INFLATE_INVALID;
+          tablec+=1<<subbits;
+          table[prefix]=PNG_INFLATE_SUB|(subbits<<8)|(suboff<<16)|root;
+          subprefix=prefix;
+        }
+        int sublen=len-root;
+        for (j=rev>>root;j<(1<<subbits);j+=1<<sublen) table[suboff+j]=e|sublen;
+      }
+      remaining[len]--;
+      int incr=1<<(len-1);
+      while (rev&incr) incr>>=1;
+      if (incr) rev=(rev&(incr-1))+incr;
+      else rev=0;
+    }
+  }
+  return 0;
+}
+
+/* Where a primary literal entry leaves room for another whole literal code, make it a pair.
+ * Walk backward, so (i>>bits) is always still a single entry when we read it.
+ */
+
+static void png_inflate_pair_literals(uint32_t *table) {
+  int i=(1<<PNG_INFLATE_LITLEN_BITS)-1;
+  for (;i>=0;i--) {
+    uint32_t e=table[i];
+    if (PNG_INFLATE_KIND(e)!=PNG_INFLATE_LITERAL) continue;
+    int bits=PNG_INFLATE_BITS(e);
+    uint32_t e2=table[i>>bits];
+    if (PNG_INFLATE_KIND(e2)!=PNG_INFLATE_LITERAL) continue;
+    int bits2=PNG_INFLATE_BITS(e2);
+    if (bits+bits2>PNG_INFLATE_LITLEN_BITS) continue;
+    table[i]=PNG_INFLATE_PAIR|(e&0xff00)|((e2&0xff00)<<8)|(bits+bits2);
+  }
+}
+
+/* Fixed tables.
+ */
+
+static int png_inflate_build_fixed(struct png_inflate *inflate) {
+  if (inflate->fixed) return 0;
+  uint8_t lens[288];
+  int i=0;
+  for (;i<144;i++) lens[i]=8;
+  for (;i<256;i++) lens[i]=9;
+  for (;i<280;i++) lens[i]=7;
+  for (;i<288;i++) lens[i]=8;
+  if (png_inflate_build(inflate->litlen,PNG_INFLATE_LITLEN_SIZE,PNG_INFLATE_LITLEN_BITS,lens,288,png_inflate_litlen_entry)<0) return -1;
+  png_inflate_pair_literals(inflate->litlen);
+  for (i=0;i<30;i++) lens[i]=5;
+  if (png_inflate_build(inflate->dist,PNG_INFLATE_DIST_SIZE,PNG_INFLATE_DIST_BITS,lens,30,png_inflate_dist_entry)<0) return -1;
+  inflate->fixed=1;
+  return 0;
+}
+
+/* Object lifecycle.
+ */
+
+void png_inflate_del(struct png_inflate *inflate) {
+  if (!inflate) return;
+  if (inflate->inv) free(inflate->inv);
+  free(inflate);
+}
+
+struct png_inflate *png_inflate_new() {
+  struct png_inflate *inflate=calloc(1,sizeof(struct png_inflate));
+  if (!inflate) return 0;
+  return inflate;
+}
+
+void png_inflate_reset(struct png_inflate *inflate,void *dst,int dsta) {
+  inflate->dst=dst;
+  inflate->dstc=0;
+  inflate->dsta=dsta;
+  inflate->inp=inflate->inc=0;
+  inflate->bitbuf=0;
+  inflate->bitc=0;
+  inflate->state=PNG_INFLATE_STATE_ZHEADER;
+  inflate->final=0;
+  inflate->storedc=0;
+  inflate->overflow=0;
+  inflate->message=0;
+}
+
+void png_inflate_set_verify(struct png_inflate *inflate,int verify) {
+  inflate->verify=verify;
+}
+
+int png_inflate_get_output_size(const struct png_inflate *inflate) {
+  return inflate->dstc;
+}
+
+const char *png_inflate_get_message(const struct png_inflate *inflate) {
+  return inflate->message;
+}
+
+/* Append input, and drop what we've consumed.
+ */
+
+static int png_inflate_append(struct png_inflate *inflate,const void *src,int srcc) {
+  if (inflate->inp) {
+    inflate->inc-=inflate->inp;
+    memmove(inflate->inv,inflate->inv+inflate->inp,inflate->inc);
+    inflate->inp=0;
+  }
+  if (inflate->inc>inflate->ina-srcc) {
+    if (srcc>INT_MAX-inflate->inc-256) return -1;
+    int na=(inflate->inc+srcc+256)&~255;
+    void *nv=realloc(inflate->inv,na);
+    if (!nv) return -1;
+    inflate->inv=nv;
+    inflate->ina=na;
+  }
+  memcpy(inflate->inv+inflate->inc,src,srcc);
+  inflate->inc+=srcc;
+  return 0;
+}
+
+/* Bit reader, over locals (in,inp,inc,bb,bc) that each function keeps.
+ * REFILL tops up to at least 56 bits if there's enough input, loading 8 bytes at once.
+ * NEED jumps to (_more_) if we can't get (n) bits.
+ */
+
+#define REFILL { \
+  if (inc-inp>=8) { \
+    uint64_t v; \
+    memcpy(&v,in+inp,8); \
+    bb|=png_inflate_le64(v)<<bc; \
+    inp+=(63-bc)>>3; \
+    bc|=56; \
+  } else { \
+    while ((bc<=56)&&(inp<inc)) { bb|=(uint64_t)in[inp++]<<bc; bc+=8; } \
+  } \
+}
+#define NEED(n) if (bc<(n)) { REFILL if (bc<(n)) goto _more_; }
+#define DROP(n) { bb>>=(n); bc-=(n); }
+
+static inline uint64_t png_inflate_le64(uint64_t v) {
+  #if defined(__BYTE_ORDER__)&&(__BYTE_ORDER__==__ORDER_BIG_ENDIAN__)
+    return __builtin_bswap64(v);
+  #else
+    return v;
+  #endif
+}
+
+/* Decode a dynamic block's tables.
+ * Caller has consumed the block header's 3 bits. Returns 0 if we need more input, >0 if done.
+ */
+
+static int png_inflate_dynamic(struct png_inflate *inflate) {
+  const uint8_t *in=inflate->inv;
+  int inp=inflate->inp,inc=inflate->inc;
+  uint64_t bb=inflate->bitbuf;
+  int bc=inflate->bitc;
+  uint8_t lens[320];
+  uint32_t cltable[1<<PNG_INFLATE_CODELEN_BITS];
+  int i;
+
+  NEED(14)
+  int hlit=(bb&31)+257,hdist=((bb>>5)&31)+1,hclen=((bb>>10)&15)+4;
+  DROP(14)
+  if ((hlit>286)||(hdist>30)) {
+    inflate->message="Invalid code counts.";
+    return -1;
+  }
+
+  memset(lens,0,19);
+  for (i=0;i<hclen;i++) {
+    NEED(3)
+    lens[png_inflate_codelen_order[i]]=bb&7;
+    DROP(3)
+  }
+  if (png_inflate_build(cltable,1<<PNG_INFLATE_CODELEN_BITS,PNG_INFLATE_CODELEN_BITS,lens,19,png_inflate_codelen_entry)<0) {
+    inflate->message="Invalid code length code.";
+    return -1;
+  }
+
+  int c=hlit+hdist;
+  for (i=0;i<c;) {
+    NEED(7)
+    uint32_t e=cltable[bb&((1<<PNG_INFLATE_CODELEN_BITS)-1)];
+    if (PNG_INFLATE_KIND(e)==PNG_INFLATE_INVALID) {
+      inflate->message="Invalid code length code.";
+      return -1;
+    }
+    int bits=PNG_INFLATE_BITS(e),sym=(e>>8)&0xff,rep,v;
+    if (sym<16) {
+      DROP(bits)
+      lens[i++]=sym;
+      continue;
+    }
+    switch (sym) {
+      case 16: NEED(bits+2) if (!i) { inflate->message="Repeat with no previous length."; return -1; }
+               v=lens[i-1]; rep=3+((bb>>bits)&3); DROP(bits+2) break;
+      case 17: NEED(bits+3) v=0; rep=3+((bb>>bits)&7); DROP(bits+3) break;
+      default: NEED(bits+7) v=0; rep=11+((bb>>bits)&127); DROP(bits+7) break;
+    }
+    if (rep>c-i) {
+      inflate->message="Code lengths overflow.";
+      return -1;
+    }
+    while (rep-->0) lens[i++]=v;
+  }
+  if (!lens[256]) {
+    inflate->message="No end-of-block code.";
+    return -1;
+  }
+
+  if (png_inflate_build(inflate->litlen,PNG_INFLATE_LITLEN_SIZE,PNG_INFLATE_LITLEN_BITS,lens,hlit,png_inflate_litlen_entry)<0) {
+    inflate->message="Invalid literal/length code.";
+    return -1;
+  }
+  png_inflate_pair_literals(inflate->litlen);
+  if (png_inflate_build(inflate->dist,PNG_INFLATE_DIST_SIZE,PNG_INFLATE_DIST_BITS,lens+hlit,hdist,png_inflate_dist_entry)<0) {
+    inflate->message="Invalid distance code.";
+    return -1;
+  }
+  inflate->fixed=0;
+
+  inflate->inp=inp;
+  inflate->bitbuf=bb;
+  inflate->bitc=bc;
+  return 1;
+ _more_:
+  return 0;
+}
+
+/* Decode symbols until the block ends, input runs out, or output overflows.
+ * Returns >0 at end of block, 0 if we need more input, or <0 for errors.
+ * Overflow is end of block too, with (overflow) set.
+ */
+
+static int png_inflate_codes(struct png_inflate *inflate) {
+  const uint8_t *in=inflate->inv;
+  int inp=inflate->inp,inc=inflate->inc;
+  uint64_t bb=inflate->bitbuf;
+  int bc=inflate->bitc;
+  uint8_t *dst=inflate->dst;
+  int dstc=inflate->dstc,dsta=inflate->dsta;
+  const uint32_t *litlen=inflate->litlen,*disttable=inflate->dist;
+  int result=0;
+
+  while (1) {
+
+    // Checkpoint. If we run out of input before the end of this symbol, we come back here.
+    inflate->inp=inp;
+    inflate->bitbuf=bb;
+    inflate->bitc=bc;
+    inflate->dstc=dstc;
+    if (bc<56) REFILL
+
+    uint32_t e=litlen[bb&((1<<PNG_INFLATE_LITLEN_BITS)-1)];
+    if (PNG_INFLATE_KIND(e)==PNG_INFLATE_SUB) {
+      if (bc<PNG_INFLATE_LITLEN_BITS) goto _more_;
+      int root=PNG_INFLATE_LITLEN_BITS;
+      e=litlen[(e>>16)+((bb>>root)&((1<<((e>>8)&0xff))-1))];
+      int bits=PNG_INFLATE_BITS(e);
+      if (root+bits>bc) goto _more_;
+      DROP(root)
+    }
+    int bits=PNG_INFLATE_BITS(e);
+    if (bits>bc) goto _more_;
+
+    switch (PNG_INFLATE_KIND(e)) {
+
+      case PNG_INFLATE_LITERAL: {
+          if (dstc>=dsta) goto _overflow_;
+          DROP(bits)
+          dst[dstc++]=e>>8;
+        } break;
+
+      case PNG_INFLATE_PAIR: {
+          if (dstc>=dsta) goto _overflow_;
+          DROP(bits)
+          dst[dstc++]=e>>8;
+          if (dstc>=dsta) goto _overflow_;
+          dst[dstc++]=e>>16;
+        } break;
+
+      case PNG_INFLATE_LENGTH: {
+          int extra=(e>>8)&0xff;
+          if (bits+extra>bc) goto _more_;
+          int len=(e>>16)+((bb>>bits)&((1<<extra)-1));
+          DROP(bits+extra)
+          if (bc<PNG_INFLATE_DIST_BITS) REFILL
+          uint32_t d=disttable[bb&((1<<PNG_INFLATE_DIST_BITS)-1)];
+          if (PNG_INFLATE_KIND(d)==PNG_INFLATE_SUB) {
+            if (bc<PNG_INFLATE_DIST_BITS) goto _more_;
+            int root=PNG_INFLATE_DIST_BITS;
+            d=disttable[(d>>16)+((bb>>root)&((1<<((d>>8)&0xff))-1))];
+            if (root+PNG_INFLATE_BITS(d)>bc) goto _more_;
+            DROP(root)
+          }
+          int dbits=PNG_INFLATE_BITS(d);
+          if (dbits>bc) goto _more_;
+          if (PNG_INFLATE_KIND(d)!=PNG_INFLATE_DIST) {
+            inflate->message="Invalid distance code.";
+            return -1;
+          }
+          int dextra=(d>>8)&0xff;
+          if (dbits+dextra>bc) {
+            REFILL
+            if (dbits+dextra>bc) goto _more_;
+          }
+          int dist=(d>>16)+((bb>>dbits)&((1<<dextra)-1));
+          DROP(dbits+dextra)
+          if (dist>dstc) {
+            inflate->message="Distance too far back.";
+            return -1;
+          }
+          if (len>dsta-dstc) {
+            len=dsta-dstc;
+            inflate->overflow=1;
+          }
+          uint8_t *dp=dst+dstc;
+          const uint8_t *sp=dp-dist;
+          dstc+=len;
+          // We're allowed to overrun by up to 7 bytes; the caller leaves PNG_INFLATE_SLACK past (dsta).
+          if (dist>=8) {
+            uint8_t *dend=dp+len;
+            do {
+              memcpy(dp,sp,8);
+              dp+=8;
+              sp+=8;
+            } while (dp<dend);
+          } else if (dist==1) {
+            memset(dp,*sp,len);
+          } else {
+            while (len-->0) *(dp++)=*(sp++);
+          }
+          if (inflate->overflow) {
+            result=1;
+            goto _done_;
+          }
+        } break;
+
+      case PNG_INFLATE_END: {
+          DROP(bits)
+          result=1;
+          goto _done_;
+        }
+
+      default: {
+          inflate->message="Invalid literal/length code.";
+          return -1;
+        }
+    }
+  }
+
+ _overflow_:
+  inflate->overflow=1;
+  result=1;
+ _done_:
+  inflate->inp=inp;
+  inflate->bitbuf=bb;
+  inflate->bitc=bc;
+  inflate->dstc=dstc;
+  return result;
+ _more_:
+  // (inflate) still holds the last checkpoint.
+  return 0;
+}
+
+/* Stored block, as much as we can.
+ * Returns >0 at end of block.
+ */
+
+static int png_inflate_stored(struct png_inflate *inflate) {
+  // Leftover whole bytes in the bit buffer first.
+  while (inflate->storedc&&(inflate->bitc>=8)&&(inflate->dstc<inflate->dsta)) {
+    inflate->dst[inflate->dstc++]=inflate->bitbuf;
+    inflate->bitbuf>>=8;
+    inflate->bitc-=8;
+    inflate->storedc--;
+  }
+  if (!inflate->storedc) return 1;
+  if (inflate->dstc>=inflate->dsta) {
+    inflate->overflow=1;
+    return 1;
+  }
+  // Bit buffer is empty; any bits above (bitc) are stale copies of input we're about to take directly.
+  inflate->bitbuf=0;
+  int cpc=inflate->inc-inflate->inp;
+  if (cpc>inflate->storedc) cpc=inflate->storedc;
+  if (cpc>inflate->dsta-inflate->dstc) cpc=inflate->dsta-inflate->dstc;
+  memcpy(inflate->dst+inflate->dstc,inflate->inv+inflate->inp,cpc);
+  inflate->dstc+=cpc;
+  inflate->inp+=cpc;
+  inflate->storedc-=cpc;
+  if (!inflate->storedc) return 1;
+  if (inflate->dstc>=inflate->dsta) {
+    inflate->overflow=1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Receive input.
+ */
+
+int png_inflate_provide(struct png_inflate *inflate,const void *src,int srcc) {
+  if (inflate->message) return -1;
+  if (inflate->state==PNG_INFLATE_STATE_DONE) return 1;
+  if (inflate->overflow) return 1;
+  if (png_inflate_append(inflate,src,srcc)<0) {
+    inflate->message="Out of memory.";
+    return -1;
+  }
+
+  while (1) {
+    const uint8_t *in=inflate->inv;
+    int inp=inflate->inp,inc=inflate->inc;
+    uint64_t bb=inflate->bitbuf;
+    int bc=inflate->bitc;
+    int err;
+
+    switch (inflate->state) {
+
+      case PNG_INFLATE_STATE_ZHEADER: {
+          NEED(16)
+          int cmf=bb&0xff,flg=(bb>>8)&0xff;
+          if (((cmf&0x0f)!=8)||((cmf<<8|flg)%31)||(flg&0x20)) {
+            inflate->message="Invalid zlib header.";
+            return -1;
+          }
+          DROP(16)
+          inflate->state=PNG_INFLATE_STATE_BLOCK;
+        } break;
+
+      case PNG_INFLATE_STATE_BLOCK: {
+          NEED(3)
+          inflate->final=bb&1;
+          int type=(bb>>1)&3;
+          DROP(3)
+          switch (type) {
+            case 0: {
+                DROP(bc&7)
+                NEED(32)
+                int len=bb&0xffff,nlen=(bb>>16)&0xffff;
+                if (len!=(nlen^0xffff)) {
+                  inflate->message="Stored block length mismatch.";
+                  return -1;
+                }
+                DROP(32)
+                inflate->storedc=len;
+                inflate->state=PNG_INFLATE_STATE_STORED;
+              } break;
+            case 1: {
+                if (png_inflate_build_fixed(inflate)<0) {
+                  inflate->message="Failed to build fixed tables.";
+                  return -1;
+                }
+                inflate->state=PNG_INFLATE_STATE_CODES;
+              } break;
+            case 2: {
+                // png_inflate_dynamic() picks up from (inflate), so commit the header first, then roll back if we need more.
+                int pinp=inflate->inp,pbc=inflate->bitc;
+                uint64_t pbb=inflate->bitbuf;
+                inflate->inp=inp;
+                inflate->bitbuf=bb;
+                inflate->bitc=bc;
+                if ((err=png_inflate_dynamic(inflate))<0) return -1;
+                if (!err) {
+                  inflate->inp=pinp;
+                  inflate->bitbuf=pbb;
+                  inflate->bitc=pbc;
+                  return 0;
+                }
+                inflate->state=PNG_INFLATE_STATE_CODES;
+              } continue;
+            default: {
+                inflate->message="Invalid block type.";
+                return -1;
+              }
+          }
+        } break;
+
+      case PNG_INFLATE_STATE_STORED: {
+          if ((err=png_inflate_stored(inflate))<0) return -1;
+          if (!err) return 0;
+          if (inflate->overflow) return 1;
+          inflate->state=inflate->final?PNG_INFLATE_STATE_ADLER:PNG_INFLATE_STATE_BLOCK;
+        } continue;
+
+      case PNG_INFLATE_STATE_CODES: {
+          if ((err=png_inflate_codes(inflate))<0) return -1;
+          if (!err) return 0;
+          if (inflate->overflow) return 1;
+          inflate->state=inflate->final?PNG_INFLATE_STATE_ADLER:PNG_INFLATE_STATE_BLOCK;
+        } continue;
+
+      case PNG_INFLATE_STATE_ADLER: {
+          DROP(bc&7)
+          NEED(32)
+          uint32_t expect=((bb&0xff)<<24)|((bb&0xff00)<<8)|((bb>>8)&0xff00)|((bb>>24)&0xff);
+          DROP(32)
+          if (inflate->verify&&(expect!=png_adler32(1,inflate->dst,inflate->dstc))) {
+            inflate->message="Adler-32 mismatch.";
+            return -1;
+          }
+          inflate->state=PNG_INFLATE_STATE_DONE;
+        } break;
+
+      case PNG_INFLATE_STATE_DONE: return 1;
+    }
+
+    // Header states commit their reads here.
+    inflate->inp=inp;
+    inflate->bitbuf=bb;
+    inflate->bitc=bc;
+    continue;
+   _more_:
+    return 0;
+  }
+}
+
+#undef REFILL
+#undef NEED
+#undef DROP
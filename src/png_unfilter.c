@@ -0,0 +1,358 @@
+/* png_unfilter.c
+ * Reverse the per-row PNG filters.
+ * The scalar implementation is the reference and works everywhere.
+ * On x86 we pick SSE2 or AVX2 kernels at runtime, specialized per pixel size.
+ * Avg and Paeth are serial pixel-to-pixel, so the best we can do there is one pixel per step.
+ * Sub is serial too, but it's a plain prefix sum, so we can do a whole vector per step.
+ */
+
+#include "animaniac.h"
+#include <pthread.h>
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+  #define PNG_UNFILTER_X86 1
+  #include <immintrin.h>
+  #define PNG_SSE2 __attribute__((target("sse2")))
+  #define PNG_AVX2 __attribute__((target("avx2")))
+#else
+  #define PNG_UNFILTER_X86 0
+#endif
+
+typedef void (*png_unfilter_fn)(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len);
+
+/* Scalar reference.
+ */
+
+static inline uint8_t png_paeth(uint8_t a,uint8_t b,uint8_t c) {
+  int p=a+b-c;
+  int pa=a-p; if (pa<0) pa=-pa;
+  int pb=b-p; if (pb<0) pb=-pb;
+  int pc=c-p; if (pc<0) pc=-pc;
+  if ((pa<=pb)&&(pa<=pc)) return a;
+  if (pb<=pc) return b;
+  return c;
+}
+
+int png_unfilter_row_scalar(
+  uint8_t *dst,
+  const uint8_t *src,
+  const uint8_t *pv,
+  uint8_t filter,
+  int len,
+  int xstride
+) {
+  switch (filter) {
+    case 0: {
+        memcpy(dst,src,len);
+      } return 0;
+    case 1: {
+        memcpy(dst,src,xstride);
+        int i=xstride; for (;i<len;i++) {
+          dst[i]=src[i]+dst[i-xstride];
+        }
+      } return 0;
+    case 2: if (pv) {
+        int i=len; for (;i-->0;dst++,src++,pv++) {
+          *dst=(*src)+(*pv);
+        }
+      } else {
+        memcpy(dst,src,len);
+      } return 0;
+    case 3: if (pv) {
+        int i=0;
+        for (;i<xstride;i++) dst[i]=src[i]+(pv[i]>>1);
+        for (;i<len;i++) dst[i]=src[i]+((pv[i]+dst[i-xstride])>>1);
+      } else {
+        int i=0;
+        for (;i<xstride;i++) dst[i]=src[i];
+        for (;i<len;i++) dst[i]=src[i]+(dst[i-xstride]>>1);
+      } return 0;
+    case 4: if (pv) {
+        int i=0;
+        for (;i<xstride;i++) dst[i]=src[i]+pv[i];
+        for (;i<len;i++) dst[i]=src[i]+png_paeth(dst[i-xstride],pv[i],pv[i-xstride]);
+      } else {
+        int i=0;
+        for (;i<xstride;i++) dst[i]=src[i];
+        for (;i<len;i++) dst[i]=src[i]+dst[i-xstride];
+      } return 0;
+  }
+  return -1;
+}
+
+/* Scalar kernels with a constant pixel size, for the 1- and 2-byte cases where SIMD doesn't help.
+ * All kernels here assume (pv) is present.
+ */
+
+static inline uint8_t png_paeth_branchless(int a,int b,int c) {
+  int pa=b-c,pb=a-c,pc=pa+pb;
+  pa=(pa<0)?-pa:pa;
+  pb=(pb<0)?-pb:pb;
+  pc=(pc<0)?-pc:pc;
+  int best=b; if (pb>pc) { best=c; pb=pc; }
+  return (pa<=pb)?a:best;
+}
+
+#define PNG_UNFILTER_SMALL(bpp) \
+  static void png_unfilter_avg_##bpp(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) { \
+    int i=0; \
+    for (;i<bpp;i++) dst[i]=src[i]+(pv[i]>>1); \
+    for (;i<len;i++) dst[i]=src[i]+((pv[i]+dst[i-bpp])>>1); \
+  } \
+  static void png_unfilter_paeth_##bpp(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) { \
+    int i=0; \
+    for (;i<bpp;i++) dst[i]=src[i]+pv[i]; \
+    for (;i<len;i++) dst[i]=src[i]+png_paeth_branchless(dst[i-bpp],pv[i],pv[i-bpp]); \
+  }
+
+PNG_UNFILTER_SMALL(1)
+PNG_UNFILTER_SMALL(2)
+
+#undef PNG_UNFILTER_SMALL
+
+#if PNG_UNFILTER_X86
+
+/* Up, whole vectors at a time.
+ */
+
+static PNG_SSE2 void png_unfilter_up_sse2(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) {
+  int i=0;
+  for (;i<=len-16;i+=16) {
+    __m128i x=_mm_loadu_si128((const __m128i*)(src+i));
+    __m128i b=_mm_loadu_si128((const __m128i*)(pv+i));
+    _mm_storeu_si128((__m128i*)(dst+i),_mm_add_epi8(x,b));
+  }
+  for (;i<len;i++) dst[i]=src[i]+pv[i];
+}
+
+static PNG_AVX2 void png_unfilter_up_avx2(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) {
+  int i=0;
+  for (;i<=len-32;i+=32) {
+    __m256i x=_mm256_loadu_si256((const __m256i*)(src+i));
+    __m256i b=_mm256_loadu_si256((const __m256i*)(pv+i));
+    _mm256_storeu_si256((__m256i*)(dst+i),_mm256_add_epi8(x,b));
+  }
+  for (;i<len;i++) dst[i]=src[i]+pv[i];
+}
+
+/* Load or store one pixel in the low lanes of a vector.
+ * We move 4 or 8 bytes regardless of (bpp), so callers must leave that much headroom.
+ */
+
+#define PNG_LOADPX(bpp,p) (((bpp)<=4)?_mm_cvtsi32_si128(png_load32(p)):_mm_loadl_epi64((const __m128i*)(p)))
+#define PNG_STOREPX(bpp,p,v) { if ((bpp)<=4) png_store32(p,_mm_cvtsi128_si32(v)); else _mm_storel_epi64((__m128i*)(p),v); }
+#define PNG_PXLOAD(bpp) (((bpp)<=4)?4:8)
+
+static inline int png_load32(const uint8_t *p) {
+  int v;
+  memcpy(&v,p,4);
+  return v;
+}
+
+static inline void png_store32(uint8_t *p,int v) {
+  memcpy(p,&v,4);
+}
+
+/* Sub: Add the previous pixel to the first lanes, then prefix-sum the vector by pixels.
+ * We take as many whole pixels as fit in 16 bytes.
+ * Lanes beyond the last whole pixel get written with garbage, then overwritten on the next step.
+ */
+
+#define PNG_UNFILTER_SUB_SSE2(bpp) \
+  static PNG_SSE2 void png_unfilter_sub_sse2_##bpp(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) { \
+    const int step=(16/(bpp))*(bpp); \
+    const __m128i mask=_mm_srli_si128(_mm_set1_epi8(-1),16-(bpp)); \
+    __m128i carry=_mm_setzero_si128(); \
+    int i=0; \
+    for (;i<=len-16;i+=step) { \
+      __m128i x=_mm_add_epi8(_mm_loadu_si128((const __m128i*)(src+i)),carry); \
+      x=_mm_add_epi8(x,_mm_slli_si128(x,(bpp))); \
+      if ((bpp)*2<step) x=_mm_add_epi8(x,_mm_slli_si128(x,(bpp)*2)); \
+      if ((bpp)*4<step) x=_mm_add_epi8(x,_mm_slli_si128(x,(bpp)*4)); \
+      if ((bpp)*8<step) x=_mm_add_epi8(x,_mm_slli_si128(x,(bpp)*8)); \
+      _mm_storeu_si128((__m128i*)(dst+i),x); \
+      carry=_mm_and_si128(_mm_srli_si128(x,(16/(bpp))*(bpp)-(bpp)),mask); \
+    } \
+    if (!i) { memcpy(dst,src,(bpp)); i=(bpp); } \
+    for (;i<len;i++) dst[i]=src[i]+dst[i-(bpp)]; \
+  }
+
+/* Avg: One pixel per step.
+ * _mm_avg_epu8 rounds up, and we need it to round down, so subtract the low bit of (a^b).
+ */
+
+#define PNG_UNFILTER_AVG_SSE2(bpp) \
+  static PNG_SSE2 void png_unfilter_avg_sse2_##bpp(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) { \
+    const __m128i one=_mm_set1_epi8(1); \
+    __m128i a=_mm_setzero_si128(); \
+    int i=0; \
+    for (;i<=len-PNG_PXLOAD(bpp);i+=(bpp)) { \
+      __m128i b=PNG_LOADPX(bpp,pv+i); \
+      __m128i avg=_mm_sub_epi8(_mm_avg_epu8(a,b),_mm_and_si128(_mm_xor_si128(a,b),one)); \
+      a=_mm_add_epi8(PNG_LOADPX(bpp,src+i),avg); \
+      PNG_STOREPX(bpp,dst+i,a) \
+    } \
+    if (!i) for (;(i<(bpp))&&(i<len);i++) dst[i]=src[i]+(pv[i]>>1); \
+    for (;i<len;i++) dst[i]=src[i]+((pv[i]+dst[i-(bpp)])>>1); \
+  }
+
+/* Paeth: One pixel per step, in 16-bit lanes.
+ * pa=|b-c|, pb=|a-c|, pc=|a+b-2c|; prefer a, then b, then c.
+ */
+
+static PNG_SSE2 inline __m128i png_abs16_sse2(__m128i v) {
+  return _mm_max_epi16(v,_mm_sub_epi16(_mm_setzero_si128(),v));
+}
+
+static PNG_SSE2 inline __m128i png_select_sse2(__m128i mask,__m128i yes,__m128i no) {
+  return _mm_or_si128(_mm_and_si128(mask,yes),_mm_andnot_si128(mask,no));
+}
+
+#define PNG_UNFILTER_PAETH_SSE2(bpp) \
+  static PNG_SSE2 void png_unfilter_paeth_sse2_##bpp(uint8_t *dst,const uint8_t *src,const uint8_t *pv,int len) { \
+    const __m128i zero=_mm_setzero_si128(); \
+    __m128i a=zero,c=zero; \
+    int i=0; \
+    for (;i<=len-PNG_PXLOAD(bpp);i+=(bpp)) { \
+      __m128i b=_mm_unpacklo_epi8(PNG_LOADPX(bpp,pv+i),zero); \
+      __m128i pa=_mm_sub_epi16(b,c); \
+      __m128i pb=_mm_sub_epi16(a,c); \
+      __m128i pc=png_abs16_sse2(_mm_add_epi16(pa,pb)); \
+      pa=png_abs16_sse2(pa); \
+      pb=png_abs16_sse2(pb); \
+      __m128i usea=_mm_or_si128(_mm_cmpgt_epi16(pa,pb),_mm_cmpgt_epi16(pa,pc)); \
+      __m128i useb=_mm_cmpgt_epi16(pb,pc); \
+      __m128i pred=png_select_sse2(usea,png_select_sse2(useb,c,b),a); \
+      __m128i d=_mm_add_epi8(PNG_LOADPX(bpp,src+i),_mm_packus_epi16(pred,pred)); \
+      PNG_STOREPX(bpp,dst+i,d) \
+      a=_mm_unpacklo_epi8(d,zero); \
+      c=b; \
+    } \
+    if (!i) for (;(i<(bpp))&&(i<len);i++) dst[i]=src[i]+pv[i]; \
+    for (;i<len;i++) dst[i]=src[i]+png_paeth(dst[i-(bpp)],pv[i],pv[i-(bpp)]); \
+  }
+
+PNG_UNFILTER_SUB_SSE2(1)
+PNG_UNFILTER_SUB_SSE2(2)
+PNG_UNFILTER_SUB_SSE2(3)
+PNG_UNFILTER_SUB_SSE2(4)
+PNG_UNFILTER_SUB_SSE2(6)
+PNG_UNFILTER_SUB_SSE2(8)
+PNG_UNFILTER_AVG_SSE2(3)
+PNG_UNFILTER_AVG_SSE2(4)
+PNG_UNFILTER_AVG_SSE2(6)
+PNG_UNFILTER_AVG_SSE2(8)
+PNG_UNFILTER_PAETH_SSE2(3)
+PNG_UNFILTER_PAETH_SSE2(4)
+PNG_UNFILTER_PAETH_SSE2(6)
+PNG_UNFILTER_PAETH_SSE2(8)
+
+#undef PNG_UNFILTER_SUB_SSE2
+#undef PNG_UNFILTER_AVG_SSE2
+#undef PNG_UNFILTER_PAETH_SSE2
+
+#endif
+
+/* Kernel tables, one per level, each indexed by [filter][xstride].
+ * Null entries fall back to the scalar reference.
+ * Decoders unfilter on worker threads, so the tables are built once and never touched again,
+ * and choosing a level only swaps which one (png_unfilter_kernels) points to.
+ */
+
+#define PNG_UNFILTER_LEVEL_COUNT 3
+
+typedef png_unfilter_fn png_unfilter_table[5][9];
+
+static png_unfilter_table png_unfilter_tablev[PNG_UNFILTER_LEVEL_COUNT];
+static png_unfilter_table *png_unfilter_kernels=0;
+static int png_unfilter_detected=PNG_UNFILTER_LEVEL_SCALAR;
+static pthread_once_t png_unfilter_once=PTHREAD_ONCE_INIT;
+
+static void png_unfilter_build(png_unfilter_fn (*kernels)[9],int level) {
+  if (level>=PNG_UNFILTER_LEVEL_SCALAR) {
+    kernels[3][1]=png_unfilter_avg_1;
+    kernels[3][2]=png_unfilter_avg_2;
+    kernels[4][1]=png_unfilter_paeth_1;
+    kernels[4][2]=png_unfilter_paeth_2;
+  }
+  #if PNG_UNFILTER_X86
+    if (level>=PNG_UNFILTER_LEVEL_SSE2) {
+      int xstride=1; for (;xstride<=8;xstride++) kernels[2][xstride]=png_unfilter_up_sse2;
+      #define SSE2(bpp) \
+        kernels[1][bpp]=png_unfilter_sub_sse2_##bpp; \
+        kernels[3][bpp]=png_unfilter_avg_sse2_##bpp; \
+        kernels[4][bpp]=png_unfilter_paeth_sse2_##bpp;
+      kernels[1][1]=png_unfilter_sub_sse2_1;
+      kernels[1][2]=png_unfilter_sub_sse2_2;
+      SSE2(3)
+      SSE2(4)
+      SSE2(6)
+      SSE2(8)
+      #undef SSE2
+    }
+    if (level>=PNG_UNFILTER_LEVEL_AVX2) {
+      int xstride=1; for (;xstride<=8;xstride++) kernels[2][xstride]=png_unfilter_up_avx2;
+    }
+  #endif
+}
+
+static void png_unfilter_init() {
+  int level=0;
+  for (;level<PNG_UNFILTER_LEVEL_COUNT;level++) png_unfilter_build(png_unfilter_tablev[level],level);
+  #if PNG_UNFILTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) png_unfilter_detected=PNG_UNFILTER_LEVEL_SSE2;
+    if (__builtin_cpu_supports("avx2")) png_unfilter_detected=PNG_UNFILTER_LEVEL_AVX2;
+  #endif
+}
+
+/* Choose kernels.
+ */
+
+int png_unfilter_set_level(int level) {
+  pthread_once(&png_unfilter_once,png_unfilter_init);
+  if (level<0) {
+    level=png_unfilter_detected;
+  } else {
+    #if PNG_UNFILTER_X86
+      if (level>PNG_UNFILTER_LEVEL_AVX2) level=PNG_UNFILTER_LEVEL_AVX2;
+    #else
+      if (level>PNG_UNFILTER_LEVEL_SCALAR) level=PNG_UNFILTER_LEVEL_SCALAR;
+    #endif
+  }
+  __atomic_store_n(&png_unfilter_kernels,png_unfilter_tablev+level,__ATOMIC_RELEASE);
+  return level;
+}
+
+/* Unfilter with the best available kernel.
+ */
+
+int png_unfilter_row(
+  uint8_t *dst,
+  const uint8_t *src,
+  const uint8_t *pv,
+  uint8_t filter,
+  int len,
+  int xstride
+) {
+  png_unfilter_table *kernels=__atomic_load_n(&png_unfilter_kernels,__ATOMIC_ACQUIRE);
+  if (!kernels) {
+    png_unfilter_set_level(-1);
+    kernels=__atomic_load_n(&png_unfilter_kernels,__ATOMIC_ACQUIRE);
+  }
+  if (pv&&(filter<5)&&(xstride<=8)) {
+    png_unfilter_fn fn=(*kernels)[filter][xstride];
+    if (fn) {
+      fn(dst,src,pv,len);
+      return 0;
+    }
+  } else if ((filter==1)&&(xstride<=8)) {
+    // Sub is the only filter that doesn't look at the previous row; use the kernel even for row zero.
+    png_unfilter_fn fn=(*kernels)[1][xstride];
+    if (fn) {
+      fn(dst,src,0,len);
+      return 0;
+    }
+  }
+  return png_unfilter_row_scalar(dst,src,pv,filter,len,xstride);
+}
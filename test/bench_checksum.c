@@ -0,0 +1,69 @@
+/* bench_checksum.c
+ * Cost of verification: png_crc32 and png_adler32 against zlib's, over one big buffer and in chunk-sized pieces.
+ * Usage: bench_checksum [MEGABYTES]
+ */
+
+#include "animaniac.h"
+#include <zlib.h>
+#include <time.h>
+
+#define REPC 10
+#define PIECE 37
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+static void bench_report(const char *name,double start,int c) {
+  printf("%s: %.0f MB/s\n",name,(double)c*REPC/(bench_now()-start)/1000000.0);
+}
+
+int main(int argc,char **argv) {
+  int mb=(argc>=2)?atoi(argv[1]):16;
+  if ((mb<1)||(mb>1024)) mb=16;
+  int c=mb<<20;
+  uint8_t *src=malloc(c+1);
+  if (!src) return 1;
+  int i=0;
+  for (;i<=c;i++) src[i]=i*2654435761u>>13;
+  
+  // Start one byte in, so nobody gets an aligned buffer for free.
+  if (png_crc32(0,src+1,c)!=crc32(0,src+1,c)) {
+    fprintf(stderr,"bench_checksum: png_crc32 disagrees with zlib.\n");
+    return 1;
+  }
+  if (png_adler32(1,src+1,c)!=adler32(1,src+1,c)) {
+    fprintf(stderr,"bench_checksum: png_adler32 disagrees with zlib.\n");
+    return 1;
+  }
+  
+  // Sum the results so the calls can't be dropped.
+  uint32_t sum=0;
+  double start=bench_now();
+  for (i=REPC;i-->0;) sum+=png_crc32(0,src+1,c);
+  bench_report("png_crc32",start,c);
+  start=bench_now();
+  for (i=REPC;i-->0;) sum+=crc32(0,src+1,c);
+  bench_report("zlib crc32",start,c);
+  start=bench_now();
+  for (i=REPC;i-->0;) sum+=png_adler32(1,src+1,c);
+  bench_report("png_adler32",start,c);
+  start=bench_now();
+  for (i=REPC;i-->0;) sum+=adler32(1,src+1,c);
+  bench_report("zlib adler32",start,c);
+  
+  // The decoder sees input in whatever pieces arrive; make sure small ones aren't much worse.
+  start=bench_now();
+  for (i=REPC;i-->0;) {
+    uint32_t crc=0;
+    int p=1;
+    for (;p<=c-PIECE;p+=PIECE) crc=png_crc32(crc,src+p,PIECE);
+    sum+=crc;
+  }
+  bench_report("png_crc32 in small pieces",start,c);
+  
+  free(src);
+  return sum==0xffffffff;
+}
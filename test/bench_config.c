@@ -0,0 +1,62 @@
+/* bench_config.c
+ * Parse generated configs of doubling size, and look up every face by name.
+ * Time per face should stay flat as the config grows.
+ * Usage: bench_config [MAXFACEC] [FRAMES_PER_FACE]
+ */
+
+#include "animaniac.h"
+#include <time.h>
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+static int bench_config(int facec,int framec) {
+  int srca=facec*(32+framec*24)+64,srcc=0;
+  char *src=malloc(srca);
+  if (!src) return -1;
+  int i=0;
+  for (;i<facec;i++) {
+    srcc+=sprintf(src+srcc,"[face%d]\n= rate 3f\n",i);
+    int k=0;
+    for (;k<framec;k++) srcc+=sprintf(src+srcc,"- %d %d 8 8\n",k*8,(i%100)*8);
+  }
+  struct an_animator *animator=an_animator_new();
+  if (!animator) return -1;
+  
+  double start=bench_now();
+  if (an_animator_set_config(animator,src,srcc,"bench")<0) return -1;
+  double parse=bench_now()-start;
+  
+  char name[32];
+  int namec;
+  start=bench_now();
+  for (i=0;i<facec;i++) {
+    namec=sprintf(name,"face%d",i);
+    if (an_animator_use_face_by_name(animator,name,namec)<0) return -1;
+  }
+  double byname=bench_now()-start;
+  
+  printf("%7d faces, %8d frames: parse %8.2f ms, %6.0f ns/face; by name %6.0f ns/face\n",
+    facec,facec*framec,parse*1000.0,parse*1000000000.0/facec,byname*1000000000.0/facec
+  );
+  an_animator_del(animator);
+  free(src);
+  return 0;
+}
+
+int main(int argc,char **argv) {
+  int maxfacec=(argc>=2)?atoi(argv[1]):128000;
+  int framec=(argc>=3)?atoi(argv[2]):4;
+  if (framec<1) framec=1;
+  int facec=1000;
+  for (;facec<=maxfacec;facec<<=1) {
+    if (bench_config(facec,framec)<0) {
+      fprintf(stderr,"bench_config: Failed at %d faces.\n",facec);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,230 @@
+/* bench_inflate.c
+ * Decompress the image data of some PNG files with zlib and with png_inflate, and compare.
+ * Usage: bench_inflate [PNGFILE...]
+ * With no files, we use etc/sprites.png and a generated sheet.
+ * etc/sprites.png is tiny and mostly flat, so it flatters whoever copies runs fastest; the generated one is closer to real art.
+ * Both sides reuse their state between reps: zlib through inflateReset(), and png_inflate through png_inflate_reset().
+ */
+
+#include "animaniac.h"
+#include <zlib.h>
+#include <time.h>
+
+#define REPC 20
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+/* Concatenate the file's IDAT chunks into a new buffer.
+ */
+
+static int bench_extract_idat(void *dstpp,const uint8_t *src,int srcc) {
+  if ((srcc<8)||memcmp(src,"\x89PNG\r\n\x1a\n",8)) return -1;
+  uint8_t *dst=malloc(srcc);
+  if (!dst) return -1;
+  int dstc=0,srcp=8;
+  while (srcp<=srcc-12) {
+    int len=(src[srcp]<<24)|(src[srcp+1]<<16)|(src[srcp+2]<<8)|src[srcp+3];
+    if ((len<0)||(len>srcc-srcp-12)) break;
+    if (!memcmp(src+srcp+4,"IDAT",4)) {
+      memcpy(dst+dstc,src+srcp+8,len);
+      dstc+=len;
+    }
+    srcp+=12+len;
+  }
+  *(void**)dstpp=dst;
+  return dstc;
+}
+
+/* Measure the decompressed stream with zlib, and leave it in a new buffer.
+ */
+
+static int bench_measure_raw(void *dstpp,const void *src,int srcc) {
+  z_stream z={0};
+  if (inflateInit(&z)<0) return -1;
+  int dsta=srcc*4+1024,dstc=0;
+  uint8_t *dst=malloc(dsta);
+  if (!dst) return -1;
+  z.next_in=(void*)src;
+  z.avail_in=srcc;
+  for (;;) {
+    if (dstc>=dsta) {
+      if (dsta>INT_MAX>>1) break;
+      void *nv=realloc(dst,dsta<<=1);
+      if (!nv) break;
+      dst=nv;
+    }
+    z.next_out=dst+dstc;
+    z.avail_out=dsta-dstc;
+    int err=inflate(&z,Z_NO_FLUSH);
+    dstc=dsta-z.avail_out;
+    if (err==Z_STREAM_END) {
+      inflateEnd(&z);
+      *(void**)dstpp=dst;
+      return dstc;
+    }
+    if ((err<0)&&(err!=Z_BUF_ERROR)) break;
+  }
+  inflateEnd(&z);
+  free(dst);
+  return -1;
+}
+
+/* Generate the image data of a 1024x1024 RGBA sheet: Tiles of noisy color with transparent margins, Sub-filtered, at zlib's default level.
+ */
+
+#define GEN_W 1024
+#define GEN_H 1024
+#define GEN_TILE 32
+
+static int bench_generate_idat(void *dstpp) {
+  int stride=GEN_W*4,rawc=(1+stride)*GEN_H;
+  uint8_t *raw=malloc(rawc),*row=malloc(stride);
+  if (!raw||!row) return -1;
+  uint32_t rng=0x2545f491;
+  uint8_t *dst=raw;
+  int y=0;
+  for (;y<GEN_H;y++) {
+    int x=0;
+    for (;x<GEN_W;x++) {
+      int tx=x/GEN_TILE,ty=y/GEN_TILE,dx=x%GEN_TILE-GEN_TILE/2,dy=y%GEN_TILE-GEN_TILE/2;
+      uint8_t *px=row+x*4;
+      rng^=rng<<13; rng^=rng>>17; rng^=rng<<5;
+      if (dx*dx+dy*dy>(GEN_TILE*GEN_TILE)/5) {
+        px[0]=px[1]=px[2]=px[3]=0;
+      } else {
+        int noise=rng&15;
+        px[0]=tx*37+dx+noise;
+        px[1]=ty*53+dy+noise;
+        px[2]=(tx^ty)*29+noise;
+        px[3]=0xff;
+      }
+    }
+    *(dst++)=1;
+    for (x=0;x<stride;x++) *(dst++)=row[x]-((x>=4)?row[x-4]:0);
+  }
+  free(row);
+  uLongf dstc=compressBound(rawc);
+  uint8_t *z=malloc(dstc);
+  if (!z||(compress2(z,&dstc,raw,rawc,Z_DEFAULT_COMPRESSION)!=Z_OK)) {
+    free(raw);
+    free(z);
+    return -1;
+  }
+  free(raw);
+  *(void**)dstpp=z;
+  return dstc;
+}
+
+/* Time both inflaters on one stream, and add to the totals.
+ */
+
+struct bench_totals {
+  double zlibtime,builtintime,bytes;
+};
+
+static int bench_stream(
+  struct bench_totals *totals,
+  z_stream *z,struct png_inflate *builtin,
+  const char *name,const void *idat,int idatc
+) {
+  void *raw=0;
+  int rawc=bench_measure_raw(&raw,idat,idatc);
+  if (rawc<0) {
+    fprintf(stderr,"%s: Failed to inflate.\n",name);
+    return -1;
+  }
+  uint8_t *dst=malloc(rawc+PNG_INFLATE_SLACK);
+  if (!dst) return -1;
+  
+  double start=bench_now();
+  int i=REPC;
+  for (;i-->0;) {
+    inflateReset(z);
+    z->next_in=(void*)idat;
+    z->avail_in=idatc;
+    z->next_out=dst;
+    z->avail_out=rawc;
+    if (inflate(z,Z_FINISH)!=Z_STREAM_END) {
+      fprintf(stderr,"%s: zlib failed.\n",name);
+      return -1;
+    }
+  }
+  double zlibtime=bench_now()-start;
+  
+  start=bench_now();
+  for (i=REPC;i-->0;) {
+    png_inflate_reset(builtin,dst,rawc);
+    if (png_inflate_provide(builtin,idat,idatc)!=1) {
+      fprintf(stderr,"%s: %s\n",name,png_inflate_get_message(builtin));
+      return -1;
+    }
+  }
+  double builtintime=bench_now()-start;
+  if ((png_inflate_get_output_size(builtin)!=rawc)||memcmp(dst,raw,rawc)) {
+    fprintf(stderr,"%s: Builtin inflate output differs from zlib.\n",name);
+    return -1;
+  }
+  
+  printf("%s: %d => %d bytes, zlib %.0f MB/s, builtin %.0f MB/s\n",
+    name,idatc,rawc,(double)rawc*REPC/zlibtime/1000000.0,(double)rawc*REPC/builtintime/1000000.0
+  );
+  totals->zlibtime+=zlibtime;
+  totals->builtintime+=builtintime;
+  totals->bytes+=(double)rawc*REPC;
+  free(dst);
+  free(raw);
+  return 0;
+}
+
+int main(int argc,char **argv) {
+  struct png_inflate *builtin=png_inflate_new();
+  if (!builtin) return 1;
+  z_stream z={0};
+  if (inflateInit(&z)!=Z_OK) return 1;
+  struct bench_totals totals={0};
+  void *idat=0;
+  int idatc,streamc=0;
+  
+  char *fallback[]={argv[0],"etc/sprites.png"};
+  if (argc<2) {
+    argc=2;
+    argv=fallback;
+    if ((idatc=bench_generate_idat(&idat))<0) return 1;
+    if (bench_stream(&totals,&z,builtin,"(generated sheet)",idat,idatc)<0) return 1;
+    free(idat);
+    streamc++;
+  }
+  
+  int argi=1;
+  for (;argi<argc;argi++) {
+    const char *path=argv[argi];
+    void *serial=0;
+    int serialc=an_file_read(&serial,path);
+    if (serialc<0) {
+      fprintf(stderr,"%s: Failed to read file.\n",path);
+      return 1;
+    }
+    idatc=bench_extract_idat(&idat,serial,serialc);
+    free(serial);
+    if (idatc<1) {
+      fprintf(stderr,"%s: No image data.\n",path);
+      return 1;
+    }
+    if (bench_stream(&totals,&z,builtin,path,idat,idatc)<0) return 1;
+    free(idat);
+    streamc++;
+  }
+  
+  if (streamc>1) {
+    printf("total: zlib %.0f MB/s, builtin %.0f MB/s\n",
+      totals.bytes/totals.zlibtime/1000000.0,totals.bytes/totals.builtintime/1000000.0
+    );
+  }
+  inflateEnd(&z);
+  png_inflate_del(builtin);
+  return 0;
+}
@@ -0,0 +1,55 @@
+/* bench_palette.c
+ * Throughput of INDEX to RGBA8 expansion at each depth, for each level the CPU supports.
+ * Usage: bench_palette [ROWC]
+ */
+
+#include "animaniac.h"
+#include <time.h>
+
+#define ROW_W 4096
+
+static double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+int main(int argc,char **argv) {
+  int rowc=(argc>=2)?atoi(argv[1]):20000;
+  if (rowc<1) rowc=1;
+  
+  // A full palette with a partial tRNS, so the table is doing real work.
+  struct png_image chunks={0};
+  uint8_t plte[768],trns[100];
+  int i=0;
+  for (;i<sizeof(plte);i++) plte[i]=i*37;
+  for (i=0;i<sizeof(trns);i++) trns[i]=i*5;
+  if (png_image_add_chunk_copy(&chunks,PNG_ID('P','L','T','E'),plte,sizeof(plte))<0) return 1;
+  if (png_image_add_chunk_copy(&chunks,PNG_ID('t','R','N','S'),trns,sizeof(trns))<0) return 1;
+  
+  uint8_t *src=malloc(ROW_W),*dst=malloc(ROW_W*4);
+  if (!src||!dst) return 1;
+  for (i=0;i<ROW_W;i++) src[i]=i*2654435761u>>13;
+  
+  int toplevel=png_convert_set_level(-1);
+  int level=PNG_CONVERT_LEVEL_SCALAR;
+  for (;level<=toplevel;level++) {
+    png_convert_set_level(level);
+    int depth=1;
+    for (;depth<=8;depth<<=1) {
+      struct png_converter converter;
+      if (png_converter_init(&converter,8,PNG_COLORTYPE_RGBA,depth,PNG_COLORTYPE_INDEX,&chunks)<0) return 1;
+      int w=ROW_W*8/depth;
+      if (w>ROW_W) w=ROW_W;
+      double start=bench_now();
+      for (i=rowc;i-->0;) png_convert_row(&converter,dst,src,w);
+      double elapsed=bench_now()-start;
+      printf("level %d, %d-bit: %.0f Mpx/s\n",level,depth,(double)w*rowc/elapsed/1000000.0);
+    }
+  }
+  
+  free(src);
+  free(dst);
+  png_image_cleanup(&chunks);
+  return 0;
+}